@@ -0,0 +1,167 @@
+import argparse
+import csv
+import glob
+import json
+import os
+import subprocess
+import sys
+import time
+
+# Sequential phases of the "Timing:" line; transfer and launch are the DPU parts of them (see PhaseTimes in dataset.h)
+SEQUENTIAL_PHASES = ['load', 'index', 'core', 'expansion', 'output']
+DPU_PHASES = ['transfer', 'launch']
+PHASES = SEQUENTIAL_PHASES[:4] + DPU_PHASES + SEQUENTIAL_PHASES[4:]
+# Phases counted as clustering for the points/sec rate
+CLUSTERING_PHASES = ['index', 'core', 'expansion']
+
+BINARIES = {
+    'cpu': 'dbscan_cpu',
+    'openmp': 'dbscan_cpu_openmp',
+    'pim': 'dbscan_pim_host',
+    'incremental': 'dbscan_incremental',
+}
+
+def parse_config(spec):
+    # "backend" or "backend:extra args", e.g. "cpu:-w 4" or "openmp:-m cells"
+    backend, _, args = spec.partition(':')
+    if backend not in BINARIES:
+        sys.exit(f"Unknown backend {backend!r}; expected one of {', '.join(BINARIES)}")
+    return backend, args.split()
+
+def run_once(bin_dir, backend, args, data_file, eps, min_pts, dpus, prefix):
+    binary = os.path.join(bin_dir, BINARIES[backend])
+    stdin = None
+    if backend == 'incremental':
+        # Every point of the file is inserted in one batch
+        command = [binary] + args + [str(eps), str(min_pts), prefix]
+        stdin = open(data_file)
+        result_file = f"{prefix}_result.txt"
+    elif backend == 'pim':
+        command = [binary] + args + [data_file, str(eps), str(min_pts), prefix, str(dpus)]
+        result_file = f"{prefix}_{dpus}_result.txt"
+    else:
+        command = [binary] + args + [data_file, str(eps), str(min_pts), prefix]
+        result_file = f"{prefix}_result.txt"
+
+    start = time.perf_counter()
+    try:
+        completed = subprocess.run(command, stdin=stdin, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+    finally:
+        if stdin:
+            stdin.close()
+    wall = time.perf_counter() - start
+    if completed.returncode != 0:
+        sys.exit(f"{' '.join(command)} failed:\n{completed.stderr}")
+    return parse_timing(result_file), wall
+
+def parse_timing(result_file):
+    with open(result_file) as f:
+        for line in f:
+            if line.startswith('Timing:'):
+                fields = dict(field.split('=') for field in line.split()[1:])
+                run = {'points': int(fields['points']), 'peak_rss_kb': int(fields['peak_rss_kb'])}
+                for phase in PHASES:
+                    run[phase] = None if fields[phase] == '-' else float(fields[phase])
+                return run
+    sys.exit(f"No Timing line in {result_file}")
+
+def percentile(values, p):
+    # Nearest-rank percentile, so p95 of few repeats is their maximum rather than an interpolation
+    ordered = sorted(values)
+    rank = max(1, -(-len(ordered) * p // 100))
+    return ordered[int(rank) - 1]
+
+def summarize(values):
+    values = [v for v in values if v is not None]
+    if not values:
+        return None
+    return {'median': percentile(values, 50), 'p95': percentile(values, 95), 'min': min(values), 'max': max(values)}
+
+def benchmark(bin_dir, spec, data_file, eps, min_pts, dpus, warmup, repeats, work_dir):
+    backend, args = parse_config(spec)
+    dataset = os.path.splitext(os.path.basename(data_file))[0]
+    prefix = os.path.join(work_dir, f"{backend}_{dataset}")
+    for _ in range(warmup):
+        run_once(bin_dir, backend, args, data_file, eps, min_pts, dpus, prefix)
+    runs = []
+    for _ in range(repeats):
+        run, wall = run_once(bin_dir, backend, args, data_file, eps, min_pts, dpus, prefix)
+        run['wall'] = wall
+        run['total'] = sum(run[phase] for phase in SEQUENTIAL_PHASES if run[phase] is not None)
+        run['clustering'] = sum(run[phase] for phase in CLUSTERING_PHASES if run[phase] is not None)
+        runs.append(run)
+
+    points = runs[0]['points']
+    clustering = summarize([run['clustering'] for run in runs])
+    return {
+        'dataset': dataset,
+        'config': spec,
+        'backend': backend,
+        'args': ' '.join(args),
+        'eps': eps,
+        'min_pts': min_pts,
+        'dpus': dpus if backend == 'pim' else None,
+        'points': points,
+        'warmup': warmup,
+        'repeats': repeats,
+        'phases': {phase: summarize([run[phase] for run in runs]) for phase in PHASES},
+        'total': summarize([run['total'] for run in runs]),
+        'wall': summarize([run['wall'] for run in runs]),
+        'peak_rss_kb': max(run['peak_rss_kb'] for run in runs),
+        'points_per_sec': points / clustering['median'] if clustering['median'] > 0 else None,
+        'runs': runs,
+    }
+
+def write_csv(records, csv_file):
+    columns = ['dataset', 'config', 'backend', 'args', 'points', 'repeats']
+    for name in PHASES + ['total', 'wall']:
+        columns += [f'{name}_median', f'{name}_p95']
+    columns += ['peak_rss_kb', 'points_per_sec']
+    with open(csv_file, 'w', newline='') as f:
+        writer = csv.writer(f)
+        writer.writerow(columns)
+        for record in records:
+            row = [record[c] for c in columns[:6]]
+            for name in PHASES + ['total', 'wall']:
+                stats = record['phases'][name] if name in PHASES else record[name]
+                row += [stats['median'], stats['p95']] if stats else ['', '']
+            row += [record['peak_rss_kb'], record['points_per_sec']]
+            writer.writerow(row)
+
+def main():
+    parser = argparse.ArgumentParser(description='Times every phase of the DBSCAN programs over repeated runs.')
+    parser.add_argument('datasets', nargs='*', help='point files (default: every data/*.csv but the labels)')
+    parser.add_argument('-b', '--backends', nargs='+', default=['cpu'],
+                        help='configurations "backend[:args]", backend one of ' + ', '.join(BINARIES))
+    parser.add_argument('-w', '--warmup', type=int, default=1, help='untimed runs before the repeats')
+    parser.add_argument('-n', '--repeats', type=int, default=5, help='timed runs of each configuration')
+    parser.add_argument('--eps', type=int, default=9)
+    parser.add_argument('--min-pts', type=int, default=20)
+    parser.add_argument('--dpus', type=int, default=64, help='DPUs for the pim backend')
+    parser.add_argument('--bin-dir', default='./bin')
+    parser.add_argument('-o', '--output', default='./results/benchmark',
+                        help='prefix of the .json and .csv summaries; labels of the runs go to <prefix>_runs/')
+    options = parser.parse_args()
+
+    datasets = options.datasets or sorted(f for f in glob.glob('./data/*.csv') if not f.endswith('_labels.csv'))
+    work_dir = f"{options.output}_runs"
+    os.makedirs(work_dir, exist_ok=True)
+
+    records = []
+    for data_file in datasets:
+        for spec in options.backends:
+            record = benchmark(options.bin_dir, spec, data_file, options.eps, options.min_pts, options.dpus,
+                               options.warmup, options.repeats, work_dir)
+            records.append(record)
+            total = record['total']
+            rate = f"{record['points_per_sec']:.0f}" if record['points_per_sec'] else '-'
+            print(f"{record['dataset']} [{spec}]: total {total['median']:.4f} s median, {total['p95']:.4f} s p95, "
+                  f"{rate} points/s, peak RSS {record['peak_rss_kb'] // 1024} MB")
+
+    with open(f"{options.output}.json", 'w') as f:
+        json.dump(records, f, indent=2)
+    write_csv(records, f"{options.output}.csv")
+    print(f"Benchmark saved to {options.output}.json and {options.output}.csv")
+
+if __name__ == "__main__":
+    main()
@@ -2,9 +2,15 @@ import sys
 import numpy as np
 from sklearn.metrics import adjusted_rand_score
 
+def load_labels(labels_file):
+    # .bin label files (dbscan_* -o binary|mmap) are raw native-endian int32 values
+    if labels_file.endswith(".bin"):
+        return np.fromfile(labels_file, dtype=np.int32)
+    return np.loadtxt(labels_file)
+
 def calculate_ari(true_labels_file, pred_labels_file):
-    true_labels = np.loadtxt(true_labels_file)
-    pred_labels = np.loadtxt(pred_labels_file)
+    true_labels = load_labels(true_labels_file)
+    pred_labels = load_labels(pred_labels_file)
     
     ari = adjusted_rand_score(true_labels, pred_labels)
     return ari
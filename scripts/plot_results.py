@@ -43,6 +43,35 @@ def plot_results(data_file, labels_file, result_file, output_file):
 
     print(f"Plot saved as {output_file}")
 
+def plot_benchmark(benchmark_file, output_file):
+    # Median time of each phase per configuration, one panel per dataset (benchmark.csv from scripts/benchmark.py)
+    bench = pd.read_csv(benchmark_file)
+    phases = ['load', 'index', 'core', 'expansion', 'output']
+    datasets = bench['dataset'].unique()
+    fig, axes = plt.subplots(len(datasets), 1, figsize=(12, 3 + 0.5 * len(bench)), squeeze=False)
+
+    for ax, dataset in zip(axes[:, 0], datasets):
+        rows = bench[bench['dataset'] == dataset]
+        left = [0.0] * len(rows)
+        for phase, color in zip(phases, sns.color_palette('deep', len(phases))):
+            widths = rows[f'{phase}_median'].fillna(0).tolist()
+            ax.barh(rows['config'], widths, left=left, color=color, label=phase)
+            left = [l + w for l, w in zip(left, widths)]
+        # Whiskers at the p95 of the summed phases
+        ax.errorbar(rows['total_median'], rows['config'], xerr=[[0] * len(rows), rows['total_p95'] - rows['total_median']],
+                    fmt='none', ecolor='black', capsize=3)
+        for y, (total, rate) in enumerate(zip(rows['total_median'], rows['points_per_sec'])):
+            ax.text(total, y, f'  {rate / 1e6:.2f} M points/s', va='center', fontsize=9)
+        ax.set_title(f'{dataset} ({rows["points"].iloc[0]} points)')
+        ax.set_xlabel('Median time (seconds)')
+        ax.legend(bbox_to_anchor=(1.05, 1), loc='upper left')
+
+    plt.tight_layout()
+    plt.savefig(output_file, dpi=300, bbox_inches='tight')
+    plt.close()
+
+    print(f"Plot saved as {output_file}")
+
 def main():
     data_dir = './data'
     results_dir = './results'
@@ -66,5 +95,9 @@ def main():
                 else:
                     print(f"Warning: Required files for {dataset} {implementation} not found. Skipping.")
 
+    benchmark_file = os.path.join(results_dir, 'benchmark.csv')
+    if os.path.exists(benchmark_file):
+        plot_benchmark(benchmark_file, os.path.join(plots_dir, 'benchmark_phases.png'))
+
 if __name__ == "__main__":
     main()
\ No newline at end of file
@@ -22,10 +22,8 @@ for DATASET in "${DATASETS[@]}"; do
   echo "Processing dataset: $DATASET"
   for dpus in 64 128 256 512 1024; do
     echo "Running with $dpus DPUs"
-    sudo LD_LIBRARY_PATH=$LD_LIBRARY_PATH $BIN_DIR/dbscan_pim_host $DATA_DIR/${DATASET}.csv $EPS $MIN_PTS "${RESULTS_DIR}/pim_${DATASET}" ${dpus}
+    sudo LD_LIBRARY_PATH=$LD_LIBRARY_PATH $BIN_DIR/dbscan_pim_host -e $DATA_DIR/${DATASET}_labels.csv $DATA_DIR/${DATASET}.csv $EPS $MIN_PTS "${RESULTS_DIR}/pim_${DATASET}" ${dpus}
     sudo chown $USER:$USER "${RESULTS_DIR}/pim_${DATASET}_${dpus}_labels.txt"
     sudo chown $USER:$USER "${RESULTS_DIR}/pim_${DATASET}_${dpus}_result.txt"
-    ari=$(python3 scripts/calculate_ari.py "$DATA_DIR/${DATASET}_labels.csv" "${RESULTS_DIR}/pim_${DATASET}_${dpus}_labels.txt")
-    echo "PIM ARI: $ari" >> "${RESULTS_DIR}/pim_${DATASET}_${dpus}_result.txt"
   done
 done
\ No newline at end of file
@@ -16,6 +16,7 @@ MIN_PTS=20
 RUN_CPU=0
 RUN_OPENMP=0
 RUN_PIM=0
+MAX_WORKERS=0
 
 # Parse command line arguments
 while [[ "$#" -gt 0 ]]; do
@@ -23,13 +24,14 @@ while [[ "$#" -gt 0 ]]; do
         -c|--cpu) RUN_CPU=1 ;;
         -o|--openmp) RUN_OPENMP=1 ;;
         -p|--pim) RUN_PIM=1 ;;
+        -w|--workers) MAX_WORKERS=$2; shift ;;
         *) echo "Unknown parameter passed: $1"; exit 1 ;;
     esac
     shift
 done
 
 # If no options selected, run all versions
-if [[ $RUN_CPU -eq 0 && $RUN_OPENMP -eq 0 && $RUN_PIM -eq 0 ]]; then
+if [[ $RUN_CPU -eq 0 && $RUN_OPENMP -eq 0 && $RUN_PIM -eq 0 && $MAX_WORKERS -eq 0 ]]; then
     RUN_CPU=1
     RUN_OPENMP=1
     RUN_PIM=1
@@ -54,33 +56,39 @@ for data_file in $DATA_DIR/*.csv; do
         if [[ $RUN_OPENMP -eq 1 ]]; then
             # OpenMP version
             echo "Running OpenMP version..."
-            $BIN_DIR/dbscan_cpu_openmp "$data_file" $EPS $MIN_PTS "$RESULTS_DIR/openmp_${dataset}"
-            # Calculate ARI
-            ari=$(python3 scripts/calculate_ari.py "$labels_file" "${RESULTS_DIR}/openmp_${dataset}_labels.txt")
-            echo "OpenMP ARI: $ari" >> "${RESULTS_DIR}/openmp_${dataset}_result.txt"
+            # ARI/NMI are computed by the program itself (-e) and end the result file
+            $BIN_DIR/dbscan_cpu_openmp -e "$labels_file" "$data_file" $EPS $MIN_PTS "$RESULTS_DIR/openmp_${dataset}"
         fi
         
         if [[ $RUN_PIM -eq 1 ]]; then
             # PIM version
             echo "Running PIM version..."
-            sudo LD_LIBRARY_PATH=$LD_LIBRARY_PATH $BIN_DIR/dbscan_pim_host "$data_file" $EPS $MIN_PTS "$RESULTS_DIR/pim_${dataset}" 1024
+            sudo LD_LIBRARY_PATH=$LD_LIBRARY_PATH $BIN_DIR/dbscan_pim_host -e "$labels_file" "$data_file" $EPS $MIN_PTS "$RESULTS_DIR/pim_${dataset}" 1024
             
             # Change permissions of the output files
             sudo chown $USER:$USER "${RESULTS_DIR}/pim_${dataset}_1024_labels.txt"
             sudo chown $USER:$USER "${RESULTS_DIR}/pim_${dataset}_1024_result.txt"
-            
-            # Calculate ARI
-            ari=$(python3 scripts/calculate_ari.py "$labels_file" "${RESULTS_DIR}/pim_${dataset}_1024_labels.txt")
-            echo "PIM ARI: $ari" >> "${RESULTS_DIR}/pim_${dataset}_1024_result.txt"
         fi
         
         if [[ $RUN_CPU -eq 1 ]]; then
             # CPU version
             echo "Running CPU version..."
-            $BIN_DIR/dbscan_cpu "$data_file" $EPS $MIN_PTS "$RESULTS_DIR/cpu_${dataset}"
-            # Calculate ARI
-            ari=$(python3 scripts/calculate_ari.py "$labels_file" "${RESULTS_DIR}/cpu_${dataset}_labels.txt")
-            echo "CPU ARI: $ari" >> "${RESULTS_DIR}/cpu_${dataset}_result.txt"
+            $BIN_DIR/dbscan_cpu -e "$labels_file" "$data_file" $EPS $MIN_PTS "$RESULTS_DIR/cpu_${dataset}"
+        fi
+        if [[ $MAX_WORKERS -gt 0 ]]; then
+            # Sharded CPU version with 1, 2, 4, ... workers up to MAX_WORKERS; speedup is against 1 worker
+            echo "Running sharded CPU version (scaling up to $MAX_WORKERS workers)..."
+            scaling_file="$RESULTS_DIR/sharded_${dataset}_scaling.csv"
+            echo "workers,seconds,speedup" > "$scaling_file"
+            workers=1
+            while [[ $workers -le $MAX_WORKERS ]]; do
+                $BIN_DIR/dbscan_cpu -w $workers "$data_file" $EPS $MIN_PTS "$RESULTS_DIR/sharded_${dataset}_w${workers}"
+                seconds=$(awk '/^DBSCAN completed in/ {print $4}' "$RESULTS_DIR/sharded_${dataset}_w${workers}_result.txt")
+                [[ $workers -eq 1 ]] && base_seconds=$seconds
+                echo "$workers,$seconds,$(awk -v a="$base_seconds" -v b="$seconds" 'BEGIN {printf "%.2f", a / b}')" >> "$scaling_file"
+                [[ $workers -lt $MAX_WORKERS && $((workers * 2)) -gt $MAX_WORKERS ]] && workers=$MAX_WORKERS || workers=$((workers * 2))
+            done
+            cat "$scaling_file"
         fi
         echo "Finished experiments for $dataset dataset"
         echo "----------------------------------------"
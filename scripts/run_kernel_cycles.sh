@@ -0,0 +1,26 @@
+#!/bin/bash
+# DPU kernel cycle 측정: dense / sparse dataset에서 PIM 버전을 실행하고 kernel cycle을 모은다.
+# 이전 kernel과 비교하려면 그 버전을 다른 디렉터리에 빌드한 뒤 BIN_DIR로 지정한다.
+#   BIN_DIR=./bin_before TAG=before ./scripts/run_kernel_cycles.sh
+
+BIN_DIR=${BIN_DIR:-"./bin"}
+DATA_DIR="./data"
+RESULTS_DIR="./results/cycles"
+TAG=${TAG:-"after"}
+DPUS=${DPUS:-64}
+
+EPS=9
+MIN_PTS=20
+
+# dense: 적은 수의 군집에 점이 몰려 있어 query마다 이웃이 많다. sparse: 이웃이 거의 없다.
+DENSE_DATASET=${DENSE_DATASET:-"blobs_262144_3clusters_2d"}
+SPARSE_DATASET=${SPARSE_DATASET:-"custom_262144_2d"}
+
+mkdir -p $RESULTS_DIR
+
+for DATASET in "$DENSE_DATASET" "$SPARSE_DATASET"; do
+  prefix="${RESULTS_DIR}/${TAG}_${DATASET}"
+  sudo LD_LIBRARY_PATH=$LD_LIBRARY_PATH $BIN_DIR/dbscan_pim_host $DATA_DIR/${DATASET}.csv $EPS $MIN_PTS "$prefix" $DPUS
+  sudo chown $USER:$USER "${prefix}_${DPUS}_labels.txt" "${prefix}_${DPUS}_result.txt"
+  echo "$TAG $DATASET: $(grep 'DPU kernel cycles' "${prefix}_${DPUS}_result.txt")"
+done
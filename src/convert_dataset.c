@@ -0,0 +1,111 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dataset.h"
+
+// Converts a CSV point file into the binary point format (see dataset.h) that the DBSCAN programs mmap.
+
+void usage(const char *prog) {
+  printf("Usage: %s [-t int32|int16] <input_csv> <output_file>\n", prog);
+  printf("  -t  coordinate type; int16 halves the file but needs every coordinate in [-32768, 32767]\n");
+  printf("      (default: int32, which the programs use without copying)\n");
+}
+
+int main(int argc, char *argv[]) {
+  int coord_type = COORD_INT32;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:")) != -1) {
+    switch (opt) {
+    case 't':
+      if (strcmp(optarg, "int32") == 0) {
+        coord_type = COORD_INT32;
+      } else if (strcmp(optarg, "int16") == 0) {
+        coord_type = COORD_INT16;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 2) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  uint32_t n_points;
+  int dimensions;
+  int32_t *coords = load_points_csv(argv[optind], 0, &n_points, &dimensions);
+  if (!coords)
+    return 1;
+
+  DatasetHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, DATASET_MAGIC, sizeof(header.magic));
+  header.version = DATASET_VERSION;
+  header.dimensions = (uint32_t)dimensions;
+  header.n_points = n_points;
+  header.coord_type = (uint32_t)coord_type;
+  header.flags = DATASET_HAS_BOX;
+  header.data_offset = (sizeof(DatasetHeader) + 63) & ~(uint64_t)63;
+  size_t n_values = (size_t)n_points * dimensions;
+  for (int k = 0; k < dimensions; k++) {
+    header.box_min[k] = INT32_MAX;
+    header.box_max[k] = INT32_MIN;
+  }
+  for (size_t v = 0; v < n_values; v++) {
+    int k = (int)(v % dimensions);
+    header.box_min[k] = coords[v] < header.box_min[k] ? coords[v] : header.box_min[k];
+    header.box_max[k] = coords[v] > header.box_max[k] ? coords[v] : header.box_max[k];
+  }
+  if (coord_type == COORD_INT16) {
+    for (int k = 0; k < dimensions; k++) {
+      if (header.box_min[k] < INT16_MIN || header.box_max[k] > INT16_MAX) {
+        fprintf(stderr, "Coordinate %d spans [%d, %d], which does not fit in int16; use -t int32\n", k,
+                header.box_min[k], header.box_max[k]);
+        free(coords);
+        return 1;
+      }
+    }
+  }
+
+  FILE *out = fopen(argv[optind + 1], "wb");
+  if (!out) {
+    perror("Error opening output file");
+    free(coords);
+    return 1;
+  }
+  static const uint8_t padding[64];
+  int ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+           fwrite(padding, 1, header.data_offset - sizeof(header), out) == header.data_offset - sizeof(header);
+  if (ok && coord_type == COORD_INT16) {
+    int16_t buffer[4096];
+    for (size_t v = 0; v < n_values && ok; v += 4096) {
+      size_t chunk = n_values - v < 4096 ? n_values - v : 4096;
+      for (size_t j = 0; j < chunk; j++)
+        buffer[j] = (int16_t)coords[v + j];
+      ok = fwrite(buffer, sizeof(int16_t), chunk, out) == chunk;
+    }
+  } else if (ok) {
+    ok = fwrite(coords, sizeof(int32_t), n_values, out) == n_values;
+  }
+  if (fclose(out) != 0)
+    ok = 0;
+  free(coords);
+  if (!ok) {
+    perror("Error writing output file");
+    return 1;
+  }
+
+  printf("Wrote %u %d-dimensional points (%s) to %s\n", n_points, dimensions,
+         coord_type == COORD_INT16 ? "int16" : "int32", argv[optind + 1]);
+  return 0;
+}
@@ -0,0 +1,121 @@
+#define _DEFAULT_SOURCE // syscall
+
+#include "counters.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(DBSCAN_COUNTERS) && defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#define HAVE_PERF_EVENTS
+#endif
+
+HotCounters hot_counters;
+
+void add_counters(HotCounters *a, const HotCounters *b) {
+  a->distance_evaluations += b->distance_evaluations;
+  a->core_tests += b->core_tests;
+  a->region_queries += b->region_queries;
+  a->neighbors_returned += b->neighbors_returned;
+  a->neighbors_new += b->neighbors_new;
+  a->vector_growths += b->vector_growths;
+  a->bytes_to_dpu += b->bytes_to_dpu;
+  a->bytes_from_dpu += b->bytes_from_dpu;
+}
+
+#ifdef HAVE_PERF_EVENTS
+// User-space events only, so that a perf_event_paranoid of 2 still allows them; inherited by forked workers.
+static int open_event(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+void start_hardware_counters(HardwareCounters *h) {
+  memset(h, 0, sizeof(*h));
+#ifdef HAVE_PERF_EVENTS
+  static const uint64_t configs[NR_HW_EVENTS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES};
+  for (int e = 0; e < NR_HW_EVENTS; e++) {
+    h->fds[e] = open_event(PERF_TYPE_HARDWARE, configs[e]);
+    if (h->fds[e] < 0)
+      h->errors[e] = errno;
+  }
+  for (int e = 0; e < NR_HW_EVENTS; e++) {
+    if (h->fds[e] >= 0) {
+      ioctl(h->fds[e], PERF_EVENT_IOC_RESET, 0);
+      ioctl(h->fds[e], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+#else
+  for (int e = 0; e < NR_HW_EVENTS; e++) {
+    h->fds[e] = -1;
+    h->errors[e] = ENOSYS;
+  }
+#endif
+}
+
+void stop_hardware_counters(HardwareCounters *h) {
+#ifdef HAVE_PERF_EVENTS
+  for (int e = 0; e < NR_HW_EVENTS; e++) {
+    if (h->fds[e] < 0)
+      continue;
+    ioctl(h->fds[e], PERF_EVENT_IOC_DISABLE, 0);
+    errno = 0;
+    if (read(h->fds[e], &h->values[e], sizeof(uint64_t)) != sizeof(uint64_t))
+      h->errors[e] = errno ? errno : EIO;
+    close(h->fds[e]);
+    h->fds[e] = -1;
+  }
+#else
+  (void)h;
+#endif
+}
+
+void print_counters(FILE *out, const HardwareCounters *h, int dpu) {
+#ifdef DBSCAN_COUNTERS
+  const HotCounters *c = &hot_counters;
+  fprintf(out, "Counters:");
+  if (!dpu)
+    fprintf(out, " distance evaluations %llu, core tests %llu,", (unsigned long long)c->distance_evaluations,
+            (unsigned long long)c->core_tests);
+  fprintf(out, " region queries %llu, neighbors returned %llu, newly visited %llu, vector growths %llu",
+          (unsigned long long)c->region_queries, (unsigned long long)c->neighbors_returned,
+          (unsigned long long)c->neighbors_new, (unsigned long long)c->vector_growths);
+  if (dpu)
+    fprintf(out, ", bytes to DPUs %llu, from DPUs %llu", (unsigned long long)c->bytes_to_dpu,
+            (unsigned long long)c->bytes_from_dpu);
+  fprintf(out, "\n");
+  // Events that could not be counted are marked one by one; the line stays short when none could.
+  static const char *names[NR_HW_EVENTS] = {"cycles", "LLC misses"};
+  int failed = 0;
+  for (int e = 0; e < NR_HW_EVENTS; e++)
+    failed += (h->errors[e] != 0);
+  if (failed == NR_HW_EVENTS && h->errors[HW_LLC_MISSES] == h->errors[HW_CYCLES]) {
+    fprintf(out, "Hardware counters: unavailable (%s)\n", strerror(h->errors[HW_CYCLES]));
+    return;
+  }
+  fprintf(out, "Hardware counters:");
+  for (int e = 0; e < NR_HW_EVENTS; e++) {
+    if (h->errors[e])
+      fprintf(out, "%s %s unavailable (%s)", e ? "," : "", names[e], strerror(h->errors[e]));
+    else
+      fprintf(out, "%s %llu %s", e ? "," : "", (unsigned long long)h->values[e], names[e]);
+  }
+  fprintf(out, " during clustering\n");
+#else
+  (void)out;
+  (void)h;
+  (void)dpu;
+#endif
+}
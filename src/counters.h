@@ -0,0 +1,58 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+// Hot-path event counters for dbscan_cpu and dbscan_pim_host. They are compiled in only with make COUNTERS=1
+// (-DDBSCAN_COUNTERS); otherwise COUNT() expands to nothing and the hot loops are unchanged. With the counters
+// compiled in, the CPU cycles and last-level cache misses of the clustering are also read through perf_event_open
+// where the kernel allows it.
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct {
+  uint64_t distance_evaluations; // candidates in the searched cells (a core count may stop before the last one)
+  uint64_t core_tests;           // neighbour counts that decide whether a point is core
+  uint64_t region_queries;       // queries whose neighbours are collected
+  uint64_t neighbors_returned;   // neighbours those queries found
+  uint64_t neighbors_new;        // of which not yet visited, and so added to the search
+  uint64_t vector_growths;       // reallocations of the neighbour vector
+  uint64_t bytes_to_dpu;
+  uint64_t bytes_from_dpu;
+} HotCounters;
+
+extern HotCounters hot_counters;
+
+#ifdef DBSCAN_COUNTERS
+#define COUNT(field, n) (hot_counters.field += (n))
+#else
+#define COUNT(field, n) ((void)0)
+#endif
+
+// Adds the counters of b (e.g. from a worker process) to a.
+void add_counters(HotCounters *a, const HotCounters *b);
+
+enum {
+  HW_CYCLES = 0,
+  HW_LLC_MISSES = 1,
+  NR_HW_EVENTS = 2,
+};
+
+// Hardware events of this process and of the children it starts after start_hardware_counters. Each event is opened
+// and read on its own, so one the PMU or VM does not expose leaves the others usable.
+typedef struct {
+  int fds[NR_HW_EVENTS];         // -1 if not open
+  int errors[NR_HW_EVENTS];      // errno of the failed open or read, 0 if values[e] is valid
+  uint64_t values[NR_HW_EVENTS];
+} HardwareCounters;
+
+// Opens and starts the events; does nothing unless the counters are compiled in. Failures are recorded per event in
+// h->errors and are not fatal.
+void start_hardware_counters(HardwareCounters *h);
+void stop_hardware_counters(HardwareCounters *h);
+
+// Writes the "Counters:" and "Hardware counters:" lines of a result file; nothing unless the counters are compiled in.
+// Counters that do not apply to the program (DPU bytes on the CPU, distance evaluations done on the DPUs) are left
+// out by passing dpu as 0 or 1.
+void print_counters(FILE *out, const HardwareCounters *h, int dpu);
+
+#endif
@@ -0,0 +1,835 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "dataset.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIN_CHUNK_BYTES (1u << 20) // smaller files are not worth splitting further
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline int is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+// Parses an optionally signed decimal integer at p (stopping at end). Returns the position after it, or NULL if
+// there is no integer or it does not fit in int32.
+static inline const char *parse_int(const char *p, const char *end, int32_t *value) {
+  int negative = 0;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    p++;
+  }
+  const char *digits = p;
+  int64_t v = 0;
+  while (p < end && (unsigned)(*p - '0') < 10) {
+    v = v * 10 + (*p - '0');
+    if (v > (int64_t)INT32_MAX + 1)
+      return NULL;
+    p++;
+  }
+  if (p == digits)
+    return NULL;
+  v = negative ? -v : v;
+  if (v > INT32_MAX)
+    return NULL;
+  *value = (int32_t)v;
+  return p;
+}
+
+// Parses the line at p into up to max_columns values of out. Returns the number of columns and sets *next to the
+// start of the following line, or returns -1 if the line is malformed or has more than max_columns columns.
+static int parse_row(const char *p, const char *end, int32_t *out, int max_columns, const char **next) {
+  int columns = 0;
+  while (1) {
+    while (p < end && (*p == ' ' || *p == '\t'))
+      p++;
+    if (columns == max_columns || !(p = parse_int(p, end, &out[columns])))
+      return -1;
+    columns++;
+    while (p < end && (*p == ' ' || *p == '\t'))
+      p++;
+    if (p == end || *p != ',')
+      break;
+    p++;
+  }
+  if (p < end && *p == '\r')
+    p++;
+  if (p < end && *p++ != '\n')
+    return -1;
+  *next = p;
+  return columns;
+}
+
+// Skips blank lines from p and returns the start of the next line with content, or end.
+static inline const char *skip_blank_lines(const char *p, const char *end) {
+  while (p < end) {
+    const char *q = p;
+    while (q < end && is_blank(*q))
+      q++;
+    if (q < end && *q != '\n')
+      return p;
+    p = q + 1;
+  }
+  return end;
+}
+
+// Line number (from 0) of position pos, for error messages.
+static uint64_t count_lines(const char *text, const char *pos) {
+  uint64_t lines = 0;
+  for (const char *p = text; (p = memchr(p, '\n', (size_t)(pos - p))) != NULL; p++)
+    lines++;
+  return lines;
+}
+
+// One slice of the file; each thread counts, then parses, the lines that start inside its slice.
+typedef struct {
+  const char *begin, *end;
+  int dims;
+  uint64_t rows;      // lines with content
+  int32_t *out;       // where this slice's first point goes
+  const char *error;  // first malformed line, if any
+} CsvChunk;
+
+static void *count_chunk(void *arg) {
+  CsvChunk *chunk = (CsvChunk *)arg;
+  const char *p = chunk->begin;
+  uint64_t rows = 0;
+  while ((p = skip_blank_lines(p, chunk->end)) < chunk->end) {
+    rows++;
+    const char *nl = memchr(p, '\n', (size_t)(chunk->end - p));
+    p = nl ? nl + 1 : chunk->end;
+  }
+  chunk->rows = rows;
+  return NULL;
+}
+
+static void *parse_chunk(void *arg) {
+  CsvChunk *chunk = (CsvChunk *)arg;
+  const char *p = chunk->begin;
+  int32_t *out = chunk->out;
+  while ((p = skip_blank_lines(p, chunk->end)) < chunk->end) {
+    const char *line = p;
+    if (parse_row(line, chunk->end, out, chunk->dims, &p) != chunk->dims) {
+      chunk->error = line;
+      return NULL;
+    }
+    out += chunk->dims;
+  }
+  return NULL;
+}
+
+void run_tasks(void *tasks, size_t task_size, int n_tasks, void *(*fn)(void *)) {
+  pthread_t *threads = (pthread_t *)malloc(n_tasks * sizeof(pthread_t));
+  int *started = (int *)calloc(n_tasks, sizeof(int));
+  for (int t = 1; t < n_tasks; t++) {
+    void *task = (char *)tasks + t * task_size;
+    if (threads && started && pthread_create(&threads[t], NULL, fn, task) == 0)
+      started[t] = 1;
+    else
+      fn(task);
+  }
+  fn(tasks);
+  for (int t = 1; t < n_tasks; t++) {
+    if (started && started[t])
+      pthread_join(threads[t], NULL);
+  }
+  free(threads);
+  free(started);
+}
+
+int thread_count(int n_threads, size_t work, size_t min_work) {
+  if (n_threads <= 0)
+    n_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_threads < 1)
+    n_threads = 1;
+  if ((size_t)n_threads > work / min_work + 1)
+    n_threads = (int)(work / min_work + 1);
+  return n_threads;
+}
+
+// Parses a mapped CSV: the dimension comes from the first line, the file is cut into one slice per thread at line
+// boundaries, the threads count their lines, a prefix sum of the counts gives each slice its place in the output,
+// and the threads then parse straight into it. The points keep the file order.
+static int32_t *parse_csv(const char *path, const char *text, size_t size, int n_threads, uint32_t *n_points,
+                          int *dimensions, int *threads_used) {
+  const char *end = text + size;
+  const char *first = skip_blank_lines(text, end);
+  if (first == end) {
+    fprintf(stderr, "%s: no points\n", path);
+    return NULL;
+  }
+  int32_t row[MAX_DIMENSIONS];
+  const char *next;
+  int dims = parse_row(first, end, row, MAX_DIMENSIONS, &next);
+  if (dims < 0) {
+    fprintf(stderr, "%s:%llu: expected 1 to %d integer columns\n", path,
+            (unsigned long long)(1 + count_lines(text, first)), MAX_DIMENSIONS);
+    return NULL;
+  }
+
+  n_threads = thread_count(n_threads, size, MIN_CHUNK_BYTES);
+  CsvChunk *chunks = (CsvChunk *)calloc(n_threads, sizeof(CsvChunk));
+  if (!chunks) {
+    fprintf(stderr, "Failed to allocate memory for points\n");
+    return NULL;
+  }
+  // Slice t starts after the first newline at or after its even share of the bytes.
+  for (int t = 0; t < n_threads; t++) {
+    size_t cut = size * t / n_threads;
+    const char *begin = text;
+    if (t > 0) {
+      const char *nl = memchr(text + cut - 1, '\n', size - cut + 1);
+      begin = nl ? nl + 1 : end;
+      begin = begin < chunks[t - 1].begin ? chunks[t - 1].begin : begin;
+      chunks[t - 1].end = begin;
+    }
+    chunks[t].begin = begin;
+    chunks[t].end = end;
+    chunks[t].dims = dims;
+  }
+
+  run_tasks(chunks, sizeof(CsvChunk), n_threads, count_chunk);
+  uint64_t total = 0;
+  for (int t = 0; t < n_threads; t++)
+    total += chunks[t].rows;
+  int32_t *coords = NULL;
+  if (total > UINT32_MAX)
+    fprintf(stderr, "%s: too many points\n", path);
+  else if (!(coords = (int32_t *)malloc(total * dims * sizeof(int32_t))))
+    fprintf(stderr, "Failed to allocate memory for points\n");
+  if (!coords) {
+    free(chunks);
+    return NULL;
+  }
+  uint64_t offset = 0;
+  for (int t = 0; t < n_threads; t++) {
+    chunks[t].out = coords + offset * dims;
+    offset += chunks[t].rows;
+  }
+
+  run_tasks(chunks, sizeof(CsvChunk), n_threads, parse_chunk);
+  for (int t = 0; t < n_threads; t++) {
+    if (chunks[t].error) {
+      fprintf(stderr, "%s:%llu: expected %d integer columns\n", path,
+              (unsigned long long)(1 + count_lines(text, chunks[t].error)), dims);
+      free(coords);
+      free(chunks);
+      return NULL;
+    }
+  }
+  free(chunks);
+  *n_points = (uint32_t)total;
+  *dimensions = dims;
+  *threads_used = n_threads;
+  return coords;
+}
+
+// Maps a file read-only. An empty file maps to NULL with *size 0.
+static int map_file(const char *path, void **mapping, size_t *size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror("Error opening data file");
+    return 0;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    perror("Error opening data file");
+    close(fd);
+    return 0;
+  }
+  *size = (size_t)st.st_size;
+  *mapping = NULL;
+  if (*size > 0) {
+    *mapping = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (*mapping == MAP_FAILED) {
+      perror("Error mapping data file");
+      close(fd);
+      return 0;
+    }
+  }
+  close(fd);
+  return 1;
+}
+
+int32_t *load_points_csv(const char *path, int n_threads, uint32_t *n_points, int *dimensions) {
+  void *mapping;
+  size_t size;
+  int threads_used;
+  if (!map_file(path, &mapping, &size))
+    return NULL;
+  int32_t *coords = parse_csv(path, (const char *)mapping, size, n_threads, n_points, dimensions, &threads_used);
+  if (mapping)
+    munmap(mapping, size);
+  return coords;
+}
+
+// Checks a binary point file header against the size of the file. Returns 0 after printing the reason if the file
+// cannot be read as one.
+static int check_header(const char *path, const DatasetHeader *header, size_t file_size) {
+  if (file_size < sizeof(DatasetHeader)) {
+    fprintf(stderr, "%s: truncated point file header\n", path);
+    return 0;
+  }
+  size_t coord_size = header->coord_type == COORD_INT16 ? sizeof(int16_t) : sizeof(int32_t);
+  if (header->version != DATASET_VERSION || header->dimensions < 1 || header->dimensions > MAX_DIMENSIONS ||
+      header->n_points == 0 || header->n_points > UINT32_MAX ||
+      (header->coord_type != COORD_INT32 && header->coord_type != COORD_INT16) || header->data_offset % 64 ||
+      header->data_offset < sizeof(DatasetHeader)) {
+    fprintf(stderr, "%s: unsupported or corrupt point file header\n", path);
+    return 0;
+  }
+  size_t n_values = (size_t)header->n_points * header->dimensions;
+  if (header->data_offset > file_size || (file_size - header->data_offset) / coord_size < n_values) {
+    fprintf(stderr, "%s: point file is shorter than its header says\n", path);
+    return 0;
+  }
+  return 1;
+}
+
+// Reads a mapped binary point file. int32 coordinates are used in place; int16 ones are widened into a new array.
+static int load_binary(const char *path, Dataset *ds) {
+  const DatasetHeader *header = (const DatasetHeader *)ds->mapping;
+  if (!check_header(path, header, ds->mapping_size))
+    return 0;
+  size_t n_values = (size_t)header->n_points * header->dimensions;
+
+  ds->n_points = (uint32_t)header->n_points;
+  ds->dimensions = (int)header->dimensions;
+  ds->binary = 1;
+  ds->has_box = (header->flags & DATASET_HAS_BOX) != 0;
+  if (ds->has_box) {
+    memcpy(ds->box_min, header->box_min, sizeof(ds->box_min));
+    memcpy(ds->box_max, header->box_max, sizeof(ds->box_max));
+  }
+
+  const uint8_t *data = (const uint8_t *)ds->mapping + header->data_offset;
+  if (header->coord_type == COORD_INT32) {
+    ds->coords = (int32_t *)data;
+    ds->mapped = 1;
+    return 1;
+  }
+  ds->coords = (int32_t *)malloc(n_values * sizeof(int32_t));
+  if (!ds->coords) {
+    fprintf(stderr, "Failed to allocate memory for points\n");
+    return 0;
+  }
+  const int16_t *narrow = (const int16_t *)data;
+  for (size_t k = 0; k < n_values; k++)
+    ds->coords[k] = narrow[k];
+  return 1;
+}
+
+int load_dataset(const char *path, int n_threads, Dataset *ds) {
+  memset(ds, 0, sizeof(*ds));
+  double start = now();
+  if (!map_file(path, &ds->mapping, &ds->mapping_size))
+    return 0;
+  ds->input_bytes = ds->mapping_size;
+  ds->load_threads = 1;
+
+  int ok;
+  if (ds->mapping_size >= sizeof(((DatasetHeader *)0)->magic) &&
+      memcmp(ds->mapping, DATASET_MAGIC, sizeof(((DatasetHeader *)0)->magic)) == 0) {
+    ok = load_binary(path, ds);
+  } else {
+    // The CSV text is not needed once it is parsed.
+    ds->coords = parse_csv(path, (const char *)ds->mapping, ds->mapping_size, n_threads, &ds->n_points,
+                           &ds->dimensions, &ds->load_threads);
+    if (ds->mapping)
+      munmap(ds->mapping, ds->mapping_size);
+    ds->mapping = NULL;
+    ok = ds->coords != NULL;
+  }
+  if (!ok) {
+    free_dataset(ds);
+    return 0;
+  }
+  ds->load_seconds = now() - start;
+  return 1;
+}
+
+void free_dataset(Dataset *ds) {
+  if (!ds->mapped)
+    free(ds->coords);
+  if (ds->mapping)
+    munmap(ds->mapping, ds->mapping_size);
+  memset(ds, 0, sizeof(*ds));
+}
+
+int open_point_stream(const char *path, PointStream *s) {
+  memset(s, 0, sizeof(*s));
+  s->file = fopen(path, "rb");
+  if (!s->file) {
+    perror("Error opening point file");
+    return 0;
+  }
+  struct stat st;
+  if (fstat(fileno(s->file), &st) != 0 || fread(&s->header, 1, sizeof(s->header), s->file) != sizeof(s->header) ||
+      memcmp(s->header.magic, DATASET_MAGIC, sizeof(s->header.magic)) != 0) {
+    fprintf(stderr, "%s: not a binary point file (convert it with convert_dataset)\n", path);
+    close_point_stream(s);
+    return 0;
+  }
+  if (!check_header(path, &s->header, (size_t)st.st_size)) {
+    close_point_stream(s);
+    return 0;
+  }
+  s->n_points = (uint32_t)s->header.n_points;
+  s->dimensions = (int)s->header.dimensions;
+  return rewind_point_stream(s);
+}
+
+int rewind_point_stream(PointStream *s) {
+  s->next = 0;
+  if (fseeko(s->file, (off_t)s->header.data_offset, SEEK_SET) != 0) {
+    perror("Error reading point file");
+    return 0;
+  }
+  return 1;
+}
+
+int read_point_block(PointStream *s, int32_t *coords, uint32_t max_points, uint32_t *n_read) {
+  uint32_t n = s->n_points - s->next < max_points ? s->n_points - s->next : max_points;
+  size_t n_values = (size_t)n * s->dimensions;
+  int narrow = s->header.coord_type == COORD_INT16;
+  // int16 values are read into the back half of the block and widened front to back.
+  void *in = narrow ? (void *)((int16_t *)coords + n_values) : (void *)coords;
+  if (fread(in, narrow ? sizeof(int16_t) : sizeof(int32_t), n_values, s->file) != n_values) {
+    fprintf(stderr, "Error reading point file\n");
+    return 0;
+  }
+  if (narrow) {
+    const int16_t *values = (const int16_t *)in;
+    for (size_t k = 0; k < n_values; k++)
+      coords[k] = values[k];
+  }
+  s->next += n;
+  s->bytes_read += n_values * (narrow ? sizeof(int16_t) : sizeof(int32_t));
+  *n_read = n;
+  return 1;
+}
+
+void close_point_stream(PointStream *s) {
+  if (s->file)
+    fclose(s->file);
+  memset(s, 0, sizeof(*s));
+}
+
+void print_dataset_summary(FILE *out, const Dataset *ds) {
+  if (ds->binary) {
+    fprintf(out, "Input: %s, loaded in %f seconds\n", ds->mapped ? "binary (mapped)" : "binary", ds->load_seconds);
+  } else {
+    fprintf(out, "Input: csv, parsed in %f seconds (%.2f GB/s, %d threads)\n", ds->load_seconds,
+            ds->load_seconds > 0 ? ds->input_bytes / ds->load_seconds / 1e9 : 0.0, ds->load_threads);
+  }
+}
+
+static const char *const phase_names[NR_PHASES] = {"load", "index", "core", "expansion", "transfer", "launch",
+                                                     "output"};
+
+void init_phase_times(PhaseTimes *t) {
+  for (int p = 0; p < NR_PHASES; p++)
+    t->seconds[p] = -1.0;
+}
+
+// Peak RSS of this process image in KB. ru_maxrss would also count whatever ran before exec in this process (the
+// shell or benchmark driver that started it), so the kernel's high-water mark is read instead where there is one.
+static long peak_rss_kb(void) {
+  long kb = -1;
+  FILE *status = fopen("/proc/self/status", "r");
+  if (status) {
+    char line[256];
+    while (fgets(line, sizeof(line), status) && sscanf(line, "VmHWM: %ld kB", &kb) != 1)
+      ;
+    fclose(status);
+  }
+  if (kb < 0) {
+    struct rusage self;
+    getrusage(RUSAGE_SELF, &self);
+    kb = self.ru_maxrss;
+  }
+  return kb;
+}
+
+void print_phase_times(FILE *out, const PhaseTimes *t, uint64_t n_points) {
+  struct rusage children;
+  getrusage(RUSAGE_CHILDREN, &children);
+  long self_kb = peak_rss_kb();
+  fprintf(out, "Timing: points=%llu", (unsigned long long)n_points);
+  for (int p = 0; p < NR_PHASES; p++) {
+    if (t->seconds[p] < 0)
+      fprintf(out, " %s=-", phase_names[p]);
+    else
+      fprintf(out, " %s=%f", phase_names[p], t->seconds[p]);
+  }
+  fprintf(out, " peak_rss_kb=%ld\n", self_kb > children.ru_maxrss ? self_kb : children.ru_maxrss);
+}
+
+static inline uint64_t hash_row(const int32_t *row, int dimensions) {
+  uint64_t h = 0;
+  for (int k = 0; k < dimensions; k++)
+    h = (h ^ (uint32_t)row[k]) * 0x9E3779B97F4A7C15ull;
+  return h ^ (h >> 29);
+}
+
+// One pass over the input with an open-addressing table of unique point ids, keyed by the coordinates.
+int coalesce_points(const int32_t *coords, uint32_t n_points, int dimensions, int merge, CoalescedPoints *out) {
+  double start = now();
+  memset(out, 0, sizeof(*out));
+  int bits = 4;
+  while (merge && ((size_t)1 << bits) < (size_t)n_points * 2)
+    bits++;
+  size_t mask = ((size_t)1 << bits) - 1;
+  size_t row_bytes = sizeof(int32_t) * dimensions;
+  uint32_t *table = merge ? (uint32_t *)malloc(sizeof(uint32_t) << bits) : NULL;
+  out->index = (uint32_t *)malloc(sizeof(uint32_t) * (n_points > 0 ? n_points : 1));
+  out->weights = (uint32_t *)malloc(sizeof(uint32_t) * (n_points > 0 ? n_points : 1));
+  out->coords = (int32_t *)malloc(row_bytes * (n_points > 0 ? n_points : 1));
+  if ((merge && !table) || !out->index || !out->weights || !out->coords) {
+    fprintf(stderr, "Failed to allocate memory for duplicate coalescing\n");
+    free(table);
+    free_coalesced_points(out);
+    return 0;
+  }
+  if (!merge) {
+    memcpy(out->coords, coords, row_bytes * n_points);
+    for (uint32_t i = 0; i < n_points; i++) {
+      out->index[i] = i;
+      out->weights[i] = 1;
+    }
+    out->n_points = out->n_unique = n_points;
+    out->seconds = now() - start;
+    return 1;
+  }
+  memset(table, 0xFF, sizeof(uint32_t) << bits);
+
+  uint32_t n_unique = 0;
+  for (uint32_t i = 0; i < n_points; i++) {
+    const int32_t *row = coords + (size_t)i * dimensions;
+    size_t s = (size_t)(hash_row(row, dimensions) >> (64 - bits));
+    while (table[s] != UINT32_MAX && memcmp(out->coords + (size_t)table[s] * dimensions, row, row_bytes) != 0)
+      s = (s + 1) & mask;
+    if (table[s] == UINT32_MAX) {
+      table[s] = n_unique;
+      memcpy(out->coords + (size_t)n_unique * dimensions, row, row_bytes);
+      out->weights[n_unique++] = 0;
+    }
+    out->index[i] = table[s];
+    out->weights[table[s]]++;
+  }
+  free(table);
+  out->n_points = n_points;
+  out->n_unique = n_unique;
+  out->seconds = now() - start;
+  return 1;
+}
+
+void free_coalesced_points(CoalescedPoints *c) {
+  free(c->coords);
+  free(c->weights);
+  free(c->index);
+  memset(c, 0, sizeof(*c));
+}
+
+static const char *const curve_names[] = {"none", "morton", "hilbert"};
+
+int parse_curve(const char *name, CurveKind *curve) {
+  for (int c = CURVE_NONE; c <= CURVE_HILBERT; c++) {
+    if (strcmp(name, curve_names[c]) == 0) {
+      *curve = (CurveKind)c;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+const char *curve_name(CurveKind curve) { return curve_names[curve]; }
+
+// Skilling's transform ("Programming the Hilbert curve", 2004): turns the cell coordinates x[0..dimensions) of
+// `bits` bits each into the transposed Hilbert index, whose bits interleave like a Morton key.
+static void hilbert_transpose(uint32_t *x, int dimensions, int bits) {
+  for (uint32_t q = 1u << (bits - 1); q > 1; q >>= 1) {
+    uint32_t p = q - 1;
+    for (int k = 0; k < dimensions; k++) {
+      if (x[k] & q) {
+        x[0] ^= p;
+      } else {
+        uint32_t t = (x[0] ^ x[k]) & p;
+        x[0] ^= t;
+        x[k] ^= t;
+      }
+    }
+  }
+  for (int k = 1; k < dimensions; k++)
+    x[k] ^= x[k - 1];
+  uint32_t t = 0;
+  for (uint32_t q = 1u << (bits - 1); q > 1; q >>= 1) {
+    if (x[dimensions - 1] & q)
+      t ^= q - 1;
+  }
+  for (int k = 0; k < dimensions; k++)
+    x[k] ^= t;
+}
+
+// Keys are ordered with an LSD radix sort over the bytes the keys use, so equal keys keep their order.
+int sort_points_on_curve(CoalescedPoints *c, int dimensions, CurveKind curve) {
+  double start = now();
+  uint32_t n = c->n_unique;
+  size_t size = n > 0 ? n : 1;
+  uint64_t *keys = (uint64_t *)malloc(sizeof(uint64_t) * size * 2);
+  uint32_t *ids = (uint32_t *)malloc(sizeof(uint32_t) * size * 2);
+  int32_t *coords = (int32_t *)malloc(sizeof(int32_t) * dimensions * size);
+  uint32_t *weights = (uint32_t *)malloc(sizeof(uint32_t) * size);
+  if (!keys || !ids || !coords || !weights) {
+    fprintf(stderr, "Failed to allocate memory for curve ordering\n");
+    free(keys);
+    free(ids);
+    free(coords);
+    free(weights);
+    return 0;
+  }
+
+  // One shift for every axis keeps the curve cells cubes.
+  int32_t min[MAX_DIMENSIONS];
+  uint32_t span = 0;
+  for (int k = 0; k < dimensions; k++) {
+    int32_t lo = n > 0 ? c->coords[k] : 0, hi = lo;
+    for (uint32_t i = 1; i < n; i++) {
+      int32_t v = c->coords[(size_t)i * dimensions + k];
+      lo = v < lo ? v : lo;
+      hi = v > hi ? v : hi;
+    }
+    min[k] = lo;
+    span = (uint32_t)hi - (uint32_t)lo > span ? (uint32_t)hi - (uint32_t)lo : span;
+  }
+  // Only as many bits per axis as the span needs, so small spans give short keys and few radix passes.
+  int bits = 1, max_bits = 64 / dimensions < 32 ? 64 / dimensions : 32;
+  while (bits < 32 && span >> bits)
+    bits++;
+  int shift = bits > max_bits ? bits - max_bits : 0;
+  bits -= shift;
+  int key_bytes = (bits * dimensions + 7) / 8;
+
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t x[MAX_DIMENSIONS];
+    for (int k = 0; k < dimensions; k++)
+      x[k] = ((uint32_t)c->coords[(size_t)i * dimensions + k] - (uint32_t)min[k]) >> shift;
+    if (curve == CURVE_HILBERT)
+      hilbert_transpose(x, dimensions, bits);
+    uint64_t key = 0;
+    for (int b = bits - 1; b >= 0; b--) {
+      for (int k = 0; k < dimensions; k++)
+        key = (key << 1) | ((x[k] >> b) & 1);
+    }
+    keys[i] = key;
+    ids[i] = i;
+  }
+
+  uint64_t *key_in = keys, *key_out = keys + size;
+  uint32_t *id_in = ids, *id_out = ids + size;
+  for (int byte = 0; byte < key_bytes; byte++) {
+    uint32_t offsets[257] = {0};
+    for (uint32_t i = 0; i < n; i++)
+      offsets[((key_in[i] >> (8 * byte)) & 0xFF) + 1]++;
+    for (int d = 0; d < 256; d++)
+      offsets[d + 1] += offsets[d];
+    for (uint32_t i = 0; i < n; i++) {
+      uint32_t to = offsets[(key_in[i] >> (8 * byte)) & 0xFF]++;
+      key_out[to] = key_in[i];
+      id_out[to] = id_in[i];
+    }
+    uint64_t *k = key_in;
+    key_in = key_out;
+    key_out = k;
+    uint32_t *d = id_in;
+    id_in = id_out;
+    id_out = d;
+  }
+
+  // id_out is free now and becomes the new position of each old point.
+  for (uint32_t r = 0; r < n; r++) {
+    memcpy(coords + (size_t)r * dimensions, c->coords + (size_t)id_in[r] * dimensions, sizeof(int32_t) * dimensions);
+    weights[r] = c->weights[id_in[r]];
+    id_out[id_in[r]] = r;
+  }
+  for (uint32_t i = 0; i < c->n_points; i++)
+    c->index[i] = id_out[c->index[i]];
+  free(keys);
+  free(ids);
+  free(c->coords);
+  free(c->weights);
+  c->coords = coords;
+  c->weights = weights;
+  c->curve_seconds = now() - start;
+  return 1;
+}
+
+static const char *const label_format_names[] = {"text", "binary", "mmap"};
+
+int parse_label_format(const char *name, LabelFormat *format) {
+  for (int f = LABELS_TEXT; f <= LABELS_MMAP; f++) {
+    if (strcmp(name, label_format_names[f]) == 0) {
+      *format = (LabelFormat)f;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+const char *label_format_name(LabelFormat format) { return label_format_names[format]; }
+
+const char *label_extension(LabelFormat format) { return format == LABELS_TEXT ? "txt" : "bin"; }
+
+#define LABEL_TEXT_MAX 12            // "-2147483648\n"
+#define LABELS_PER_ROUND (1u << 20) // labels each thread converts before the buffer is written out
+#define MIN_LABEL_SLICE (1u << 16)  // fewer labels are not worth another thread
+
+// Labels begin..end-1, converted into out: decimal lines for text, int32 values for binary.
+typedef struct {
+  const int32_t *labels;
+  size_t stride;
+  size_t begin, end;
+  char *out;
+  size_t length; // bytes written to out
+} LabelSlice;
+
+static inline int32_t label_at(const LabelSlice *slice, size_t i) {
+  return *(const int32_t *)((const char *)slice->labels + i * slice->stride);
+}
+
+static void *format_slice(void *arg) {
+  LabelSlice *slice = (LabelSlice *)arg;
+  char *p = slice->out;
+  for (size_t i = slice->begin; i < slice->end; i++) {
+    int32_t label = label_at(slice, i);
+    uint32_t v = label < 0 ? 0u - (uint32_t)label : (uint32_t)label;
+    char digits[10];
+    int n = 0;
+    do {
+      digits[n++] = (char)('0' + v % 10);
+      v /= 10;
+    } while (v);
+    if (label < 0)
+      *p++ = '-';
+    while (n > 0)
+      *p++ = digits[--n];
+    *p++ = '\n';
+  }
+  slice->length = (size_t)(p - slice->out);
+  return NULL;
+}
+
+static void *gather_slice(void *arg) {
+  LabelSlice *slice = (LabelSlice *)arg;
+  int32_t *out = (int32_t *)slice->out;
+  for (size_t i = slice->begin; i < slice->end; i++)
+    *out++ = label_at(slice, i);
+  slice->length = (slice->end - slice->begin) * sizeof(int32_t);
+  return NULL;
+}
+
+static int write_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0)
+      return 0;
+    data += written;
+    size -= (size_t)written;
+  }
+  return 1;
+}
+
+// Splits labels first..first+count-1 evenly over the slices; slice t converts into out at its label offset * unit.
+static void split_labels(LabelSlice *slices, int n_slices, size_t first, size_t count, char *out, size_t unit) {
+  for (int t = 0; t < n_slices; t++) {
+    slices[t].begin = first + count * t / n_slices;
+    slices[t].end = first + count * (t + 1) / n_slices;
+    slices[t].out = out + (slices[t].begin - first) * unit;
+  }
+}
+
+// Text and plain binary: the threads convert a round of labels into one buffer, which is then written in order.
+static int stream_labels(int fd, LabelSlice *slices, int n_threads, uint32_t n_points, LabelFormat format) {
+  size_t unit = format == LABELS_TEXT ? LABEL_TEXT_MAX : sizeof(int32_t);
+  size_t round = (size_t)n_threads * LABELS_PER_ROUND;
+  round = round < n_points ? round : n_points;
+  char *buffer = (char *)malloc(round * unit + 1);
+  if (!buffer)
+    return 0;
+  int ok = 1;
+  for (size_t first = 0; ok && first < n_points; first += round) {
+    size_t count = n_points - first < round ? n_points - first : round;
+    split_labels(slices, n_threads, first, count, buffer, unit);
+    run_tasks(slices, sizeof(LabelSlice), n_threads, format == LABELS_TEXT ? format_slice : gather_slice);
+    for (int t = 0; ok && t < n_threads; t++)
+      ok = write_all(fd, slices[t].out, slices[t].length);
+  }
+  free(buffer);
+  return ok;
+}
+
+// Binary through a shared mapping: the file is sized up front and the threads store straight into the page cache.
+static int map_labels(int fd, LabelSlice *slices, int n_threads, uint32_t n_points) {
+  size_t size = (size_t)n_points * sizeof(int32_t);
+  if (ftruncate(fd, (off_t)size) != 0)
+    return 0;
+  if (size == 0)
+    return 1;
+  void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED)
+    return 0;
+  split_labels(slices, n_threads, 0, n_points, (char *)mapping, sizeof(int32_t));
+  run_tasks(slices, sizeof(LabelSlice), n_threads, gather_slice);
+  return munmap(mapping, size) == 0;
+}
+
+int append_labels(int fd, const int32_t *labels, size_t stride, uint32_t n_points, LabelFormat format) {
+  LabelSlice slice = {labels, stride, 0, 0, NULL, 0};
+  if (!stream_labels(fd, &slice, 1, n_points, format == LABELS_TEXT ? LABELS_TEXT : LABELS_BINARY)) {
+    perror("Error writing labels output file");
+    return 0;
+  }
+  return 1;
+}
+
+int write_labels(const char *path, const int32_t *labels, size_t stride, uint32_t n_points, LabelFormat format,
+                 int n_threads) {
+  n_threads = thread_count(n_threads, n_points, MIN_LABEL_SLICE);
+  LabelSlice *slices = (LabelSlice *)calloc(n_threads, sizeof(LabelSlice));
+  if (!slices) {
+    fprintf(stderr, "Failed to allocate memory for labels output\n");
+    return 0;
+  }
+  for (int t = 0; t < n_threads; t++) {
+    slices[t].labels = labels;
+    slices[t].stride = stride;
+  }
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("Error opening labels output file");
+    free(slices);
+    return 0;
+  }
+  int ok = format == LABELS_MMAP ? map_labels(fd, slices, n_threads, n_points)
+                                 : stream_labels(fd, slices, n_threads, n_points, format);
+  if (!ok)
+    perror("Error writing labels output file");
+  if (close(fd) != 0 && ok) {
+    perror("Error writing labels output file");
+    ok = 0;
+  }
+  free(slices);
+  return ok;
+}
@@ -0,0 +1,172 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+// Point input and label output shared by dbscan_cpu, dbscan_cpu_openmp, dbscan_pim_host and convert_dataset.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define MAX_DIMENSIONS 64
+
+// Binary point file (native-endian): a DatasetHeader, then n_points * dimensions coordinates row-major starting at
+// data_offset. Written by convert_dataset; int32 files are mmapped and used in place, so a file is only readable on a
+// machine of the byte order that wrote it.
+#define DATASET_MAGIC "DBSCANPT"
+#define DATASET_VERSION 1
+#define DATASET_HAS_BOX 1u // box_min/box_max hold the bounding box of the points
+
+typedef enum {
+  COORD_INT32 = 0,
+  COORD_INT16 = 1, // widened to int32 when loaded
+} CoordType;
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t dimensions;
+  uint64_t n_points;
+  uint32_t coord_type;
+  uint32_t flags;
+  uint64_t data_offset; // multiple of 64
+  int32_t box_min[MAX_DIMENSIONS];
+  int32_t box_max[MAX_DIMENSIONS];
+} DatasetHeader;
+
+// Points in memory. coords is row-major and read-only when it points into a mapping of the input file.
+typedef struct {
+  int32_t *coords;
+  uint32_t n_points;
+  int dimensions;
+  int binary;  // loaded from a binary point file
+  int mapped;  // coords points into the mapping itself (no copy)
+  int has_box; // box_min/box_max are valid
+  int32_t box_min[MAX_DIMENSIONS];
+  int32_t box_max[MAX_DIMENSIONS];
+  void *mapping;
+  size_t mapping_size;
+  size_t input_bytes;
+  int load_threads;    // threads that parsed a CSV input
+  double load_seconds; // time to map or parse the input
+} Dataset;
+
+// Reads a CSV file with one point per line and the same number of integer columns on every line; the column count
+// of the first line is the dimension. The file is parsed by n_threads threads (0: one per online CPU) and the
+// points keep the file order. Returns the coordinates row-major (n_points * dimensions values), or NULL after
+// printing the reason.
+int32_t *load_points_csv(const char *path, int n_threads, uint32_t *n_points, int *dimensions);
+
+// Loads a binary point file or, when the file does not start with DATASET_MAGIC, a CSV file (see
+// load_points_csv). Returns 0 after printing the reason on failure.
+int load_dataset(const char *path, int n_threads, Dataset *ds);
+void free_dataset(Dataset *ds);
+
+// A binary point file read front to back a block at a time, for inputs that do not fit in memory.
+typedef struct {
+  FILE *file;
+  DatasetHeader header;
+  uint32_t n_points;
+  int dimensions;
+  uint32_t next;       // index of the next point to be read
+  uint64_t bytes_read; // coordinate bytes read so far, over all passes
+} PointStream;
+
+// Opens a binary point file and checks its header. Returns 0 after printing the reason on failure, including when
+// the file is a CSV file.
+int open_point_stream(const char *path, PointStream *s);
+// Starts another pass over the points. Returns 0 after printing the reason on failure.
+int rewind_point_stream(PointStream *s);
+// Reads the next (at most) max_points points into coords, row-major and widened to int32, and stores how many were
+// read in n_read (0 after the last point). Returns 0 after printing the reason on failure.
+int read_point_block(PointStream *s, int32_t *coords, uint32_t max_points, uint32_t *n_read);
+void close_point_stream(PointStream *s);
+
+// Writes the "Input: ..." line of a result file: format, load time and, for CSV, parse throughput.
+void print_dataset_summary(FILE *out, const Dataset *ds);
+
+// Wall-clock phases of a run, written on the "Timing:" line of every result file for scripts/benchmark.py. Load,
+// index, core, expansion and output follow one another; transfer and launch are the parts of them spent moving data
+// to or from the DPUs and waiting for DPU launches. A phase a program does not have, or does not time on its own,
+// stays negative and is written as "-".
+typedef enum {
+  PHASE_LOAD,      // reading or parsing the input
+  PHASE_INDEX,     // coalescing, reordering, building the index or placing the points
+  PHASE_CORE,      // deciding the core points
+  PHASE_EXPANSION, // connecting the core points and labelling the border points
+  PHASE_TRANSFER,  // host <-> DPU copies
+  PHASE_LAUNCH,    // waiting for DPU launches
+  PHASE_OUTPUT,    // writing the labels
+  NR_PHASES,
+} Phase;
+
+typedef struct {
+  double seconds[NR_PHASES];
+} PhaseTimes;
+
+void init_phase_times(PhaseTimes *t);
+// Writes "Timing: points=<n> load=<s> ... output=<s> peak_rss_kb=<kb>". The peak RSS is that of this process or of
+// its largest finished child, whichever is larger.
+void print_phase_times(FILE *out, const PhaseTimes *t, uint64_t n_points);
+
+// The points clustering runs on: the input points with identical coordinates merged into one weighted point, and
+// optionally reordered along a space-filling curve. Without reordering, unique points keep the order of their first
+// occurrence, so clustering them numbers the clusters in the same order as clustering the input would.
+typedef struct {
+  int32_t *coords;   // n_unique * dimensions, row-major
+  uint32_t *weights; // input points merged into each unique point
+  uint32_t *index;   // unique point of each input point
+  uint32_t n_points; // input points
+  uint32_t n_unique;
+  double seconds;       // time taken by coalesce_points
+  double curve_seconds; // time taken by sort_points_on_curve
+} CoalescedPoints;
+
+// With merge 0 every input point is kept with weight 1, so that the points can still be reordered. Returns 0 after
+// printing the reason if memory runs out.
+int coalesce_points(const int32_t *coords, uint32_t n_points, int dimensions, int merge, CoalescedPoints *out);
+void free_coalesced_points(CoalescedPoints *c);
+
+typedef enum {
+  CURVE_NONE,    // keep the input order
+  CURVE_MORTON,  // Z-order: the bits of all coordinates interleaved
+  CURVE_HILBERT, // Hilbert curve; consecutive points are always adjacent cells
+} CurveKind;
+
+// Parses a curve name ("none", "morton" or "hilbert"). Returns 0 if the name is unknown.
+int parse_curve(const char *name, CurveKind *curve);
+const char *curve_name(CurveKind curve);
+
+// Reorders the unique points of c by their position on curve and renumbers c->index to match. Coordinates are
+// taken relative to the bounding box and quantised to at most 64 / dimensions bits each; points in the same curve
+// cell keep their order. Returns 0 after printing the reason if memory runs out.
+int sort_points_on_curve(CoalescedPoints *c, int dimensions, CurveKind curve);
+
+typedef enum {
+  LABELS_TEXT,   // one decimal label per line
+  LABELS_BINARY, // n_points native-endian int32 labels, no header
+  LABELS_MMAP,   // LABELS_BINARY, stored through a shared mapping of the output file
+} LabelFormat;
+
+// Parses a format name ("text", "binary" or "mmap"). Returns 0 if the name is unknown.
+int parse_label_format(const char *name, LabelFormat *format);
+const char *label_format_name(LabelFormat format);
+// File extension without the dot: "txt" for text, "bin" for the binary formats.
+const char *label_extension(LabelFormat format);
+
+// Writes n_points labels to path; label i is the int32_t stride bytes after label i - 1, so the cluster field of a
+// point array can be passed directly. n_threads threads (0: one per online CPU) format the text or gather the
+// binary values. Returns 0 after printing the reason on failure.
+int write_labels(const char *path, const int32_t *labels, size_t stride, uint32_t n_points, LabelFormat format,
+                 int n_threads);
+
+// Appends n_points labels to the open file fd, for labels that are produced a piece at a time. Text is written as
+// by write_labels, and LABELS_MMAP as LABELS_BINARY. Returns 0 after printing the reason on failure.
+int append_labels(int fd, const int32_t *labels, size_t stride, uint32_t n_points, LabelFormat format);
+
+// Runs fn on each of n_tasks task structs of task_size bytes, task 0 on the calling thread. Falls back to running a
+// task inline if a thread cannot be started.
+void run_tasks(void *tasks, size_t task_size, int n_tasks, void *(*fn)(void *));
+// Thread count for n_threads (0: one per online CPU), keeping at least min_work units of work per thread.
+int thread_count(int n_threads, size_t work, size_t min_work);
+
+#endif
@@ -1,16 +1,30 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+
 #include <math.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "counters.h"
+#include "dataset.h"
+#include "distance_kernels.h"
+#include "evaluate.h"
 
 #define UNCLASSIFIED -1
 #define NOISE -2
-#define DIMENSIONS 2
 
+// x points into the row-major coordinates of the loaded Dataset.
 typedef struct {
-  int32_t x[DIMENSIONS];
+  int32_t *x;
   int32_t cluster;
 } Point;
 
@@ -20,16 +34,35 @@ typedef struct {
   int capacity;
 } IntVector;
 
-uint8_t *visited; // Global visited array
+typedef enum {
+  INDEX_BRUTE, // scan every point for each query (original O(n^2) path)
+  INDEX_GRID,  // uniform grid of eps-sized cells, 3x3 neighbourhood per query
+} IndexMode;
 
-static inline uint32_t squared_distance(const Point *a, const Point *b) {
-  uint32_t sum = 0;
-  for (int i = 0; i < DIMENSIONS; i++) {
-    int32_t diff = a->x[i] - b->x[i];
-    sum += diff * diff;
-  }
-  return sum;
-}
+// Points bucketed by cell over the first two coordinates. cell_points holds point ids grouped by cell and
+// cell_start[c]..cell_start[c + 1] is the slice belonging to cell c (counting sort, built once).
+typedef struct {
+  int32_t min_x, min_y;
+  int32_t cell_size;
+  int32_t cols, rows;
+  uint32_t *cell_start;
+  uint32_t *cell_points;
+  uint32_t *point_cell;
+} GridIndex;
+
+uint8_t *visited; // Global visited array
+IndexMode index_mode = INDEX_GRID;
+GridIndex grid;
+CoordArrays coords;
+int dimensions;
+uint32_t *match_buffer; // positions returned by collect_kernel
+int kernel_kind = -1;   // -1 picks the widest kernel the CPU supports
+int coalesce = 1; // cluster unique coordinates with weights instead of every input point
+CurveKind curve = CURVE_NONE; // order in which the points are stored and visited
+LabelFormat label_format = LABELS_TEXT;
+char *true_labels_file = NULL;
+const uint8_t *core_mask = NULL; // core flag of each point, given by run_worker or decided by dbscan() itself
+double core_seconds;             // time dbscan() took to decide the core points; the rest of its run is expansion
 
 IntVector *create_int_vector(int initial_capacity) {
   IntVector *vec = (IntVector *)malloc(sizeof(IntVector));
@@ -54,8 +87,8 @@ void free_int_vector(IntVector *vec) {
 
 int push_back(IntVector *vec, uint32_t value) {
   if (vec->size == vec->capacity) {
+    COUNT(vector_growths, 1);
     int new_capacity = vec->capacity * 2;
-    printf("set capacity to %d\n", new_capacity);
     uint32_t *new_data = (uint32_t *)realloc(vec->data, new_capacity * sizeof(uint32_t));
     if (!new_data)
       return 0;
@@ -66,14 +99,159 @@ int push_back(IntVector *vec, uint32_t value) {
   return 1;
 }
 
-int region_query(const Point *points, int n_points, int point_id, uint32_t eps_squared, IntVector *neighbors) {
-  int neighbor_count = 0;
-  neighbors->size = 0;
+// The grid uses the first two coordinates; one-dimensional data has a single row.
+static inline int32_t grid_y(const Point *p) { return dimensions > 1 ? p->x[1] : 0; }
+
+int build_grid_index(GridIndex *g, const Point *points, int n_points, uint32_t eps) {
+  int32_t min_x = 0, min_y = 0, max_x = 0, max_y = 0;
+  if (n_points > 0) {
+    min_x = max_x = points[0].x[0];
+    min_y = max_y = grid_y(&points[0]);
+  }
+  for (int i = 1; i < n_points; i++) {
+    int32_t y = grid_y(&points[i]);
+    if (points[i].x[0] < min_x)
+      min_x = points[i].x[0];
+    if (points[i].x[0] > max_x)
+      max_x = points[i].x[0];
+    if (y < min_y)
+      min_y = y;
+    if (y > max_y)
+      max_y = y;
+  }
+
+  // Cells must be at least eps wide for the 3x3 neighbourhood to cover the eps-ball. Widen them when the
+  // bounding box is so sparse that eps-sized cells would need more cells than there are points.
+  int64_t cell_size = eps > 0 ? eps : 1;
+  int64_t span_x = (int64_t)max_x - min_x, span_y = (int64_t)max_y - min_y;
+  int64_t max_cells = (int64_t)n_points * 4 + 16;
+  while ((span_x / cell_size + 1) * (span_y / cell_size + 1) > max_cells)
+    cell_size *= 2;
+
+  g->min_x = min_x;
+  g->min_y = min_y;
+  g->cell_size = (int32_t)cell_size;
+  g->cols = (int32_t)(span_x / cell_size + 1);
+  g->rows = (int32_t)(span_y / cell_size + 1);
+
+  size_t n_cells = (size_t)g->cols * g->rows;
+  g->cell_start = (uint32_t *)calloc(n_cells + 1, sizeof(uint32_t));
+  g->cell_points = (uint32_t *)malloc((n_points > 0 ? n_points : 1) * sizeof(uint32_t));
+  g->point_cell = (uint32_t *)malloc((n_points > 0 ? n_points : 1) * sizeof(uint32_t));
+  if (!g->cell_start || !g->cell_points || !g->point_cell)
+    return 0;
 
   for (int i = 0; i < n_points; i++) {
-    if (squared_distance(&points[point_id], &points[i]) <= eps_squared) {
-      neighbor_count++;
+    uint32_t cx = (uint32_t)(((int64_t)points[i].x[0] - min_x) / cell_size);
+    uint32_t cy = (uint32_t)(((int64_t)grid_y(&points[i]) - min_y) / cell_size);
+    g->point_cell[i] = cy * g->cols + cx;
+    g->cell_start[g->point_cell[i] + 1]++;
+  }
+  for (size_t c = 0; c < n_cells; c++)
+    g->cell_start[c + 1] += g->cell_start[c];
+
+  // Scatter in index order so each cell lists its points in ascending id.
+  uint32_t *fill = (uint32_t *)malloc(n_cells * sizeof(uint32_t));
+  if (!fill)
+    return 0;
+  memcpy(fill, g->cell_start, n_cells * sizeof(uint32_t));
+  for (int i = 0; i < n_points; i++)
+    g->cell_points[fill[g->point_cell[i]]++] = i;
+  free(fill);
+  return 1;
+}
+
+void free_grid_index(GridIndex *g) {
+  free(g->cell_start);
+  free(g->cell_points);
+  free(g->point_cell);
+  memset(g, 0, sizeof(*g));
+}
+
+// Lays the coordinates (and weights, if any) out in scan order: cell_points order for the grid, input order for
+// brute force.
+int build_coord_arrays(CoordArrays *c, const Point *points, int n_points, const uint32_t *weights) {
+  size_t size = (n_points > 0 ? n_points : 1) * sizeof(int32_t);
+  for (int a = 0; a < dimensions; a++) {
+    c->axis[a] = (int32_t *)malloc(size);
+    if (!c->axis[a])
+      return 0;
+  }
+  if (weights && !(c->weight = (uint32_t *)malloc(size)))
+    return 0;
+  for (int k = 0; k < n_points; k++) {
+    uint32_t i = (index_mode == INDEX_GRID) ? grid.cell_points[k] : (uint32_t)k;
+    for (int a = 0; a < dimensions; a++)
+      c->axis[a][k] = points[i].x[a];
+    if (weights)
+      c->weight[k] = weights[i];
+  }
+  return 1;
+}
+
+void free_coord_arrays(CoordArrays *c) {
+  for (int a = 0; a < MAX_DIMENSIONS; a++)
+    free(c->axis[a]);
+  free(c->weight);
+  memset(c, 0, sizeof(*c));
+}
+
+// Runs of scan positions that may hold neighbours of point_id: one run per row of the 3x3 grid neighbourhood, or
+// the whole array for brute force. Cells of one row are adjacent in cell_points, so each row is a single run.
+static inline int candidate_runs(int n_points, int point_id, uint32_t *begin, uint32_t *end) {
+  if (index_mode == INDEX_BRUTE) {
+    begin[0] = 0;
+    end[0] = (uint32_t)n_points;
+    return 1;
+  }
+  int32_t cx = grid.point_cell[point_id] % grid.cols;
+  int32_t cy = grid.point_cell[point_id] / grid.cols;
+  int32_t x_lo = cx > 0 ? cx - 1 : 0, x_hi = cx + 1 < grid.cols ? cx + 1 : cx;
+  int32_t y_lo = cy > 0 ? cy - 1 : 0, y_hi = cy + 1 < grid.rows ? cy + 1 : cy;
+  int runs = 0;
+  for (int32_t y = y_lo; y <= y_hi; y++, runs++) {
+    begin[runs] = grid.cell_start[y * grid.cols + x_lo];
+    end[runs] = grid.cell_start[y * grid.cols + x_hi + 1];
+  }
+  return runs;
+}
+
+// Counts neighbours of point_id (itself included) but stops at limit; enough to decide whether it is a core point.
+// Weighted points count as many neighbours as they merge, so their matches are collected and the weights summed.
+uint32_t count_neighbors(const Point *points, int n_points, int point_id, uint32_t eps_squared, uint32_t limit) {
+  uint32_t begin[3], end[3];
+  int runs = candidate_runs(n_points, point_id, begin, end);
+  uint32_t count = 0;
+  COUNT(core_tests, 1);
+  for (int r = 0; r < runs && count < limit; r++) {
+    COUNT(distance_evaluations, end[r] - begin[r]);
+    if (!coords.weight) {
+      count += count_kernel((const int32_t *const *)coords.axis, begin[r], end[r], points[point_id].x, eps_squared,
+                            limit - count);
+      continue;
+    }
+    uint32_t n = collect_kernel((const int32_t *const *)coords.axis, begin[r], end[r], points[point_id].x,
+                                eps_squared, match_buffer);
+    for (uint32_t j = 0; j < n && count < limit; j++)
+      count += coords.weight[match_buffer[j]];
+  }
+  return count;
+}
+
+// Appends the not yet visited neighbours of point_id to neighbors and marks them visited.
+void region_query(const Point *points, int n_points, int point_id, uint32_t eps_squared, IntVector *neighbors) {
+  uint32_t begin[3], end[3];
+  int runs = candidate_runs(n_points, point_id, begin, end);
+  COUNT(region_queries, 1);
+  for (int r = 0; r < runs; r++) {
+    uint32_t n = collect_kernel((const int32_t *const *)coords.axis, begin[r], end[r], points[point_id].x,
+                                eps_squared, match_buffer);
+    COUNT(distance_evaluations, end[r] - begin[r]);
+    COUNT(neighbors_returned, n);
+    for (uint32_t j = 0; j < n; j++) {
+      uint32_t i = (index_mode == INDEX_GRID) ? grid.cell_points[match_buffer[j]] : match_buffer[j];
       if (!visited[i]) {
+        COUNT(neighbors_new, 1);
         if (!push_back(neighbors, i)) {
           fprintf(stderr, "Failed to add neighbor in region_query\n");
           exit(1);
@@ -82,11 +260,13 @@ int region_query(const Point *points, int n_points, int point_id, uint32_t eps_s
       }
     }
   }
-  return neighbor_count;
 }
 
-void expand_cluster(Point *points, int n_points, int point_id, int cluster_id, uint32_t eps_squared, int min_pts,
-                    IntVector *neighbors, IntVector *tmp_neighbors) {
+// Neighbours are only collected (and marked visited) for core points, whose flags are known before expansion.
+// Neighbours of a non-core point therefore stay eligible for a later cluster and the result does not depend on the
+// order in which queries are issued.
+void expand_cluster(Point *points, int n_points, int point_id, int cluster_id, uint32_t eps_squared,
+                    IntVector *neighbors) {
   points[point_id].cluster = cluster_id;
 
   for (int i = 0; i < neighbors->size; i++) {
@@ -95,92 +275,1240 @@ void expand_cluster(Point *points, int n_points, int point_id, int cluster_id, u
       points[current_point].cluster = cluster_id;
     } else if (points[current_point].cluster == UNCLASSIFIED) {
       points[current_point].cluster = cluster_id;
-      tmp_neighbors->size = 0;
-      int neighbor_count = region_query(points, n_points, current_point, eps_squared, tmp_neighbors);
-      if (neighbor_count >= min_pts) {
-        for (int j = 0; j < tmp_neighbors->size; j++) {
-          if (!push_back(neighbors, tmp_neighbors->data[j])) {
-            fprintf(stderr, "Failed to add neighbor in expand_cluster\n");
-            exit(1);
-          }
-        }
-      }
+      if (core_mask[current_point])
+        region_query(points, n_points, current_point, eps_squared, neighbors);
     }
   }
 }
 
+static double elapsed(const struct timeval *start) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1e6;
+}
+
+// Without a core mask, the core points are decided in a pass of their own before any cluster is expanded. Each point
+// is counted once either way, as it would be on first visit.
 void dbscan(Point *points, int n_points, uint32_t eps, int min_pts) {
   int cluster_id = 0;
   uint32_t eps_squared = eps * eps;
   IntVector *neighbors = create_int_vector(n_points);
-  IntVector *tmp_neighbors = create_int_vector(n_points);
   visited = (uint8_t *)calloc(n_points, sizeof(uint8_t));
+  match_buffer = (uint32_t *)malloc((n_points + 16) * sizeof(uint32_t));
 
-  if (!neighbors || !visited) {
+  if (!neighbors || !visited || !match_buffer) {
     fprintf(stderr, "Failed to allocate memory\n");
     exit(1);
   }
 
+  uint8_t *own_mask = NULL;
+  if (!core_mask) {
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    own_mask = (uint8_t *)malloc(n_points + 1);
+    if (!own_mask) {
+      fprintf(stderr, "Failed to allocate memory\n");
+      exit(1);
+    }
+    for (int i = 0; i < n_points; i++)
+      own_mask[i] = count_neighbors(points, n_points, i, eps_squared, min_pts) >= (uint32_t)min_pts;
+    core_mask = own_mask;
+    core_seconds = elapsed(&start);
+  }
+
   for (int i = 0; i < n_points; i++) {
     if (points[i].cluster != UNCLASSIFIED)
       continue;
 
-    // memset(visited, 0, n_points * sizeof(uint8_t)); // Reset visited array
-    neighbors->size = 0; // Clear neighbors
-    int neighbor_count = region_query(points, n_points, i, eps_squared, neighbors);
-
-    if (neighbor_count < min_pts) {
+    if (!core_mask[i]) {
       points[i].cluster = NOISE;
-    } else {
-      visited[i] = 1;
-      cluster_id++;
-      expand_cluster(points, n_points, i, cluster_id, eps_squared, min_pts, neighbors, tmp_neighbors);
+      continue;
     }
+    neighbors->size = 0; // Clear neighbors
+    region_query(points, n_points, i, eps_squared, neighbors);
+    visited[i] = 1;
+    cluster_id++;
+    expand_cluster(points, n_points, i, cluster_id, eps_squared, neighbors);
   }
 
+  if (own_mask) {
+    core_mask = NULL;
+    free(own_mask);
+  }
   free_int_vector(neighbors);
-  free_int_vector(tmp_neighbors);
   free(visited);
+  free(match_buffer);
 }
 
-int main(int argc, char *argv[]) {
-  if (argc != 5) {
-    printf("Usage: %s <data_file> <eps> <min_pts> <output_prefix>\n", argv[0]);
+// Out-of-core clustering (-m): the binary input is streamed, never loaded whole. The first axis is cut into strips
+// whose points fit the memory budget together with their halo, the points less than eps outside the strip. Each
+// strip is written to a file of (id, coordinates) records and clustered on its own with the grid index, in two
+// passes. The first pass decides which of the strip's own points are core, which needs the halo. The second
+// connects all core points of the strip (the halo's core flags come from their own strips) into local clusters, and
+// records for each own point the local clusters it is a core point of or borders. Each halo core point then ties
+// its local cluster to the one of its own strip in a disjoint set, so only the points near strip boundaries are
+// merged.
+// The labels are those of the in-memory run.
+#define STREAM_BLOCK 65536u     // points read from a file at a time
+#define HISTOGRAM_BINS 65536u   // bins of the first coordinate that strips are cut along
+#define MAX_OPEN_STRIPS 256u    // strip files written in one pass over the input
+#define LABEL_CHUNK (1u << 18)  // labels assembled in memory before they are appended to the output
+#define NO_CLUSTER UINT32_MAX
+
+// A strip owns the points with x[0] in [lo, hi) and loads those in [lo - eps, hi + eps).
+typedef struct {
+  int64_t lo, hi;
+  uint32_t n_loaded;
+  uint64_t n_links; // halo core points of other strips that this strip owns
+  long record_offset; // next record of its cluster file to read when the labels are written (-1: none left)
+} Strip;
+
+// Memory a loaded strip point takes during clustering: the coordinates twice (as records and in scan order), the
+// Point, its id, the grid index (at most four cells per point), the match buffer, the search stack, its core flag
+// and local cluster.
+#define STRIP_POINT_BYTES(dims) (8 * (uint64_t)(dims) + 64)
+
+uint64_t memory_budget = 0; // bytes allowed for out-of-core clustering (-m); 0 clusters in memory
+
+// Local clusters of all strips: disjoint-set parent, smallest id of an own core point, and the final cluster number.
+uint32_t *cluster_parent, *cluster_min_id, *cluster_number;
+uint32_t n_local_clusters, local_cluster_capacity;
+
+static void strip_path(char *path, size_t size, const char *prefix, uint32_t s, const char *kind) {
+  snprintf(path, size, "%s_strip%u.%s", prefix, s, kind);
+}
+
+// Strip owning first coordinate x: the last one starting at or before it.
+static uint32_t owner_strip(const Strip *strips, uint32_t n_strips, int64_t x) {
+  uint32_t a = 0, b = n_strips;
+  while (b - a > 1) {
+    uint32_t m = (a + b) / 2;
+    if (strips[m].lo <= x)
+      a = m;
+    else
+      b = m;
+  }
+  return a;
+}
+
+// Cuts the first axis into strips of whole histogram bins whose points and halo number at most capacity. Returns the
+// number of strips, or 0 after printing the reason.
+static uint32_t plan_strips(PointStream *in, int32_t *block, uint32_t eps, uint64_t capacity, Strip **out) {
+  int64_t min = INT64_MAX, max = INT64_MIN;
+  uint32_t n;
+  if (in->header.flags & DATASET_HAS_BOX) {
+    min = in->header.box_min[0];
+    max = in->header.box_max[0];
+  } else {
+    if (!rewind_point_stream(in))
+      return 0;
+    while (read_point_block(in, block, STREAM_BLOCK, &n) && n > 0) {
+      for (uint32_t i = 0; i < n; i++) {
+        int64_t x = block[(size_t)i * in->dimensions];
+        min = x < min ? x : min;
+        max = x > max ? x : max;
+      }
+    }
+    if (in->next < in->n_points)
+      return 0;
+  }
+
+  int64_t width = (max - min + HISTOGRAM_BINS) / HISTOGRAM_BINS;
+  uint32_t n_bins = (uint32_t)((max - min) / width + 1);
+  uint64_t *prefix = (uint64_t *)calloc(n_bins + 1, sizeof(uint64_t));
+  if (!prefix || !rewind_point_stream(in)) {
+    fprintf(stderr, "Failed to allocate memory for the strip histogram\n");
+    free(prefix);
+    return 0;
+  }
+  while (read_point_block(in, block, STREAM_BLOCK, &n) && n > 0) {
+    for (uint32_t i = 0; i < n; i++)
+      prefix[(block[(size_t)i * in->dimensions] - min) / width + 1]++;
+  }
+  if (in->next < in->n_points) {
+    free(prefix);
+    return 0;
+  }
+  for (uint32_t b = 0; b < n_bins; b++)
+    prefix[b + 1] += prefix[b];
+
+  // The halo of bins a..e-1 lies in the `reach` bins on either side.
+  uint32_t reach = (uint32_t)(((int64_t)eps + width - 1) / width);
+  Strip *strips = NULL;
+  uint32_t n_strips = 0;
+  for (uint32_t a = 0, e; a < n_bins; a = e) {
+    uint32_t first = a > reach ? a - reach : 0;
+    for (e = a; e < n_bins; e++) {
+      uint32_t last = e + 1 + reach < n_bins ? e + 1 + reach : n_bins;
+      if (prefix[last] - prefix[first] > capacity)
+        break;
+    }
+    if (e == a) {
+      uint32_t last = a + 1 + reach < n_bins ? a + 1 + reach : n_bins;
+      fprintf(stderr, "Memory budget too small: %llu points lie within eps of a single %lld-wide strip, %llu fit\n",
+              (unsigned long long)(prefix[last] - prefix[first]), (long long)width, (unsigned long long)capacity);
+      free(prefix);
+      free(strips);
+      return 0;
+    }
+    strips = (Strip *)realloc(strips, (n_strips + 1) * sizeof(Strip));
+    if (!strips) {
+      fprintf(stderr, "Failed to allocate memory for strips\n");
+      free(prefix);
+      return 0;
+    }
+    strips[n_strips].lo = min + (int64_t)a * width;
+    strips[n_strips].hi = min + (int64_t)e * width;
+    strips[n_strips].n_loaded = 0;
+    strips[n_strips].n_links = 0;
+    strips[n_strips].record_offset = 0;
+    n_strips++;
+  }
+  free(prefix);
+  *out = strips;
+  return n_strips;
+}
+
+// Writes every point, with its id, to the file of each strip that loads it, for MAX_OPEN_STRIPS strips per pass
+// over the input. Returns the bytes written, or 0 after printing the reason.
+static uint64_t partition_points(PointStream *in, int32_t *block, Strip *strips, uint32_t n_strips, uint32_t eps,
+                                 const char *prefix) {
+  FILE *files[MAX_OPEN_STRIPS];
+  uint64_t written = 0;
+  size_t record = (1 + (size_t)dimensions) * sizeof(int32_t);
+  char path[256];
+  for (uint32_t group = 0; group < n_strips; group += MAX_OPEN_STRIPS) {
+    uint32_t end = group + MAX_OPEN_STRIPS < n_strips ? group + MAX_OPEN_STRIPS : n_strips;
+    for (uint32_t s = group; s < end; s++) {
+      strip_path(path, sizeof(path), prefix, s, "pts");
+      if (!(files[s - group] = fopen(path, "wb"))) {
+        perror("Error creating strip file");
+        return 0;
+      }
+    }
+    uint32_t n, ok = rewind_point_stream(in);
+    while (ok && (ok = read_point_block(in, block, STREAM_BLOCK, &n)) && n > 0) {
+      for (uint32_t i = 0; i < n; i++) {
+        const int32_t *x = block + (size_t)i * dimensions;
+        uint32_t id = in->next - n + i, owner = owner_strip(strips, n_strips, x[0]);
+        uint32_t s = owner, t = owner;
+        while (s > 0 && x[0] < strips[s - 1].hi + eps)
+          s--;
+        while (t + 1 < n_strips && x[0] >= strips[t + 1].lo - eps)
+          t++;
+        for (s = s > group ? s : group; s <= t && s < end; s++) {
+          FILE *f = files[s - group];
+          ok = ok && fwrite(&id, sizeof(id), 1, f) == 1 && fwrite(x, sizeof(int32_t), dimensions, f) == (size_t)dimensions;
+          strips[s].n_loaded++;
+          written += record;
+        }
+      }
+    }
+    for (uint32_t s = group; s < end; s++)
+      ok = (fclose(files[s - group]) == 0) && ok;
+    if (!ok) {
+      fprintf(stderr, "Error writing strip files\n");
+      return 0;
+    }
+  }
+  return written;
+}
+
+// Loads strip s and builds the grid index and coordinate arrays over its points. ids and x are row-major like the
+// input; points[i] is the point with id ids[i], in id order.
+static int load_strip(const Strip *strip, uint32_t s, const char *prefix, uint32_t eps, int32_t *block, uint32_t **ids,
+                      int32_t **x, Point **points) {
+  uint32_t n = strip->n_loaded;
+  *ids = (uint32_t *)malloc((n + 1) * sizeof(uint32_t));
+  *x = (int32_t *)malloc(((size_t)n * dimensions + 1) * sizeof(int32_t));
+  *points = (Point *)malloc((n + 1) * sizeof(Point));
+  match_buffer = (uint32_t *)malloc((n + 16) * sizeof(uint32_t));
+  if (!*ids || !*x || !*points || !match_buffer) {
+    fprintf(stderr, "Failed to allocate memory for strip %u\n", s);
+    return 0;
+  }
+  char path[256];
+  strip_path(path, sizeof(path), prefix, s, "pts");
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror("Error opening strip file");
+    return 0;
+  }
+  size_t words = 1 + (size_t)dimensions;
+  for (uint32_t done = 0; done < n;) {
+    uint32_t count = n - done < STREAM_BLOCK ? n - done : STREAM_BLOCK;
+    if (fread(block, words * sizeof(int32_t), count, f) != count) {
+      fprintf(stderr, "Error reading strip file %s\n", path);
+      fclose(f);
+      return 0;
+    }
+    for (uint32_t i = 0; i < count; i++, done++) {
+      (*ids)[done] = (uint32_t)block[i * words];
+      memcpy(*x + (size_t)done * dimensions, block + i * words + 1, dimensions * sizeof(int32_t));
+    }
+  }
+  fclose(f);
+  for (uint32_t i = 0; i < n; i++) {
+    (*points)[i].x = *x + (size_t)i * dimensions;
+    (*points)[i].cluster = UNCLASSIFIED;
+  }
+  if (!build_grid_index(&grid, *points, (int)n, eps) || !build_coord_arrays(&coords, *points, (int)n, NULL)) {
+    fprintf(stderr, "Failed to allocate the index of strip %u\n", s);
+    return 0;
+  }
+  return 1;
+}
+
+static void free_strip(uint32_t *ids, int32_t *x, Point *points) {
+  free_grid_index(&grid);
+  free_coord_arrays(&coords);
+  free(match_buffer);
+  match_buffer = NULL;
+  free(ids);
+  free(x);
+  free(points);
+}
+
+// Writes the strip-local ids of all points within eps of point_id, itself included, to out and returns how many
+// there are; out needs 16 spare slots past the last one.
+static uint32_t strip_neighbors(const Point *points, int n_points, int point_id, uint32_t eps_squared, uint32_t *out) {
+  uint32_t begin[3], end[3], n = 0;
+  int runs = candidate_runs(n_points, point_id, begin, end);
+  for (int r = 0; r < runs; r++) {
+    COUNT(distance_evaluations, end[r] - begin[r]);
+    n += collect_kernel((const int32_t *const *)coords.axis, begin[r], end[r], points[point_id].x, eps_squared, out + n);
+  }
+  COUNT(region_queries, 1);
+  COUNT(neighbors_returned, n);
+  for (uint32_t j = 0; j < n; j++)
+    out[j] = grid.cell_points[out[j]];
+  return n;
+}
+
+static uint32_t new_local_cluster(void) {
+  if (n_local_clusters == local_cluster_capacity) {
+    local_cluster_capacity = local_cluster_capacity ? local_cluster_capacity * 2 : 1024;
+    cluster_parent = (uint32_t *)realloc(cluster_parent, local_cluster_capacity * sizeof(uint32_t));
+    cluster_min_id = (uint32_t *)realloc(cluster_min_id, local_cluster_capacity * sizeof(uint32_t));
+    if (!cluster_parent || !cluster_min_id) {
+      fprintf(stderr, "Failed to allocate memory for local clusters\n");
+      exit(1);
+    }
+  }
+  cluster_parent[n_local_clusters] = n_local_clusters;
+  cluster_min_id[n_local_clusters] = UINT32_MAX;
+  return n_local_clusters++;
+}
+
+static uint32_t find_cluster(uint32_t c) {
+  while (cluster_parent[c] != c) {
+    cluster_parent[c] = cluster_parent[cluster_parent[c]];
+    c = cluster_parent[c];
+  }
+  return c;
+}
+
+static void union_clusters(uint32_t a, uint32_t b) {
+  a = find_cluster(a);
+  b = find_cluster(b);
+  if (a == b)
+    return;
+  if (cluster_min_id[b] < cluster_min_id[a])
+    cluster_min_id[a] = cluster_min_id[b];
+  cluster_parent[b] = a;
+}
+
+// First strip pass: marks the own core points of strip s in core_bits (indexed by id).
+static int find_strip_cores(const Strip *strips, uint32_t s, const char *prefix, uint32_t eps, int min_pts,
+                            int32_t *block, uint8_t *core_bits) {
+  uint32_t *ids;
+  int32_t *x;
+  Point *points;
+  int n = (int)strips[s].n_loaded;
+  if (!load_strip(&strips[s], s, prefix, eps, block, &ids, &x, &points))
+    return 0;
+  for (int i = 0; i < n; i++) {
+    if (points[i].x[0] >= strips[s].lo && points[i].x[0] < strips[s].hi &&
+        count_neighbors(points, n, i, eps * eps, min_pts) >= (uint32_t)min_pts)
+      core_bits[ids[i] >> 3] |= (uint8_t)(1u << (ids[i] & 7));
+  }
+  free_strip(ids, x, points);
+  return 1;
+}
+
+// Second strip pass: connects the core points of strip s into new local clusters. Every own point gets a record
+// (id, k, k local clusters) in the strip's cluster file: its own cluster if it is core, else the clusters of its
+// core neighbours. Every halo core point gets an (owner strip, id, local cluster) record in links.
+static int connect_strip(Strip *strips, uint32_t n_strips, uint32_t s, const char *prefix, uint32_t eps,
+                         int32_t *block, const uint8_t *core_bits, FILE *links) {
+  uint32_t *ids;
+  int32_t *x;
+  Point *points;
+  int n = (int)strips[s].n_loaded;
+  if (!load_strip(&strips[s], s, prefix, eps, block, &ids, &x, &points))
+    return 0;
+  uint8_t *core = (uint8_t *)malloc(n + 1);
+  uint32_t *cluster = (uint32_t *)malloc((n + 1) * sizeof(uint32_t));
+  IntVector *stack = create_int_vector(n + 1);
+  char path[256];
+  strip_path(path, sizeof(path), prefix, s, "clu");
+  FILE *out = fopen(path, "wb");
+  if (!core || !cluster || !stack || !out) {
+    fprintf(stderr, "Failed to set up clustering of strip %u\n", s);
+    return 0;
+  }
+  for (int i = 0; i < n; i++) {
+    core[i] = (core_bits[ids[i] >> 3] >> (ids[i] & 7)) & 1;
+    cluster[i] = NO_CLUSTER;
+  }
+
+  // Halo core points start clusters too: a border point may only reach the core points of another strip.
+  int64_t lo = strips[s].lo, hi = strips[s].hi;
+  for (int i = 0; i < n; i++) {
+    if (!core[i] || cluster[i] != NO_CLUSTER)
+      continue;
+    uint32_t c = new_local_cluster();
+    cluster[i] = c;
+    stack->size = 0;
+    push_back(stack, i);
+    while (stack->size > 0) {
+      uint32_t j = stack->data[--stack->size];
+      if (points[j].x[0] >= lo && points[j].x[0] < hi && ids[j] < cluster_min_id[c])
+        cluster_min_id[c] = ids[j];
+      uint32_t m = strip_neighbors(points, n, j, eps * eps, match_buffer);
+      for (uint32_t k = 0; k < m; k++) {
+        uint32_t q = match_buffer[k];
+        if (core[q] && cluster[q] == NO_CLUSTER) {
+          cluster[q] = c;
+          push_back(stack, q);
+        }
+      }
+    }
+  }
+
+  int ok = 1;
+  for (int i = 0; i < n && ok; i++) {
+    if (points[i].x[0] < lo || points[i].x[0] >= hi) {
+      if (core[i]) {
+        uint32_t link[3] = {owner_strip(strips, n_strips, points[i].x[0]), ids[i], cluster[i]};
+        ok = fwrite(link, sizeof(link), 1, links) == 1;
+        strips[link[0]].n_links++;
+      }
+      continue;
+    }
+    uint32_t k = 0;
+    if (core[i]) {
+      match_buffer[k++] = cluster[i];
+    } else {
+      uint32_t m = strip_neighbors(points, n, i, eps * eps, match_buffer);
+      for (uint32_t j = 0; j < m; j++) {
+        uint32_t q = match_buffer[j], seen = 0;
+        if (!core[q])
+          continue;
+        for (uint32_t t = 0; t < k && !seen; t++)
+          seen = match_buffer[t] == cluster[q];
+        if (!seen)
+          match_buffer[k++] = cluster[q];
+      }
+    }
+    ok = ok && fwrite(&ids[i], sizeof(uint32_t), 1, out) == 1 && fwrite(&k, sizeof(k), 1, out) == 1 &&
+         fwrite(match_buffer, sizeof(uint32_t), k, out) == k;
+  }
+  ok = (fclose(out) == 0) && ok;
+  if (!ok)
+    fprintf(stderr, "Error writing the cluster file of strip %u\n", s);
+  free(core);
+  free(cluster);
+  free_int_vector(stack);
+  free_strip(ids, x, points);
+  return ok;
+}
+
+static int compare_pairs(const void *a, const void *b) {
+  const uint32_t *x = (const uint32_t *)a, *y = (const uint32_t *)b;
+  if (x[0] != y[0])
+    return x[0] < y[0] ? -1 : 1;
+  return (x[1] > y[1]) - (x[1] < y[1]);
+}
+
+// Joins each halo core point's local cluster to the one of its own strip. The links are read for a group of strips
+// at a time, at most max_links of them (or one strip's), sorted by (owner, id) and matched against the owners'
+// cluster files, which are in id order.
+static int merge_links(const char *path, const Strip *strips, uint32_t n_strips, const char *prefix,
+                       uint64_t max_links) {
+  char clu_path[256];
+  int ok = 1;
+  for (uint32_t group = 0, end; ok && group < n_strips; group = end) {
+    uint64_t n_links = strips[group].n_links;
+    for (end = group + 1; end < n_strips && n_links + strips[end].n_links <= max_links; end++)
+      n_links += strips[end].n_links;
+    if (n_links == 0)
+      continue;
+    uint32_t *links = (uint32_t *)malloc(n_links * 3 * sizeof(uint32_t));
+    FILE *f = fopen(path, "rb");
+    if (!links || !f) {
+      fprintf(stderr, "Failed to read the boundary links\n");
+      if (f)
+        fclose(f);
+      free(links);
+      return 0;
+    }
+    uint64_t n = 0;
+    uint32_t link[3];
+    while (n < n_links && fread(link, sizeof(link), 1, f) == 1) {
+      if (link[0] >= group && link[0] < end)
+        memcpy(&links[3 * n++], link, sizeof(link));
+    }
+    fclose(f);
+    qsort(links, n, 3 * sizeof(uint32_t), compare_pairs);
+
+    uint64_t next = 0;
+    for (uint32_t t = group; ok && t < end; t++) {
+      strip_path(clu_path, sizeof(clu_path), prefix, t, "clu");
+      FILE *records = fopen(clu_path, "rb");
+      uint32_t head[2], c = NO_CLUSTER;
+      ok = records != NULL;
+      while (ok && next < n && links[3 * next] == t && fread(head, sizeof(head), 1, records) == 1) {
+        for (uint32_t k = 0; ok && k < head[1]; k++)
+          ok = fread(&c, sizeof(c), 1, records) == 1;
+        for (; next < n && links[3 * next] == t && links[3 * next + 1] == head[0]; next++)
+          union_clusters(links[3 * next + 2], c);
+      }
+      if (records)
+        fclose(records);
+    }
+    ok = ok && next == n;
+    if (!ok)
+      fprintf(stderr, "Error matching the boundary links to the strip cluster files\n");
+    free(links);
+  }
+  return ok;
+}
+
+// Numbers the clusters from 1 in the order of their smallest core point, as the in-memory run does.
+static int number_clusters(uint32_t *n_clusters) {
+  uint32_t *pairs = (uint32_t *)malloc(((size_t)n_local_clusters + 1) * 2 * sizeof(uint32_t));
+  cluster_number = (uint32_t *)malloc(((size_t)n_local_clusters + 1) * sizeof(uint32_t));
+  if (!pairs || !cluster_number) {
+    fprintf(stderr, "Failed to allocate memory for the cluster numbers\n");
+    free(pairs);
+    return 0;
+  }
+  uint32_t n_roots = 0;
+  for (uint32_t c = 0; c < n_local_clusters; c++) {
+    if (find_cluster(c) == c && cluster_min_id[c] != UINT32_MAX) {
+      pairs[2 * n_roots] = cluster_min_id[c];
+      pairs[2 * n_roots++ + 1] = c;
+    }
+  }
+  qsort(pairs, n_roots, 2 * sizeof(uint32_t), compare_pairs);
+  for (uint32_t r = 0; r < n_roots; r++)
+    cluster_number[pairs[2 * r + 1]] = r + 1;
+  free(pairs);
+  *n_clusters = n_roots;
+  return 1;
+}
+
+// Assembles the labels LABEL_CHUNK ids at a time from the strips' cluster files and appends them to fd: a point
+// takes the smallest cluster among the local clusters of its record, or NOISE if there are none.
+static int write_strip_labels(int fd, Strip *strips, uint32_t n_strips, uint32_t n_points, const char *prefix) {
+  int32_t *labels = (int32_t *)malloc(LABEL_CHUNK * sizeof(int32_t));
+  if (!labels) {
+    fprintf(stderr, "Failed to allocate memory for labels\n");
+    return 0;
+  }
+  char path[256];
+  int ok = 1;
+  for (uint32_t first = 0; ok && first < n_points; first += LABEL_CHUNK) {
+    uint32_t count = n_points - first < LABEL_CHUNK ? n_points - first : LABEL_CHUNK;
+    for (uint32_t s = 0; ok && s < n_strips; s++) {
+      if (strips[s].record_offset < 0)
+        continue;
+      strip_path(path, sizeof(path), prefix, s, "clu");
+      FILE *f = fopen(path, "rb");
+      ok = f && fseek(f, strips[s].record_offset, SEEK_SET) == 0;
+      uint32_t head[2];
+      while (ok) {
+        long offset = ftell(f);
+        if (fread(head, sizeof(head), 1, f) != 1) {
+          strips[s].record_offset = -1;
+          break;
+        }
+        if (head[0] >= first + count) {
+          strips[s].record_offset = offset;
+          break;
+        }
+        int32_t label = NOISE;
+        for (uint32_t k = 0, c; ok && k < head[1]; k++) {
+          ok = fread(&c, sizeof(c), 1, f) == 1;
+          int32_t number = (int32_t)cluster_number[find_cluster(c)];
+          if (label == NOISE || number < label)
+            label = number;
+        }
+        labels[head[0] - first] = label;
+      }
+      if (f)
+        fclose(f);
+    }
+    if (!ok)
+      fprintf(stderr, "Error reading strip cluster files\n");
+    ok = ok && append_labels(fd, labels, sizeof(int32_t), count, label_format);
+  }
+  free(labels);
+  return ok;
+}
+
+static void remove_strip_files(const char *prefix, uint32_t n_strips) {
+  char path[256];
+  for (uint32_t s = 0; s < n_strips; s++) {
+    strip_path(path, sizeof(path), prefix, s, "pts");
+    remove(path);
+    strip_path(path, sizeof(path), prefix, s, "clu");
+    remove(path);
+  }
+  snprintf(path, sizeof(path), "%s_links.tmp", prefix);
+  remove(path);
+}
+
+int dbscan_out_of_core(const char *data_file, uint32_t eps, int min_pts, const char *output_prefix) {
+  struct timeval start, step;
+  gettimeofday(&start, NULL);
+  PointStream in;
+  if (!open_point_stream(data_file, &in))
+    return 1;
+  dimensions = in.dimensions;
+  uint32_t n_points = in.n_points;
+  kernel_kind = select_kernels(kernel_kind, dimensions);
+  if (kernel_kind < 0) {
+    fprintf(stderr, "Requested distance kernel is not supported on this CPU\n");
+    return 1;
+  }
+
+  // The core flags, the I/O blocks, the histogram and the label chunk stay allocated throughout; a quarter of the
+  // rest is left for the local clusters.
+  size_t block_words = (size_t)STREAM_BLOCK * (1 + dimensions);
+  uint64_t fixed = n_points / 8 + 1 + block_words * sizeof(int32_t) + (HISTOGRAM_BINS + 1) * sizeof(uint64_t) +
+                   LABEL_CHUNK * (sizeof(int32_t) + 12) + (uint64_t)MAX_OPEN_STRIPS * BUFSIZ;
+  uint64_t capacity =
+      memory_budget > fixed ? (memory_budget - fixed) / 4 * 3 / STRIP_POINT_BYTES(dimensions) : 0;
+  int32_t *block = (int32_t *)malloc(block_words * sizeof(int32_t));
+  uint8_t *core_bits = (uint8_t *)calloc(n_points / 8 + 1, 1);
+  if (!block || !core_bits) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return 1;
+  }
+
+  gettimeofday(&step, NULL);
+  Strip *strips = NULL;
+  uint32_t n_strips = capacity > 0 ? plan_strips(&in, block, eps, capacity, &strips) : 0;
+  if (n_strips == 0) {
+    if (capacity == 0)
+      fprintf(stderr, "Memory budget too small: the fixed buffers alone need %llu MB\n",
+              (unsigned long long)(fixed >> 20) + 1);
     return 1;
   }
+  uint64_t spilled = partition_points(&in, block, strips, n_strips, eps, output_prefix);
+  double partition_time = elapsed(&step);
+  uint64_t bytes_read = in.bytes_read;
+  close_point_stream(&in);
+  int ok = spilled > 0;
+  uint32_t max_loaded = 0;
+  uint64_t halo = 0;
+  for (uint32_t s = 0; s < n_strips; s++) {
+    max_loaded = strips[s].n_loaded > max_loaded ? strips[s].n_loaded : max_loaded;
+    halo += strips[s].n_loaded;
+  }
+  halo -= n_points;
+
+  HardwareCounters hardware;
+  start_hardware_counters(&hardware);
+  gettimeofday(&step, NULL);
+  for (uint32_t s = 0; ok && s < n_strips; s++)
+    ok = find_strip_cores(strips, s, output_prefix, eps, min_pts, block, core_bits);
+  double core_time = elapsed(&step);
+
+  gettimeofday(&step, NULL);
+  char links_path[256];
+  snprintf(links_path, sizeof(links_path), "%s_links.tmp", output_prefix);
+  FILE *links = ok ? fopen(links_path, "wb") : NULL;
+  ok = links != NULL;
+  for (uint32_t s = 0; ok && s < n_strips; s++)
+    ok = connect_strip(strips, n_strips, s, output_prefix, eps, block, core_bits, links);
+  if (links)
+    ok = (fclose(links) == 0) && ok;
+  double connect_time = elapsed(&step);
 
-  char *data_file = argv[1];
-  uint32_t eps = atoi(argv[2]);
-  int min_pts = atoi(argv[3]);
-  char *output_prefix = argv[4];
+  // A link and its place in the sort take 24 bytes.
+  gettimeofday(&step, NULL);
+  uint32_t n_clusters = 0;
+  uint64_t n_links = 0;
+  for (uint32_t s = 0; s < n_strips; s++)
+    n_links += strips[s].n_links;
+  ok = ok && merge_links(links_path, strips, n_strips, output_prefix, capacity * STRIP_POINT_BYTES(dimensions) / 24) &&
+       number_clusters(&n_clusters);
+  double merge_time = elapsed(&step);
+  stop_hardware_counters(&hardware);
+  double time_taken = elapsed(&start);
 
-  int n_points = 0;
-  int max_points = 1000000;
-  Point *points = (Point *)malloc(max_points * sizeof(Point));
+  char labels_output_file[256];
+  snprintf(labels_output_file, sizeof(labels_output_file), "%s_labels.%s", output_prefix,
+           label_extension(label_format));
+  gettimeofday(&step, NULL);
+  if (ok) {
+    int fd = open(labels_output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+      perror("Error opening labels output file");
+    ok = fd >= 0 && write_strip_labels(fd, strips, n_strips, n_points, output_prefix);
+    if (fd >= 0 && close(fd) != 0 && ok) {
+      perror("Error writing labels output file");
+      ok = 0;
+    }
+  }
+  double labels_time = elapsed(&step);
+  remove_strip_files(output_prefix, n_strips);
+  if (!ok)
+    return 1;
 
-  // Load data from CSV file
-  FILE *file = fopen(data_file, "r");
-  if (file == NULL) {
-    printf("Error opening data file\n");
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  char result_file[256];
+  snprintf(result_file, sizeof(result_file), "%s_result.txt", output_prefix);
+  FILE *result = fopen(result_file, "w");
+  if (result == NULL) {
+    printf("Error opening result file\n");
     return 1;
   }
+  fprintf(result, "DBSCAN completed in %f seconds\n", time_taken);
+  fprintf(result, "Index: grid\n");
+  fprintf(result, "Out of core: %u strips along the first coordinate, memory budget %llu MB, peak RSS %ld MB\n",
+          n_strips, (unsigned long long)(memory_budget >> 20), usage.ru_maxrss / 1024);
+  fprintf(result, "Strips: at most %u points loaded, %llu halo copies in total\n", max_loaded,
+          (unsigned long long)halo);
+  fprintf(result, "Partitioned in %f seconds (%llu bytes written to strip files)\n", partition_time,
+          (unsigned long long)spilled);
+  fprintf(result, "Core points found in %f seconds, strips connected in %f seconds (%u local clusters)\n", core_time,
+          connect_time, n_local_clusters);
+  fprintf(result, "Boundary merge: %llu links in %f seconds, %u clusters\n", (unsigned long long)n_links,
+          merge_time, n_clusters);
+  fprintf(result, "Input: binary, streamed (%llu bytes read)\n", (unsigned long long)bytes_read);
+  fprintf(result, "Dimensions: %d\n", dimensions);
+  fprintf(result, "Distance kernel: %s (%s)\n", kernel_names[kernel_kind],
+          kernel_specialized ? "specialized for this dimension" : "generic");
+  fprintf(result, "Labels: %s, written in %f seconds\n", label_format_name(label_format), labels_time);
+  // Reading the input includes spilling it to the strip files; each strip builds its grid while it is clustered.
+  PhaseTimes phases;
+  init_phase_times(&phases);
+  phases.seconds[PHASE_LOAD] = partition_time;
+  phases.seconds[PHASE_CORE] = core_time;
+  phases.seconds[PHASE_EXPANSION] = connect_time + merge_time;
+  phases.seconds[PHASE_OUTPUT] = labels_time;
+  print_phase_times(result, &phases, n_points);
+  print_counters(result, &hardware, 0);
+  fclose(result);
+
+  printf("Results saved to %s\n", result_file);
+  printf("Predicted labels saved to %s\n", labels_output_file);
+
+  free(strips);
+  free(block);
+  free(core_bits);
+  free(cluster_parent);
+  free(cluster_min_id);
+  free(cluster_number);
+  return 0;
+}
 
-  while (fscanf(file, "%d,%d", &points[n_points].x[0], &points[n_points].x[1]) == 2) {
-    points[n_points].cluster = UNCLASSIFIED;
-    n_points++;
-    if (n_points >= max_points) {
-      max_points *= 2;
-      points = (Point *)realloc(points, max_points * sizeof(Point));
+// Sharded clustering (-w): the points are cut along the first coordinate into one shard per worker process, with
+// equal numbers of own points. Each worker indexes its shard and halo, points less than eps outside it. The worker
+// shares the input and three arrays indexed by id with the coordinator: core flags, the local cluster of each own
+// core point, and the labels. Control messages and the merge data travel over one Unix socket pair per worker. The
+// run has three phases, and the coordinator waits for every worker at the end of each:
+// 1. Each worker marks its own core points.
+// 2. Each worker runs dbscan() on its shard and halo with those flags. It reports its local clusters and, for every
+//    halo core point, the local cluster it joined. The coordinator ties each halo core point's cluster to the one of
+//    its own shard with the disjoint set of the out-of-core mode, and numbers the clusters.
+// 3. Each worker labels its own points: border points take the smallest cluster among their core neighbours. The
+//    labels are those of the in-memory run.
+typedef struct {
+  uint32_t n_own, n_loaded;
+  uint32_t n_clusters, n_links;
+  double seconds[3]; // time of each phase
+  HotCounters counters; // sent with the last report
+} WorkerReport;
+
+int n_workers = 0; // worker processes for sharded clustering (-w); 0 clusters in this process
+WorkerReport *worker_reports;
+
+static int send_all(int fd, const void *data, size_t size) {
+  for (const char *p = (const char *)data; size > 0;) {
+    ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+    if (n <= 0)
+      return 0;
+    p += n;
+    size -= (size_t)n;
+  }
+  return 1;
+}
+
+static int recv_all(int fd, void *data, size_t size) {
+  for (char *p = (char *)data; size > 0;) {
+    ssize_t n = read(fd, p, size);
+    if (n <= 0)
+      return 0;
+    p += n;
+    size -= (size_t)n;
+  }
+  return 1;
+}
+
+static void *map_shared(size_t size) {
+  void *p = mmap(NULL, size > 0 ? size : 1, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+// Cuts the first axis at histogram bin boundaries into n_shards shards of about n_points / n_shards points each
+// (some may be empty).
+static Strip *plan_shards(const Point *points, uint32_t n_points, int n_shards) {
+  int64_t min = INT64_MAX, max = INT64_MIN;
+  for (uint32_t i = 0; i < n_points; i++) {
+    min = points[i].x[0] < min ? points[i].x[0] : min;
+    max = points[i].x[0] > max ? points[i].x[0] : max;
+  }
+  int64_t width = n_points > 0 ? (max - min + HISTOGRAM_BINS) / HISTOGRAM_BINS : 1;
+  uint32_t n_bins = n_points > 0 ? (uint32_t)((max - min) / width + 1) : 1;
+  uint32_t *histogram = (uint32_t *)calloc(n_bins, sizeof(uint32_t));
+  Strip *shards = (Strip *)calloc(n_shards, sizeof(Strip));
+  if (!histogram || !shards) {
+    free(histogram);
+    free(shards);
+    return NULL;
+  }
+  for (uint32_t i = 0; i < n_points; i++)
+    histogram[(points[i].x[0] - min) / width]++;
+  uint64_t seen = 0;
+  uint32_t b = 0;
+  for (int s = 0; s < n_shards; s++) {
+    shards[s].lo = min + (int64_t)b * width;
+    for (; b < n_bins && (s == n_shards - 1 || seen < (uint64_t)n_points * (s + 1) / n_shards); b++)
+      seen += histogram[b];
+    shards[s].hi = min + (int64_t)b * width;
+  }
+  free(histogram);
+  return shards;
+}
+
+// Worker process w: runs the three phases on its shard and reports to the coordinator over sock.
+static int run_worker(int sock, const Strip *shard, Point *all, uint32_t n_points, uint32_t eps, int min_pts,
+                      uint8_t *core, uint32_t *core_cluster, int32_t *labels) {
+  WorkerReport report = {0};
+  struct timeval step;
+  gettimeofday(&step, NULL);
+  int64_t lo = shard->lo, hi = shard->hi;
+  for (uint32_t i = 0; i < n_points; i++)
+    report.n_loaded += all[i].x[0] >= lo - eps && all[i].x[0] < hi + eps;
+  int n = (int)report.n_loaded;
+  uint32_t *ids = (uint32_t *)malloc((n + 1) * sizeof(uint32_t));
+  Point *points = (Point *)malloc((n + 1) * sizeof(Point));
+  uint8_t *mask = (uint8_t *)malloc(n + 1);
+  if (!ids || !points || !mask)
+    return 0;
+  for (uint32_t i = 0, k = 0; i < n_points; i++) {
+    if (all[i].x[0] >= lo - eps && all[i].x[0] < hi + eps) {
+      ids[k] = i;
+      points[k].x = all[i].x;
+      points[k++].cluster = UNCLASSIFIED;
+    }
+  }
+  match_buffer = (uint32_t *)malloc((n + 16) * sizeof(uint32_t));
+  if (!match_buffer || !build_grid_index(&grid, points, n, eps) || !build_coord_arrays(&coords, points, n, NULL))
+    return 0;
+  uint32_t eps_squared = eps * eps;
+  for (int i = 0; i < n; i++) {
+    if (points[i].x[0] >= lo && points[i].x[0] < hi) {
+      report.n_own++;
+      core[ids[i]] = count_neighbors(points, n, i, eps_squared, min_pts) >= (uint32_t)min_pts;
+    }
+  }
+  free(match_buffer);
+  report.seconds[0] = elapsed(&step);
+  uint32_t go;
+  if (!send_all(sock, &report, sizeof(report)) || !recv_all(sock, &go, sizeof(go)))
+    return 0;
+
+  gettimeofday(&step, NULL);
+  for (int i = 0; i < n; i++)
+    mask[i] = core[ids[i]];
+  core_mask = mask;
+  dbscan(points, n, eps, min_pts);
+  core_mask = NULL;
+  uint32_t *min_id = NULL, *links = (uint32_t *)malloc((2 * (size_t)n + 1) * sizeof(uint32_t));
+  if (!links)
+    return 0;
+  for (int i = 0; i < n; i++) {
+    if (!mask[i])
+      continue;
+    uint32_t c = (uint32_t)points[i].cluster - 1;
+    if (c >= report.n_clusters) {
+      if (!(min_id = (uint32_t *)realloc(min_id, (c + 1) * sizeof(uint32_t))))
+        return 0;
+      for (; report.n_clusters <= c; report.n_clusters++)
+        min_id[report.n_clusters] = UINT32_MAX;
+    }
+    if (points[i].x[0] >= lo && points[i].x[0] < hi) {
+      core_cluster[ids[i]] = c;
+      min_id[c] = ids[i] < min_id[c] ? ids[i] : min_id[c];
+    } else {
+      links[2 * report.n_links] = ids[i];
+      links[2 * report.n_links++ + 1] = c;
     }
   }
-  fclose(file);
+  report.seconds[1] = elapsed(&step);
+  int32_t *numbers = (int32_t *)malloc((report.n_clusters + 1) * sizeof(int32_t));
+  if (!numbers || !send_all(sock, &report, sizeof(report)) ||
+      !send_all(sock, min_id, report.n_clusters * sizeof(uint32_t)) ||
+      !send_all(sock, links, 2 * (size_t)report.n_links * sizeof(uint32_t)) ||
+      !recv_all(sock, numbers, report.n_clusters * sizeof(int32_t)))
+    return 0;
+
+  gettimeofday(&step, NULL);
+  match_buffer = (uint32_t *)malloc((n + 16) * sizeof(uint32_t));
+  if (!match_buffer)
+    return 0;
+  for (int i = 0; i < n; i++) {
+    if (points[i].x[0] < lo || points[i].x[0] >= hi)
+      continue;
+    int32_t label = NOISE;
+    if (mask[i]) {
+      label = numbers[points[i].cluster - 1];
+    } else if (points[i].cluster != NOISE) {
+      uint32_t m = strip_neighbors(points, n, i, eps_squared, match_buffer);
+      for (uint32_t j = 0; j < m; j++) {
+        uint32_t q = match_buffer[j];
+        if (mask[q] && (label == NOISE || numbers[points[q].cluster - 1] < label))
+          label = numbers[points[q].cluster - 1];
+      }
+    }
+    labels[ids[i]] = label;
+  }
+  report.seconds[2] = elapsed(&step);
+  report.counters = hot_counters;
+  return send_all(sock, &report, sizeof(report));
+}
+
+// Clusters points with n_workers worker processes and stores the labels in points[i].cluster.
+int dbscan_sharded(Point *points, uint32_t n_points, uint32_t eps, int min_pts, uint32_t *n_links,
+                   double *phase_seconds) {
+  Strip *shards = plan_shards(points, n_points, n_workers);
+  uint8_t *core = (uint8_t *)map_shared(n_points);
+  uint32_t *core_cluster = (uint32_t *)map_shared((size_t)n_points * sizeof(uint32_t));
+  int32_t *labels = (int32_t *)map_shared((size_t)n_points * sizeof(int32_t));
+  int *socks = (int *)malloc(n_workers * sizeof(int));
+  pid_t *pids = (pid_t *)malloc(n_workers * sizeof(pid_t));
+  worker_reports = (WorkerReport *)calloc(n_workers, sizeof(WorkerReport));
+  if (!shards || !core || !core_cluster || !labels || !socks || !pids || !worker_reports) {
+    fprintf(stderr, "Failed to allocate memory for the workers\n");
+    return 0;
+  }
+
+  struct timeval step;
+  gettimeofday(&step, NULL);
+  fflush(NULL);
+  int ok = 1, started = 0;
+  for (; started < n_workers; started++) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0 || (pids[started] = fork()) < 0) {
+      perror("Failed to start a worker");
+      ok = 0;
+      break;
+    }
+    if (pids[started] == 0) {
+      close(pair[0]);
+      for (int k = 0; k < started; k++)
+        close(socks[k]);
+      _exit(run_worker(pair[1], &shards[started], points, n_points, eps, min_pts, core, core_cluster,
+                       labels)
+                ? 0
+                : 1);
+    }
+    close(pair[1]);
+    socks[started] = pair[0];
+  }
+
+  // Phase 1: wait until every worker has marked its core points, then let them all continue.
+  uint32_t go = 1;
+  for (int w = 0; ok && w < started; w++)
+    ok = recv_all(socks[w], &worker_reports[w], sizeof(WorkerReport));
+  for (int w = 0; ok && w < started; w++)
+    ok = send_all(socks[w], &go, sizeof(go));
+  phase_seconds[0] = elapsed(&step);
+
+  // Phase 2: collect the local clusters and the halo links.
+  gettimeofday(&step, NULL);
+  uint32_t *base = (uint32_t *)calloc(n_workers + 1, sizeof(uint32_t));
+  uint32_t **links = (uint32_t **)calloc(n_workers, sizeof(uint32_t *));
+  ok = ok && base && links;
+  for (int w = 0; ok && w < started; w++) {
+    WorkerReport *r = &worker_reports[w];
+    ok = recv_all(socks[w], r, sizeof(*r));
+    base[w] = n_local_clusters;
+    for (uint32_t c = 0; ok && c < r->n_clusters; c++)
+      new_local_cluster();
+    links[w] = ok ? (uint32_t *)malloc((2 * (size_t)r->n_links + 1) * sizeof(uint32_t)) : NULL;
+    ok = ok && links[w] && recv_all(socks[w], cluster_min_id + base[w], r->n_clusters * sizeof(uint32_t)) &&
+         recv_all(socks[w], links[w], 2 * (size_t)r->n_links * sizeof(uint32_t));
+  }
+  phase_seconds[1] = elapsed(&step);
+
+  // Each halo core point is an own core point of the shard that holds it.
+  gettimeofday(&step, NULL);
+  *n_links = 0;
+  for (int w = 0; ok && w < started; w++) {
+    for (uint32_t k = 0; k < worker_reports[w].n_links; k++) {
+      uint32_t id = links[w][2 * k];
+      uint32_t owner = owner_strip(shards, (uint32_t)n_workers, points[id].x[0]);
+      union_clusters(base[w] + links[w][2 * k + 1], base[owner] + core_cluster[id]);
+    }
+    *n_links += worker_reports[w].n_links;
+  }
+  uint32_t n_clusters;
+  ok = ok && number_clusters(&n_clusters);
+  for (int w = 0; ok && w < started; w++) {
+    uint32_t k = worker_reports[w].n_clusters;
+    int32_t *numbers = (int32_t *)malloc((k + 1) * sizeof(int32_t));
+    ok = numbers != NULL;
+    for (uint32_t c = 0; ok && c < k; c++)
+      numbers[c] = (int32_t)cluster_number[find_cluster(base[w] + c)];
+    ok = ok && send_all(socks[w], numbers, k * sizeof(int32_t));
+    free(numbers);
+  }
+  phase_seconds[2] = elapsed(&step);
+
+  // Phase 3: the workers label their own points.
+  gettimeofday(&step, NULL);
+  for (int w = 0; ok && w < started; w++) {
+    ok = recv_all(socks[w], &worker_reports[w], sizeof(WorkerReport));
+    add_counters(&hot_counters, &worker_reports[w].counters);
+  }
+  phase_seconds[3] = elapsed(&step);
+
+  for (int w = 0; w < started; w++) {
+    int status;
+    close(socks[w]);
+    ok = waitpid(pids[w], &status, 0) == pids[w] && WIFEXITED(status) && WEXITSTATUS(status) == 0 && ok;
+    free(links ? links[w] : NULL);
+  }
+  if (!ok)
+    fprintf(stderr, "A worker failed\n");
+  for (uint32_t i = 0; ok && i < n_points; i++)
+    points[i].cluster = labels[i];
+
+  munmap(core, n_points > 0 ? n_points : 1);
+  munmap(core_cluster, n_points > 0 ? (size_t)n_points * sizeof(uint32_t) : 1);
+  munmap(labels, n_points > 0 ? (size_t)n_points * sizeof(int32_t) : 1);
+  free(shards);
+  free(socks);
+  free(pids);
+  free(base);
+  free(links);
+  free(cluster_parent);
+  free(cluster_min_id);
+  free(cluster_number);
+  return ok;
+}
+
+void usage(const char *prog) {
+  printf("Usage: %s [-i grid|brute] [-k scalar|avx2|avx512] [-u on|off] [-r none|morton|hilbert] [-m budget_mb] [-w workers] [-o text|binary|mmap] [-e true_labels] <data_file> <eps> <min_pts> <output_prefix>\n", prog);
+  printf("  -i  neighbour search index (default: grid)\n");
+  printf("  -k  distance kernel (default: the widest one this CPU supports)\n");
+  printf("  -u  merge points with identical coordinates into weighted points before clustering (default: on)\n");
+  printf("  -r  sort the points along a space-filling curve before clustering (default: none, the input order)\n");
+  printf("  -m  cluster a binary point file out of core in strips, within this many megabytes of memory\n");
+  printf("      (grid index, points not coalesced or reordered, no -e)\n");
+  printf("  -w  cluster in this many worker processes, one shard of the first coordinate each\n");
+  printf("      (grid index, points not coalesced or reordered)\n");
+  printf("  -o  labels file format: text, or int32 binary written directly or through mmap (default: text)\n");
+  printf("  -e  ground-truth labels file; ARI and NMI are added to the result file\n");
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "i:k:u:r:m:w:o:e:")) != -1) {
+    switch (opt) {
+    case 'i':
+      if (strcmp(optarg, "grid") == 0) {
+        index_mode = INDEX_GRID;
+      } else if (strcmp(optarg, "brute") == 0) {
+        index_mode = INDEX_BRUTE;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'k':
+      kernel_kind = -2;
+      for (int k = KERNEL_SCALAR; k <= KERNEL_AVX512; k++) {
+        if (strcmp(optarg, kernel_names[k]) == 0)
+          kernel_kind = k;
+      }
+      if (kernel_kind == -2) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'u':
+      if (strcmp(optarg, "on") == 0) {
+        coalesce = 1;
+      } else if (strcmp(optarg, "off") == 0) {
+        coalesce = 0;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'r':
+      if (!parse_curve(optarg, &curve)) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'm':
+      memory_budget = strtoull(optarg, NULL, 10) << 20;
+      if (memory_budget == 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'w':
+      n_workers = atoi(optarg);
+      if (n_workers < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'e':
+      true_labels_file = optarg;
+      break;
+    case 'o':
+      if (!parse_label_format(optarg, &label_format)) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 4) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  char *data_file = argv[optind];
+  uint32_t eps = atoi(argv[optind + 1]);
+  int min_pts = atoi(argv[optind + 2]);
+  char *output_prefix = argv[optind + 3];
+  if (memory_budget > 0) {
+    if (index_mode != INDEX_GRID || curve != CURVE_NONE || true_labels_file) {
+      usage(argv[0]);
+      return 1;
+    }
+    return dbscan_out_of_core(data_file, eps, min_pts, output_prefix);
+  }
+  if (n_workers > 0) {
+    if (index_mode != INDEX_GRID || curve != CURVE_NONE) {
+      usage(argv[0]);
+      return 1;
+    }
+    coalesce = 0;
+  }
+
+  Dataset dataset;
+  if (!load_dataset(data_file, 0, &dataset))
+    return 1;
+  dimensions = dataset.dimensions;
+
+  // Clustering runs on the unique (or reordered) points; their labels are expanded back to every input point for
+  // output.
+  CoalescedPoints unique = {0};
+  if ((coalesce || curve != CURVE_NONE) &&
+      !coalesce_points(dataset.coords, dataset.n_points, dimensions, coalesce, &unique))
+    return 1;
+  if (curve != CURVE_NONE && !sort_points_on_curve(&unique, dimensions, curve))
+    return 1;
+  int weighted = coalesce && unique.n_unique < dataset.n_points;
+  int remapped = weighted || curve != CURVE_NONE;
+  int n_points = remapped ? (int)unique.n_unique : (int)dataset.n_points;
+  const int32_t *point_coords = remapped ? unique.coords : dataset.coords;
+  Point *points = (Point *)malloc(n_points * sizeof(Point));
+  int32_t *labels = (int32_t *)malloc(dataset.n_points * sizeof(int32_t) + 1);
+  if (!points || !labels) {
+    fprintf(stderr, "Failed to allocate memory for points\n");
+    return 1;
+  }
+  for (int i = 0; i < n_points; i++) {
+    points[i].x = (int32_t *)point_coords + (size_t)i * dimensions;
+    points[i].cluster = UNCLASSIFIED;
+  }
+
+  kernel_kind = select_kernels(kernel_kind, dimensions);
+  if (kernel_kind < 0) {
+    fprintf(stderr, "Requested distance kernel is not supported on this CPU\n");
+    return 1;
+  }
 
   struct timeval start_time, end_time;
+  double index_time = 0.0;
+  if (index_mode == INDEX_GRID && n_workers == 0) {
+    gettimeofday(&start_time, NULL);
+    if (!build_grid_index(&grid, points, n_points, eps)) {
+      fprintf(stderr, "Failed to allocate grid index\n");
+      return 1;
+    }
+    gettimeofday(&end_time, NULL);
+    index_time = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_usec - start_time.tv_usec) / 1e6;
+  }
+  gettimeofday(&start_time, NULL);
+  if (n_workers == 0 && !build_coord_arrays(&coords, points, n_points, weighted ? unique.weights : NULL)) {
+    fprintf(stderr, "Failed to allocate coordinate arrays\n");
+    return 1;
+  }
+  gettimeofday(&end_time, NULL);
+  double coord_time = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_usec - start_time.tv_usec) / 1e6;
+
+  // Time spent in the sharded phases: core points, local clustering, merge and border points.
+  double phase_seconds[4] = {0};
+  uint32_t n_links = 0;
+  HardwareCounters hardware;
+  start_hardware_counters(&hardware);
   gettimeofday(&start_time, NULL);
-  dbscan(points, n_points, eps, min_pts);
+  if (n_workers > 0) {
+    if (!dbscan_sharded(points, (uint32_t)n_points, eps, min_pts, &n_links, phase_seconds))
+      return 1;
+  } else {
+    dbscan(points, n_points, eps, min_pts);
+  }
   gettimeofday(&end_time, NULL);
+  stop_hardware_counters(&hardware);
 
   double time_taken = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_usec - start_time.tv_usec) / 1e6;
+  for (uint32_t i = 0; i < dataset.n_points; i++)
+    labels[i] = points[remapped ? unique.index[i] : i].cluster;
+
+  // Save predicted labels
+  char labels_output_file[256];
+  snprintf(labels_output_file, sizeof(labels_output_file), "%s_labels.%s", output_prefix,
+           label_extension(label_format));
+  gettimeofday(&start_time, NULL);
+  if (!write_labels(labels_output_file, labels, sizeof(int32_t), dataset.n_points, label_format, 0))
+    return 1;
+  gettimeofday(&end_time, NULL);
+  double labels_time = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_usec - start_time.tv_usec) / 1e6;
+
+  Evaluation evaluation;
+  if (true_labels_file &&
+      !evaluate_against_file(true_labels_file, labels, sizeof(int32_t), dataset.n_points, 0, &evaluation))
+    return 1;
 
   // Create result file name
   char result_file[256];
@@ -195,30 +1523,66 @@ int main(int argc, char *argv[]) {
 
   // Write results to file
   fprintf(result, "DBSCAN completed in %f seconds\n", time_taken);
-
-  fclose(result);
-
-  // Create labels file name
-  char labels_output_file[256];
-  snprintf(labels_output_file, sizeof(labels_output_file), "%s_labels.txt", output_prefix);
-
-  // Save predicted labels
-  FILE *labels_output = fopen(labels_output_file, "w");
-  if (labels_output == NULL) {
-    printf("Error opening labels output file\n");
-    free(points);
-    return 1;
+  fprintf(result, "Index: %s\n", index_mode == INDEX_GRID ? "grid" : "brute");
+  if (n_workers > 0) {
+    fprintf(result, "Workers: %d processes, one shard of the first coordinate each, %u halo core links\n", n_workers,
+            n_links);
+    fprintf(result, "Phases: core points %f s, local clusters %f s, merge %f s, border points %f s\n",
+            phase_seconds[0], phase_seconds[1], phase_seconds[2], phase_seconds[3]);
+    for (int w = 0; w < n_workers; w++) {
+      const WorkerReport *r = &worker_reports[w];
+      fprintf(result, "Worker %d: %u own points, %u with halo, %u local clusters; %f + %f + %f seconds\n", w,
+              r->n_own, r->n_loaded, r->n_clusters, r->seconds[0], r->seconds[1], r->seconds[2]);
+    }
+  } else if (index_mode == INDEX_GRID) {
+    fprintf(result, "Grid index built in %f seconds (%d x %d cells of size %d)\n", index_time, grid.cols, grid.rows,
+            grid.cell_size);
   }
-
-  for (int i = 0; i < n_points; i++) {
-    fprintf(labels_output, "%d\n", points[i].cluster);
+  print_dataset_summary(result, &dataset);
+  fprintf(result, "Dimensions: %d\n", dimensions);
+  if (coalesce) {
+    fprintf(result, "Unique points: %u of %u, coalesced in %f seconds\n", unique.n_unique, dataset.n_points,
+            unique.seconds);
+  }
+  fprintf(result, "Point order: %s", curve_name(curve));
+  if (curve != CURVE_NONE)
+    fprintf(result, ", sorted in %f seconds", unique.curve_seconds);
+  fprintf(result, "\n");
+  fprintf(result, "Distance kernel: %s (%s)\n", kernel_names[kernel_kind],
+          kernel_specialized ? "specialized for this dimension" : "generic");
+  fprintf(result, "Labels: %s, written in %f seconds\n", label_format_name(label_format), labels_time);
+  // Workers build their own grids while they cluster, so the sharded run has no index phase of its own.
+  PhaseTimes phases;
+  init_phase_times(&phases);
+  phases.seconds[PHASE_LOAD] = dataset.load_seconds;
+  phases.seconds[PHASE_OUTPUT] = labels_time;
+  if (n_workers > 0) {
+    phases.seconds[PHASE_CORE] = phase_seconds[0];
+    phases.seconds[PHASE_EXPANSION] = phase_seconds[1] + phase_seconds[2] + phase_seconds[3];
+  } else {
+    phases.seconds[PHASE_INDEX] = unique.seconds + unique.curve_seconds + index_time + coord_time;
+    phases.seconds[PHASE_CORE] = core_seconds;
+    phases.seconds[PHASE_EXPANSION] = time_taken - core_seconds;
   }
-  fclose(labels_output);
+  print_phase_times(result, &phases, dataset.n_points);
+  print_counters(result, &hardware, 0);
+  if (true_labels_file)
+    print_evaluation(result, true_labels_file, &evaluation);
+
+  fclose(result);
 
   printf("Results saved to %s\n", result_file);
   printf("Predicted labels saved to %s\n", labels_output_file);
+  if (true_labels_file)
+    printf("ARI: %f, NMI: %f\n", evaluation.ari, evaluation.nmi);
 
+  free_grid_index(&grid);
+  free_coord_arrays(&coords);
+  free(worker_reports);
   free(points);
+  free(labels);
+  free_coalesced_points(&unique);
+  free_dataset(&dataset);
 
   return 0;
 }
\ No newline at end of file
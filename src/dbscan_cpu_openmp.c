@@ -0,0 +1,1105 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <omp.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "dataset.h"
+#include "distance_kernels.h"
+#include "evaluate.h"
+
+#define UNCLASSIFIED -1
+#define NOISE -2
+
+// x points into the row-major coordinates of the loaded Dataset.
+typedef struct {
+  int32_t *x;
+  int32_t cluster;
+} Point;
+
+typedef enum {
+  INDEX_BRUTE, // every point is a candidate for every query (one cell holding all points)
+  INDEX_GRID,  // uniform grid of eps-sized cells, 3x3 neighbourhood per query
+} IndexMode;
+
+// Same layout as the grid in dbscan_cpu.c: cell_points holds point ids grouped by cell and
+// cell_start[c]..cell_start[c + 1] is the slice belonging to cell c.
+typedef struct {
+  int32_t min_x, min_y;
+  int32_t cell_size;
+  int32_t cols, rows;
+  uint32_t *cell_start;
+  uint32_t *cell_points;
+  uint32_t *point_cell;
+} GridIndex;
+
+typedef enum {
+  MODE_POINTS, // union-find over core points found through the eps grid
+  MODE_CELLS,  // cell graph: union-find over cells of side eps / sqrt(d)
+} ClusterMode;
+
+// The number of neighbouring cells of the cell graph grows as 5^d.
+#define CELL_MAX_DIMENSIONS 4
+
+// Cell graph (-m cells). Every axis is cut into cells of cell_size, the largest size for which any two points of a
+// cell are within eps, so a cell holding min_pts points is all core. Non-empty cells are sorted by key; cell c holds
+// cell_points[cell_start[c]..cell_start[c + 1]) in ascending id, and its non-empty neighbouring cells (those that
+// can hold a point within eps of it) are neighbors[neighbor_start[c]..neighbor_start[c + 1]).
+//
+// With rho > 0 every cell is further cut into fine cells of side at most rho * eps / sqrt(d) along each axis, and
+// the points of a cell are grouped by fine cell instead of by id. Cell c owns fine cells fine_start[c]..
+// fine_start[c + 1], and fine cell f holds cell_points[fine_point_start[f]..fine_point_start[f + 1]) inside the box
+// fine_corner[f * d + k] .. + fine_side - 1.
+typedef struct {
+  int32_t min[MAX_DIMENSIONS];
+  int64_t cell_size;
+  uint64_t cells[MAX_DIMENSIONS];  // cells along each axis
+  uint64_t stride[MAX_DIMENSIONS]; // key = sum over the axes of cell coordinate * stride
+  uint32_t n_cells;
+  uint64_t *keys;
+  uint32_t *cell_start;
+  uint32_t *cell_points;
+  uint32_t *cell_weight; // input points in each cell
+  uint32_t *neighbor_start;
+  uint32_t *neighbors;
+  int64_t fine_side;
+  uint32_t n_fine;
+  uint32_t *fine_start;
+  uint32_t *fine_point_start;
+  uint32_t *fine_weight;
+  int32_t *fine_corner;
+} CellGraph;
+
+IndexMode index_mode = INDEX_GRID;
+ClusterMode cluster_mode = MODE_POINTS;
+double rho = 0; // > 0: rho-approximate DBSCAN on the cell graph, counting fine cells instead of points
+int coalesce = 1; // cluster unique coordinates with weights instead of every input point
+CurveKind curve = CURVE_NONE; // order in which the points are stored and visited
+LabelFormat label_format = LABELS_TEXT;
+char *true_labels_file = NULL;
+GridIndex grid;
+CoordArrays coords; // -m points: coordinates in grid.cell_points order, scanned by the distance kernels
+CellGraph cell_graph;
+int dimensions;
+int kernel_kind = -1; // -1 picks the widest kernel the CPU supports
+
+// Union-find over point ids (over scan positions while -m points links core points). A root is only ever linked
+// below a smaller root with a CAS, so every root is the smallest element of its set and concurrent unions need no
+// lock.
+_Atomic uint32_t *parent;
+uint8_t *core;
+uint32_t *point_weights; // input points merged into each point (see CoalescedPoints), or NULL if all are 1
+
+double core_time, union_time, label_time;
+uint32_t nr_dense_cells; // cells with min_pts points, core without counting
+uint64_t nr_cell_tests;  // neighbouring core cell pairs searched for a core pair within eps
+
+// Squares are taken modulo 2^32, as in dbscan_cpu's kernels.
+static inline uint32_t squared_distance(const Point *a, const Point *b) {
+  uint32_t sum = 0;
+  for (int i = 0; i < dimensions; i++) {
+    uint32_t diff = (uint32_t)a->x[i] - (uint32_t)b->x[i];
+    sum += diff * diff;
+  }
+  return sum;
+}
+
+double wall_time(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// The grid uses the first two coordinates; one-dimensional data has a single row.
+static inline int32_t grid_y(const Point *p) { return dimensions > 1 ? p->x[1] : 0; }
+
+// With single_cell the whole bounding box is one cell, which turns every query into a scan of all points.
+int build_grid_index(GridIndex *g, const Point *points, int n_points, uint32_t eps, int single_cell) {
+  int32_t min_x = 0, min_y = 0, max_x = 0, max_y = 0;
+  if (n_points > 0) {
+    min_x = max_x = points[0].x[0];
+    min_y = max_y = grid_y(&points[0]);
+  }
+  for (int i = 1; i < n_points; i++) {
+    int32_t y = grid_y(&points[i]);
+    if (points[i].x[0] < min_x)
+      min_x = points[i].x[0];
+    if (points[i].x[0] > max_x)
+      max_x = points[i].x[0];
+    if (y < min_y)
+      min_y = y;
+    if (y > max_y)
+      max_y = y;
+  }
+
+  // Cells must be at least eps wide for the 3x3 neighbourhood to cover the eps-ball. Widen them when the
+  // bounding box is so sparse that eps-sized cells would need more cells than there are points.
+  int64_t cell_size = eps > 0 ? eps : 1;
+  int64_t span_x = (int64_t)max_x - min_x, span_y = (int64_t)max_y - min_y;
+  int64_t max_cells = single_cell ? 1 : (int64_t)n_points * 4 + 16;
+  while ((span_x / cell_size + 1) * (span_y / cell_size + 1) > max_cells)
+    cell_size *= 2;
+
+  g->min_x = min_x;
+  g->min_y = min_y;
+  g->cell_size = (int32_t)(cell_size < INT32_MAX ? cell_size : INT32_MAX);
+  g->cols = (int32_t)(span_x / cell_size + 1);
+  g->rows = (int32_t)(span_y / cell_size + 1);
+
+  size_t n_cells = (size_t)g->cols * g->rows;
+  g->cell_start = (uint32_t *)calloc(n_cells + 1, sizeof(uint32_t));
+  g->cell_points = (uint32_t *)malloc((n_points > 0 ? n_points : 1) * sizeof(uint32_t));
+  g->point_cell = (uint32_t *)malloc((n_points > 0 ? n_points : 1) * sizeof(uint32_t));
+  if (!g->cell_start || !g->cell_points || !g->point_cell)
+    return 0;
+
+#pragma omp parallel for
+  for (int i = 0; i < n_points; i++) {
+    uint32_t cx = (uint32_t)(((int64_t)points[i].x[0] - min_x) / cell_size);
+    uint32_t cy = (uint32_t)(((int64_t)grid_y(&points[i]) - min_y) / cell_size);
+    g->point_cell[i] = cy * g->cols + cx;
+  }
+  for (int i = 0; i < n_points; i++)
+    g->cell_start[g->point_cell[i] + 1]++;
+  for (size_t c = 0; c < n_cells; c++)
+    g->cell_start[c + 1] += g->cell_start[c];
+
+  // Scatter in index order so each cell lists its points in ascending id.
+  uint32_t *fill = (uint32_t *)malloc(n_cells * sizeof(uint32_t));
+  if (!fill)
+    return 0;
+  memcpy(fill, g->cell_start, n_cells * sizeof(uint32_t));
+  for (int i = 0; i < n_points; i++)
+    g->cell_points[fill[g->point_cell[i]]++] = i;
+  free(fill);
+  return 1;
+}
+
+// Copies the coordinates (and weights) into coords in cell_points order, so every candidate run is contiguous.
+int build_coord_arrays(CoordArrays *c, const Point *points, int n_points, const uint32_t *weights) {
+  size_t size = (n_points > 0 ? n_points : 1) * sizeof(int32_t);
+  for (int a = 0; a < dimensions; a++) {
+    c->axis[a] = (int32_t *)malloc(size);
+    if (!c->axis[a])
+      return 0;
+  }
+  if (weights && !(c->weight = (uint32_t *)malloc(size)))
+    return 0;
+#pragma omp parallel for
+  for (int k = 0; k < n_points; k++) {
+    uint32_t i = grid.cell_points[k];
+    for (int a = 0; a < dimensions; a++)
+      c->axis[a][k] = points[i].x[a];
+    if (weights)
+      c->weight[k] = weights[i];
+  }
+  return 1;
+}
+
+void free_coord_arrays(CoordArrays *c) {
+  for (int a = 0; a < MAX_DIMENSIONS; a++)
+    free(c->axis[a]);
+  free(c->weight);
+  memset(c, 0, sizeof(*c));
+}
+
+void free_grid_index(GridIndex *g) {
+  free(g->cell_start);
+  free(g->cell_points);
+  free(g->point_cell);
+  memset(g, 0, sizeof(*g));
+}
+
+typedef struct {
+  uint64_t key;
+  uint64_t fine; // fine cell within the cell, 0 without rho
+  uint32_t id;
+} CellEntry;
+
+static int compare_cell_entries(const void *a, const void *b) {
+  const CellEntry *x = (const CellEntry *)a, *y = (const CellEntry *)b;
+  if (x->key != y->key)
+    return x->key < y->key ? -1 : 1;
+  if (x->fine != y->fine)
+    return x->fine < y->fine ? -1 : 1;
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+// Position of key among the sorted cell keys, or UINT32_MAX if that cell is empty.
+static inline uint32_t find_cell(const CellGraph *g, uint64_t key) {
+  uint32_t lo = 0, hi = g->n_cells;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (g->keys[mid] < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return (lo < g->n_cells && g->keys[lo] == key) ? lo : UINT32_MAX;
+}
+
+// Calls body with the index of every non-empty cell at one of the n_offsets offsets (offsets[o * dimensions + k]
+// cells along axis k) from cell c.
+#define FOR_EACH_OFFSET_CELL(g, c, offsets, n_offsets, e, body)                                                    \
+  do {                                                                                                             \
+    int64_t at[MAX_DIMENSIONS];                                                                                    \
+    for (int k = 0; k < dimensions; k++)                                                                           \
+      at[k] = (int64_t)((g)->keys[c] / (g)->stride[k] % (g)->cells[k]);                                            \
+    for (int o = 0; o < (n_offsets); o++) {                                                                        \
+      const int8_t *off = &(offsets)[(size_t)o * dimensions];                                                      \
+      uint64_t key = 0;                                                                                            \
+      int inside = 1;                                                                                              \
+      for (int k = 0; k < dimensions && inside; k++) {                                                             \
+        int64_t v = at[k] + off[k];                                                                                \
+        inside = v >= 0 && (uint64_t)v < (g)->cells[k];                                                            \
+        key += (uint64_t)v * (g)->stride[k];                                                                       \
+      }                                                                                                            \
+      uint32_t e = inside ? find_cell((g), key) : UINT32_MAX;                                                      \
+      if (e != UINT32_MAX) {                                                                                       \
+        body;                                                                                                      \
+      }                                                                                                            \
+    }                                                                                                              \
+  } while (0)
+
+// Largest side of a cell whose points are within sqrt(limit_squared) of each other: points of a cell differ by at
+// most side - 1 along each axis.
+static int64_t max_cell_side(uint64_t limit_squared) {
+  int64_t t = (int64_t)sqrt((double)limit_squared / dimensions);
+  while ((uint64_t)dimensions * (t + 1) * (t + 1) <= limit_squared)
+    t++;
+  while (t > 0 && (uint64_t)dimensions * t * t > limit_squared)
+    t--;
+  return t + 1;
+}
+
+// Returns 0 after printing the reason if memory runs out or the cells cannot be numbered in 64 bits. rho > 0 also
+// builds the fine cells.
+int build_cell_graph(CellGraph *g, const Point *points, int n_points, uint32_t eps, double rho) {
+  memset(g, 0, sizeof(*g));
+  uint64_t eps_squared = (uint64_t)eps * eps;
+  g->cell_size = max_cell_side(eps_squared);
+
+  uint64_t n_keys = 1;
+  for (int k = 0; k < dimensions; k++) {
+    int32_t lo = n_points > 0 ? points[0].x[k] : 0, hi = lo;
+    for (int i = 1; i < n_points; i++) {
+      lo = points[i].x[k] < lo ? points[i].x[k] : lo;
+      hi = points[i].x[k] > hi ? points[i].x[k] : hi;
+    }
+    g->min[k] = lo;
+    g->cells[k] = (uint64_t)(((int64_t)hi - lo) / g->cell_size + 1);
+    g->stride[k] = n_keys;
+    if (__builtin_mul_overflow(n_keys, g->cells[k], &n_keys)) {
+      fprintf(stderr, "Coordinate range too large for -m cells\n");
+      return 0;
+    }
+  }
+
+  // A cell is cut into `split` fine cells of fine_side along each axis, fine_side <= the largest side for rho * eps.
+  int64_t split = 1;
+  uint64_t n_fine_keys = 1;
+  g->fine_side = g->cell_size;
+  if (rho > 0) {
+    int64_t limit = max_cell_side((uint64_t)floor(rho * rho * (double)eps_squared));
+    split = (g->cell_size + limit - 1) / limit;
+    g->fine_side = (g->cell_size + split - 1) / split;
+    for (int k = 0; k < dimensions; k++) {
+      if (__builtin_mul_overflow(n_fine_keys, (uint64_t)split, &n_fine_keys)) {
+        fprintf(stderr, "rho too small for eps %u\n", eps);
+        return 0;
+      }
+    }
+  }
+
+  CellEntry *entries = (CellEntry *)malloc((n_points > 0 ? n_points : 1) * sizeof(CellEntry));
+  if (!entries)
+    return 0;
+#pragma omp parallel for
+  for (int i = 0; i < n_points; i++) {
+    uint64_t key = 0, fine = 0, fine_stride = 1;
+    for (int k = 0; k < dimensions; k++) {
+      int64_t offset = (int64_t)points[i].x[k] - g->min[k];
+      key += (uint64_t)(offset / g->cell_size) * g->stride[k];
+      fine += (uint64_t)(offset % g->cell_size / g->fine_side) * fine_stride;
+      fine_stride *= (uint64_t)split;
+    }
+    entries[i].key = key;
+    entries[i].fine = fine;
+    entries[i].id = (uint32_t)i;
+  }
+  qsort(entries, n_points, sizeof(CellEntry), compare_cell_entries);
+
+  for (int i = 0; i < n_points; i++)
+    g->n_cells += (i == 0 || entries[i].key != entries[i - 1].key);
+  size_t cells = g->n_cells > 0 ? g->n_cells : 1;
+  g->keys = (uint64_t *)malloc(cells * sizeof(uint64_t));
+  g->cell_start = (uint32_t *)malloc((cells + 1) * sizeof(uint32_t));
+  g->cell_points = (uint32_t *)malloc((n_points > 0 ? n_points : 1) * sizeof(uint32_t));
+  g->cell_weight = (uint32_t *)calloc(cells, sizeof(uint32_t));
+  g->neighbor_start = (uint32_t *)calloc(cells + 1, sizeof(uint32_t));
+  if (!g->keys || !g->cell_start || !g->cell_points || !g->cell_weight || !g->neighbor_start) {
+    free(entries);
+    return 0;
+  }
+  uint32_t c = 0;
+  for (int i = 0; i < n_points; i++) {
+    if (i > 0 && entries[i].key != entries[i - 1].key)
+      c++;
+    if (i == 0 || entries[i].key != entries[i - 1].key) {
+      g->keys[c] = entries[i].key;
+      g->cell_start[c] = (uint32_t)i;
+    }
+    g->cell_points[i] = entries[i].id;
+    g->cell_weight[c] += point_weights ? point_weights[entries[i].id] : 1;
+  }
+  g->cell_start[g->n_cells] = (uint32_t)n_points;
+
+  if (rho > 0) {
+    for (int i = 0; i < n_points; i++)
+      g->n_fine += (i == 0 || entries[i].key != entries[i - 1].key || entries[i].fine != entries[i - 1].fine);
+    size_t fine = g->n_fine > 0 ? g->n_fine : 1;
+    g->fine_start = (uint32_t *)malloc((cells + 1) * sizeof(uint32_t));
+    g->fine_point_start = (uint32_t *)malloc((fine + 1) * sizeof(uint32_t));
+    g->fine_weight = (uint32_t *)calloc(fine, sizeof(uint32_t));
+    g->fine_corner = (int32_t *)malloc(fine * dimensions * sizeof(int32_t));
+    if (!g->fine_start || !g->fine_point_start || !g->fine_weight || !g->fine_corner) {
+      free(entries);
+      return 0;
+    }
+    uint32_t f = 0;
+    c = 0;
+    for (int i = 0; i < n_points; i++) {
+      int new_cell = i == 0 || entries[i].key != entries[i - 1].key;
+      if (i > 0 && (new_cell || entries[i].fine != entries[i - 1].fine))
+        f++;
+      if (new_cell)
+        g->fine_start[c++] = f;
+      if (i == 0 || new_cell || entries[i].fine != entries[i - 1].fine) {
+        g->fine_point_start[f] = (uint32_t)i;
+        for (int k = 0; k < dimensions; k++) {
+          int64_t offset = (int64_t)points[entries[i].id].x[k] - g->min[k];
+          g->fine_corner[(size_t)f * dimensions + k] =
+              (int32_t)(g->min[k] + offset - offset % g->cell_size % g->fine_side);
+        }
+      }
+      g->fine_weight[f] += point_weights ? point_weights[entries[i].id] : 1;
+    }
+    g->fine_start[g->n_cells] = g->n_fine;
+    g->fine_point_start[g->n_fine] = (uint32_t)n_points;
+  }
+  free(entries);
+
+  // Offsets of the cells whose closest points are within eps along every axis together.
+  int64_t reach = ((int64_t)eps + g->cell_size - 1) / g->cell_size;
+  int64_t span = 2 * reach + 1, n_candidates = 1;
+  for (int k = 0; k < dimensions; k++)
+    n_candidates *= span;
+  int8_t *offsets = (int8_t *)malloc((size_t)n_candidates * dimensions);
+  if (!offsets)
+    return 0;
+  int n_offsets = 0;
+  for (int64_t o = 0; o < n_candidates; o++) {
+    int8_t *off = &offsets[(size_t)n_offsets * dimensions];
+    uint64_t gap_squared = 0;
+    int zero = 1;
+    for (int64_t k = 0, rest = o; k < dimensions; k++, rest /= span) {
+      off[k] = (int8_t)(rest % span - reach);
+      int64_t gap = (off[k] < 0 ? -off[k] : off[k]) * g->cell_size - (g->cell_size - 1);
+      gap_squared += gap > 0 ? (uint64_t)(gap * gap) : 0;
+      zero = zero && off[k] == 0;
+    }
+    if (!zero && gap_squared <= eps_squared)
+      n_offsets++;
+  }
+
+  // Count, prefix sum, then fill the neighbour lists.
+#pragma omp parallel for schedule(dynamic, 256)
+  for (uint32_t c = 0; c < g->n_cells; c++) {
+    uint32_t n = 0;
+    FOR_EACH_OFFSET_CELL(g, c, offsets, n_offsets, e, n++);
+    g->neighbor_start[c + 1] = n;
+  }
+  for (uint32_t c = 0; c < g->n_cells; c++)
+    g->neighbor_start[c + 1] += g->neighbor_start[c];
+  g->neighbors = (uint32_t *)malloc(((size_t)g->neighbor_start[g->n_cells] + 1) * sizeof(uint32_t));
+  if (!g->neighbors) {
+    free(offsets);
+    return 0;
+  }
+#pragma omp parallel for schedule(dynamic, 256)
+  for (uint32_t c = 0; c < g->n_cells; c++) {
+    uint32_t n = g->neighbor_start[c];
+    FOR_EACH_OFFSET_CELL(g, c, offsets, n_offsets, e, g->neighbors[n++] = e);
+  }
+  free(offsets);
+  return 1;
+}
+
+void free_cell_graph(CellGraph *g) {
+  free(g->keys);
+  free(g->cell_start);
+  free(g->cell_points);
+  free(g->cell_weight);
+  free(g->neighbor_start);
+  free(g->neighbors);
+  free(g->fine_start);
+  free(g->fine_point_start);
+  free(g->fine_weight);
+  free(g->fine_corner);
+  memset(g, 0, sizeof(*g));
+}
+
+// Candidate slices of cell_points for a query on point_id: one contiguous run per row of the 3x3 neighbourhood.
+static inline int candidate_runs(uint32_t point_id, uint32_t *begin, uint32_t *end) {
+  int32_t cx = grid.point_cell[point_id] % grid.cols;
+  int32_t cy = grid.point_cell[point_id] / grid.cols;
+  int32_t x_lo = cx > 0 ? cx - 1 : 0, x_hi = cx + 1 < grid.cols ? cx + 1 : cx;
+  int32_t y_lo = cy > 0 ? cy - 1 : 0, y_hi = cy + 1 < grid.rows ? cy + 1 : cy;
+  int runs = 0;
+  for (int32_t y = y_lo; y <= y_hi; y++, runs++) {
+    begin[runs] = grid.cell_start[y * grid.cols + x_lo];
+    end[runs] = grid.cell_start[y * grid.cols + x_hi + 1];
+  }
+  return runs;
+}
+
+// Longest run candidate_runs can return, which bounds the matches of one collect_kernel call.
+static uint32_t max_run_length(void) {
+  uint32_t longest = 0;
+  for (int32_t y = 0; y < grid.rows; y++) {
+    for (int32_t x = 0; x < grid.cols; x++) {
+      int32_t x_lo = x > 0 ? x - 1 : 0, x_hi = x + 1 < grid.cols ? x + 1 : x;
+      uint32_t length = grid.cell_start[y * grid.cols + x_hi + 1] - grid.cell_start[y * grid.cols + x_lo];
+      if (length > longest)
+        longest = length;
+    }
+  }
+  return longest;
+}
+
+// Path halving; a lost CAS only means another thread already shortened the path.
+static inline uint32_t find_root(uint32_t x) {
+  while (1) {
+    uint32_t p = atomic_load_explicit(&parent[x], memory_order_relaxed);
+    if (p == x)
+      return x;
+    uint32_t gp = atomic_load_explicit(&parent[p], memory_order_relaxed);
+    if (gp != p)
+      atomic_compare_exchange_weak_explicit(&parent[x], &p, gp, memory_order_relaxed, memory_order_relaxed);
+    x = gp;
+  }
+}
+
+// Link the larger root below the smaller one and return the root of the merged set. The CAS only succeeds while
+// the larger id is still a root, so a concurrent union that got there first makes us retry from the new roots.
+static inline uint32_t union_sets(uint32_t a, uint32_t b) {
+  while (1) {
+    a = find_root(a);
+    b = find_root(b);
+    if (a == b)
+      return a;
+    if (a < b) {
+      uint32_t t = a;
+      a = b;
+      b = t;
+    }
+    uint32_t expected = a;
+    if (atomic_compare_exchange_strong_explicit(&parent[a], &expected, b, memory_order_acq_rel,
+                                                memory_order_relaxed))
+      return b;
+  }
+}
+
+// Roots are the smallest id of their cluster, so a prefix sum of roots in id order numbers the clusters in seed order
+// (thread_roots has a slot per thread plus one). Core points get the id of their cluster and the others NOISE. The
+// cluster field of a root temporarily holds its cluster id.
+static void number_clusters(Point *points, int n_points, uint32_t *thread_roots) {
+#pragma omp parallel
+  {
+    int t = omp_get_thread_num(), team = omp_get_num_threads();
+    int lo = (int)((int64_t)n_points * t / team), hi = (int)((int64_t)n_points * (t + 1) / team);
+    uint32_t n_roots = 0;
+    for (int i = lo; i < hi; i++) {
+      if (core[i] && find_root(i) == (uint32_t)i)
+        n_roots++;
+    }
+    thread_roots[t + 1] = n_roots;
+#pragma omp barrier
+#pragma omp single
+    for (int k = 0; k < team; k++)
+      thread_roots[k + 1] += thread_roots[k];
+    uint32_t next_id = thread_roots[t];
+    for (int i = lo; i < hi; i++) {
+      points[i].cluster = NOISE;
+      if (core[i] && find_root(i) == (uint32_t)i)
+        points[i].cluster = ++next_id;
+    }
+#pragma omp barrier
+#pragma omp for
+    for (int i = 0; i < n_points; i++) {
+      if (core[i])
+        points[i].cluster = points[find_root(i)].cluster;
+    }
+  }
+}
+
+// Labels match dbscan_cpu: clusters are numbered in the order of their smallest core point (the order in which
+// the sequential version seeds them), and a border point takes the smallest cluster id among its core
+// neighbours (the first cluster that reaches it when clusters are expanded one after another).
+//
+// Candidates are scanned with dbscan_cpu's distance kernels over coords, and the core flags and the union-find are
+// kept by scan position (core_at, parent) while clustering, so the flags and parents of a run are as contiguous as
+// its coordinates. Before numbering, every core point's parent is rewritten by id to the smallest id of its set.
+void dbscan(Point *points, int n_points, uint32_t eps, int min_pts) {
+  uint32_t eps_squared = eps * eps;
+  const int32_t *const *axes = (const int32_t *const *)coords.axis;
+  size_t size = n_points > 0 ? n_points : 1;
+  parent = (_Atomic uint32_t *)malloc(size * sizeof(*parent));
+  core = (uint8_t *)calloc(size, sizeof(uint8_t));
+  uint8_t *core_at = (uint8_t *)malloc(size);
+  _Atomic uint32_t *seed = (_Atomic uint32_t *)malloc(size * sizeof(*seed)); // smallest id of the set of a root
+  int n_threads = omp_get_max_threads();
+  uint32_t *thread_roots = (uint32_t *)calloc(n_threads + 1, sizeof(uint32_t));
+  size_t match_slots = (size_t)max_run_length() + 16;
+  uint32_t *matches = (uint32_t *)malloc(match_slots * n_threads * sizeof(uint32_t));
+  if (!parent || !core || !core_at || !seed || !thread_roots || !matches) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    exit(1);
+  }
+
+  // Weighted points count as many neighbours as they merge, so their matches are collected and the weights summed.
+  double start = wall_time();
+#pragma omp parallel
+  {
+    uint32_t *out = matches + match_slots * omp_get_thread_num();
+#pragma omp for schedule(dynamic, 256)
+    for (int p = 0; p < n_points; p++) {
+      uint32_t i = grid.cell_points[p];
+      int32_t query[MAX_DIMENSIONS];
+      for (int a = 0; a < dimensions; a++)
+        query[a] = coords.axis[a][p];
+      uint32_t begin[3], end[3];
+      int runs = candidate_runs(i, begin, end);
+      uint32_t count = 0;
+      for (int r = 0; r < runs && count < (uint32_t)min_pts; r++) {
+        if (!coords.weight) {
+          count += count_kernel(axes, begin[r], end[r], query, eps_squared, min_pts - count);
+          continue;
+        }
+        uint32_t n = collect_kernel(axes, begin[r], end[r], query, eps_squared, out);
+        for (uint32_t m = 0; m < n && count < (uint32_t)min_pts; m++)
+          count += coords.weight[out[m]];
+      }
+      core[i] = core_at[p] = count >= (uint32_t)min_pts;
+      atomic_init(&parent[p], (uint32_t)p);
+      atomic_init(&seed[p], i);
+    }
+  }
+  double union_start = wall_time();
+  core_time = union_start - start;
+
+  // Each core pair is considered once, from its smaller position. The root of p is found once per point and kept up
+  // to date by the unions, so a neighbour already in the same set costs one find_root and no CAS.
+#pragma omp parallel
+  {
+    uint32_t *out = matches + match_slots * omp_get_thread_num();
+#pragma omp for schedule(dynamic, 256)
+    for (int p = 0; p < n_points; p++) {
+      if (!core_at[p])
+        continue;
+      uint32_t root = find_root(p);
+      int32_t query[MAX_DIMENSIONS];
+      for (int a = 0; a < dimensions; a++)
+        query[a] = coords.axis[a][p];
+      uint32_t begin[3], end[3];
+      int runs = candidate_runs(grid.cell_points[p], begin, end);
+      for (int r = 0; r < runs; r++) {
+        uint32_t n = collect_kernel(axes, begin[r], end[r], query, eps_squared, out);
+        for (uint32_t m = 0; m < n; m++) {
+          uint32_t k = out[m];
+          if (k > (uint32_t)p && core_at[k] && find_root(k) != root)
+            root = union_sets(root, k);
+        }
+      }
+    }
+  }
+
+  // Carry the smallest id of every set to its root, then point each core id at it. The seed is its own parent, so
+  // parent becomes a forest over ids whose roots are the smallest id of their set, as number_clusters expects.
+#pragma omp parallel for
+  for (int p = 0; p < n_points; p++) {
+    if (!core_at[p])
+      continue;
+    uint32_t root = find_root(p), id = grid.cell_points[p];
+    uint32_t smallest = atomic_load_explicit(&seed[root], memory_order_relaxed);
+    while (id < smallest &&
+           !atomic_compare_exchange_weak_explicit(&seed[root], &smallest, id, memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+    }
+  }
+#pragma omp parallel for
+  for (int p = 0; p < n_points; p++) {
+    uint32_t id = grid.cell_points[p];
+    atomic_store_explicit(&seed[p], core_at[p] ? atomic_load_explicit(&seed[find_root(p)], memory_order_relaxed) : id,
+                          memory_order_relaxed);
+  }
+#pragma omp parallel for
+  for (int p = 0; p < n_points; p++)
+    atomic_store_explicit(&parent[grid.cell_points[p]], atomic_load_explicit(&seed[p], memory_order_relaxed),
+                          memory_order_relaxed);
+  double label_start = wall_time();
+  union_time = label_start - union_start;
+
+  number_clusters(points, n_points, thread_roots);
+
+  // Core labels are final now; border points read them without further synchronisation.
+#pragma omp parallel
+  {
+    uint32_t *out = matches + match_slots * omp_get_thread_num();
+#pragma omp for schedule(dynamic, 256)
+    for (int i = 0; i < n_points; i++) {
+      if (core[i])
+        continue;
+      uint32_t begin[3], end[3];
+      int runs = candidate_runs(i, begin, end);
+      int32_t cluster = NOISE;
+      for (int r = 0; r < runs; r++) {
+        uint32_t n = collect_kernel(axes, begin[r], end[r], points[i].x, eps_squared, out);
+        for (uint32_t m = 0; m < n; m++) {
+          if (core_at[out[m]]) {
+            int32_t c = points[grid.cell_points[out[m]]].cluster;
+            if (cluster == NOISE || c < cluster)
+              cluster = c;
+          }
+        }
+      }
+      points[i].cluster = cluster;
+    }
+  }
+  label_time = wall_time() - label_start;
+
+  free(parent);
+  free(core);
+  free(core_at);
+  free(seed);
+  free(thread_roots);
+  free(matches);
+}
+
+// Squared distance from p to the nearest point of the box of fine cell f.
+static inline uint64_t fine_cell_distance(const CellGraph *g, uint32_t f, const Point *p) {
+  uint64_t sum = 0;
+  for (int k = 0; k < dimensions; k++) {
+    int64_t lo = g->fine_corner[(size_t)f * dimensions + k], hi = lo + g->fine_side - 1;
+    int64_t gap = p->x[k] < lo ? lo - p->x[k] : (p->x[k] > hi ? p->x[k] - hi : 0);
+    sum += (uint64_t)(gap * gap);
+  }
+  return sum;
+}
+
+// Same labels as dbscan() without a point-level neighbour search between cells: every point of a cell with
+// min_pts points is core, core points of one cell are always within eps of each other, and two neighbouring cells
+// are joined as soon as one pair of their core points is within eps.
+//
+// With rho > 0 the tests between cells only look at fine cells: a fine cell counts in full once its box is within eps,
+// so every point within eps is counted and no point beyond (1 + rho) * eps is. The clusters then lie between the
+// exact clusters for eps and for (1 + rho) * eps, and each point costs a bounded number of fine cells.
+void dbscan_cells(Point *points, int n_points, uint32_t eps, int min_pts) {
+  const CellGraph *g = &cell_graph;
+  uint32_t eps_squared = eps * eps;
+  parent = (_Atomic uint32_t *)malloc((n_points > 0 ? n_points : 1) * sizeof(*parent));
+  core = (uint8_t *)calloc(n_points > 0 ? n_points : 1, sizeof(uint8_t));
+  uint32_t *first_core = (uint32_t *)malloc((g->n_cells > 0 ? g->n_cells : 1) * sizeof(uint32_t));
+  uint8_t *fine_core = (uint8_t *)calloc(g->n_fine > 0 ? g->n_fine : 1, sizeof(uint8_t)); // holds a core point
+  int n_threads = omp_get_max_threads();
+  uint32_t *thread_roots = (uint32_t *)calloc(n_threads + 1, sizeof(uint32_t));
+  if (!parent || !core || !first_core || !fine_core || !thread_roots) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    exit(1);
+  }
+
+  // A point of a sparse cell starts from the weight of its own cell and counts the neighbouring cells up to
+  // min_pts. first_core[c] is the smallest core point of cell c, or UINT32_MAX.
+  double start = wall_time();
+  uint32_t n_dense = 0;
+#pragma omp parallel for schedule(dynamic, 64) reduction(+ : n_dense)
+  for (uint32_t c = 0; c < g->n_cells; c++) {
+    n_dense += g->cell_weight[c] >= (uint32_t)min_pts;
+    first_core[c] = UINT32_MAX;
+    for (uint32_t k = g->cell_start[c]; k < g->cell_start[c + 1]; k++) {
+      uint32_t i = g->cell_points[k];
+      uint32_t count = g->cell_weight[c];
+      for (uint32_t n = g->neighbor_start[c]; n < g->neighbor_start[c + 1] && count < (uint32_t)min_pts; n++) {
+        uint32_t e = g->neighbors[n];
+        if (rho > 0) {
+          for (uint32_t f = g->fine_start[e]; f < g->fine_start[e + 1]; f++) {
+            if (fine_cell_distance(g, f, &points[i]) <= eps_squared &&
+                (count += g->fine_weight[f]) >= (uint32_t)min_pts)
+              break;
+          }
+          continue;
+        }
+        for (uint32_t m = g->cell_start[e]; m < g->cell_start[e + 1]; m++) {
+          uint32_t j = g->cell_points[m];
+          if (squared_distance(&points[i], &points[j]) <= eps_squared &&
+              (count += point_weights ? point_weights[j] : 1) >= (uint32_t)min_pts)
+            break;
+        }
+      }
+      core[i] = count >= (uint32_t)min_pts;
+      if (core[i] && i < first_core[c])
+        first_core[c] = i;
+      atomic_init(&parent[i], i);
+    }
+  }
+#pragma omp parallel for schedule(dynamic, 256)
+  for (uint32_t f = 0; f < g->n_fine; f++) {
+    for (uint32_t k = g->fine_point_start[f]; k < g->fine_point_start[f + 1] && !fine_core[f]; k++)
+      fine_core[f] = core[g->cell_points[k]];
+  }
+  nr_dense_cells = n_dense;
+  double union_start = wall_time();
+  core_time = union_start - start;
+
+  // Each pair of neighbouring core cells is tested once, from its smaller index, and only while they are still
+  // in different sets. The bichromatic search stops at the first core pair within eps.
+  uint64_t n_tests = 0;
+#pragma omp parallel for schedule(dynamic, 64) reduction(+ : n_tests)
+  for (uint32_t c = 0; c < g->n_cells; c++) {
+    uint32_t a = first_core[c];
+    if (a == UINT32_MAX)
+      continue;
+    for (uint32_t k = g->cell_start[c]; k < g->cell_start[c + 1]; k++) {
+      if (core[g->cell_points[k]])
+        union_sets(a, g->cell_points[k]);
+    }
+    for (uint32_t n = g->neighbor_start[c]; n < g->neighbor_start[c + 1]; n++) {
+      uint32_t e = g->neighbors[n];
+      if (e < c || first_core[e] == UINT32_MAX || find_root(a) == find_root(first_core[e]))
+        continue;
+      n_tests++;
+      int linked = 0;
+      for (uint32_t k = g->cell_start[c]; k < g->cell_start[c + 1] && !linked; k++) {
+        uint32_t i = g->cell_points[k];
+        if (!core[i])
+          continue;
+        if (rho > 0) {
+          for (uint32_t f = g->fine_start[e]; f < g->fine_start[e + 1] && !linked; f++)
+            linked = fine_core[f] && fine_cell_distance(g, f, &points[i]) <= eps_squared;
+          continue;
+        }
+        for (uint32_t m = g->cell_start[e]; m < g->cell_start[e + 1] && !linked; m++) {
+          uint32_t j = g->cell_points[m];
+          linked = core[j] && squared_distance(&points[i], &points[j]) <= eps_squared;
+        }
+      }
+      if (linked)
+        union_sets(a, first_core[e]);
+    }
+  }
+  nr_cell_tests = n_tests;
+  double label_start = wall_time();
+  union_time = label_start - union_start;
+
+  number_clusters(points, n_points, thread_roots);
+
+  // A border point is within eps of every core point of its own cell, which all share one cluster.
+#pragma omp parallel for schedule(dynamic, 64)
+  for (uint32_t c = 0; c < g->n_cells; c++) {
+    for (uint32_t k = g->cell_start[c]; k < g->cell_start[c + 1]; k++) {
+      uint32_t i = g->cell_points[k];
+      if (core[i])
+        continue;
+      int32_t cluster = first_core[c] != UINT32_MAX ? points[first_core[c]].cluster : NOISE;
+      for (uint32_t n = g->neighbor_start[c]; n < g->neighbor_start[c + 1]; n++) {
+        uint32_t e = g->neighbors[n];
+        if (first_core[e] == UINT32_MAX ||
+            (cluster != NOISE && points[first_core[e]].cluster >= cluster))
+          continue;
+        if (rho > 0) {
+          for (uint32_t f = g->fine_start[e]; f < g->fine_start[e + 1]; f++) {
+            if (fine_core[f] && fine_cell_distance(g, f, &points[i]) <= eps_squared) {
+              cluster = points[first_core[e]].cluster;
+              break;
+            }
+          }
+          continue;
+        }
+        for (uint32_t m = g->cell_start[e]; m < g->cell_start[e + 1]; m++) {
+          uint32_t j = g->cell_points[m];
+          if (core[j] && squared_distance(&points[i], &points[j]) <= eps_squared) {
+            cluster = points[j].cluster;
+            break;
+          }
+        }
+      }
+      points[i].cluster = cluster;
+    }
+  }
+  label_time = wall_time() - label_start;
+
+  free(parent);
+  free(core);
+  free(first_core);
+  free(fine_core);
+  free(thread_roots);
+}
+
+void usage(const char *prog) {
+  printf("Usage: %s [-m points|cells] [-a rho] [-i grid|brute] [-k scalar|avx2|avx512] [-u on|off] [-r none|morton|hilbert] [-o text|binary|mmap] [-e true_labels] <data_file> <eps> <min_pts> <output_prefix>\n", prog);
+  printf("  -m  points: union-find over core points, cells: union-find over grid cells of side eps / sqrt(d), at most %d\n"
+         "      dimensions (default: points)\n", CELL_MAX_DIMENSIONS);
+  printf("  -a  rho-approximate clustering on the cell graph (implies -m cells): distances between cells are only\n"
+         "      resolved to rho * eps (default: exact)\n");
+  printf("  -i  neighbour search index of -m points (default: grid)\n");
+  printf("  -k  distance kernel of -m points (default: the widest one this CPU supports)\n");
+  printf("  -u  merge points with identical coordinates into weighted points before clustering (default: on)\n");
+  printf("  -r  sort the points along a space-filling curve before clustering (default: none, the input order)\n");
+  printf("  -o  labels file format: text, or int32 binary written directly or through mmap (default: text)\n");
+  printf("  -e  ground-truth labels file; ARI and NMI are added to the result file\n");
+  printf("  threads are taken from OMP_NUM_THREADS\n");
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "m:a:i:k:u:r:o:e:")) != -1) {
+    switch (opt) {
+    case 'm':
+      if (strcmp(optarg, "points") == 0) {
+        cluster_mode = MODE_POINTS;
+      } else if (strcmp(optarg, "cells") == 0) {
+        cluster_mode = MODE_CELLS;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'a':
+      rho = atof(optarg);
+      if (!(rho > 0 && rho <= 1)) {
+        fprintf(stderr, "-a takes a rho in (0, 1]\n");
+        return 1;
+      }
+      break;
+    case 'i':
+      if (strcmp(optarg, "grid") == 0) {
+        index_mode = INDEX_GRID;
+      } else if (strcmp(optarg, "brute") == 0) {
+        index_mode = INDEX_BRUTE;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'k':
+      kernel_kind = -2;
+      for (int k = KERNEL_SCALAR; k <= KERNEL_AVX512; k++) {
+        if (strcmp(optarg, kernel_names[k]) == 0)
+          kernel_kind = k;
+      }
+      if (kernel_kind == -2) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'u':
+      if (strcmp(optarg, "on") == 0) {
+        coalesce = 1;
+      } else if (strcmp(optarg, "off") == 0) {
+        coalesce = 0;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'r':
+      if (!parse_curve(optarg, &curve)) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'e':
+      true_labels_file = optarg;
+      break;
+    case 'o':
+      if (!parse_label_format(optarg, &label_format)) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (rho > 0)
+    cluster_mode = MODE_CELLS;
+  if (argc - optind != 4) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  char *data_file = argv[optind];
+  uint32_t eps = atoi(argv[optind + 1]);
+  int min_pts = atoi(argv[optind + 2]);
+  char *output_prefix = argv[optind + 3];
+
+  Dataset dataset;
+  if (!load_dataset(data_file, omp_get_max_threads(), &dataset))
+    return 1;
+  dimensions = dataset.dimensions;
+  if (cluster_mode == MODE_CELLS && dimensions > CELL_MAX_DIMENSIONS) {
+    fprintf(stderr, "-m cells supports at most %d dimensions, the data has %d\n", CELL_MAX_DIMENSIONS, dimensions);
+    return 1;
+  }
+  kernel_kind = select_kernels(kernel_kind, dimensions);
+  if (kernel_kind < 0) {
+    fprintf(stderr, "Requested distance kernel is not supported on this CPU\n");
+    return 1;
+  }
+
+  // Clustering runs on the unique (or reordered) points; their labels are expanded back to every input point for
+  // output.
+  CoalescedPoints unique = {0};
+  if ((coalesce || curve != CURVE_NONE) &&
+      !coalesce_points(dataset.coords, dataset.n_points, dimensions, coalesce, &unique))
+    return 1;
+  if (curve != CURVE_NONE && !sort_points_on_curve(&unique, dimensions, curve))
+    return 1;
+  int weighted = coalesce && unique.n_unique < dataset.n_points;
+  int remapped = weighted || curve != CURVE_NONE;
+  int n_points = remapped ? (int)unique.n_unique : (int)dataset.n_points;
+  const int32_t *point_coords = remapped ? unique.coords : dataset.coords;
+  point_weights = weighted ? unique.weights : NULL;
+  Point *points = (Point *)malloc(n_points * sizeof(Point));
+  int32_t *labels = (int32_t *)malloc(dataset.n_points * sizeof(int32_t) + 1);
+  if (!points || !labels) {
+    fprintf(stderr, "Failed to allocate memory for points\n");
+    return 1;
+  }
+  for (int i = 0; i < n_points; i++) {
+    points[i].x = (int32_t *)point_coords + (size_t)i * dimensions;
+    points[i].cluster = UNCLASSIFIED;
+  }
+
+  double start = wall_time();
+  if (cluster_mode == MODE_CELLS) {
+    if (!build_cell_graph(&cell_graph, points, n_points, eps, rho)) {
+      fprintf(stderr, "Failed to build cell graph\n");
+      return 1;
+    }
+  } else if (!build_grid_index(&grid, points, n_points, eps, index_mode == INDEX_BRUTE) ||
+             !build_coord_arrays(&coords, points, n_points, point_weights)) {
+    fprintf(stderr, "Failed to allocate grid index\n");
+    return 1;
+  }
+  double index_time = wall_time() - start;
+
+  start = wall_time();
+  if (cluster_mode == MODE_CELLS)
+    dbscan_cells(points, n_points, eps, min_pts);
+  else
+    dbscan(points, n_points, eps, min_pts);
+  double time_taken = wall_time() - start;
+#pragma omp parallel for
+  for (uint32_t i = 0; i < dataset.n_points; i++)
+    labels[i] = points[remapped ? unique.index[i] : i].cluster;
+
+  // Save predicted labels
+  char labels_output_file[256];
+  snprintf(labels_output_file, sizeof(labels_output_file), "%s_labels.%s", output_prefix,
+           label_extension(label_format));
+  start = wall_time();
+  if (!write_labels(labels_output_file, labels, sizeof(int32_t), dataset.n_points, label_format,
+                    omp_get_max_threads()))
+    return 1;
+  double labels_time = wall_time() - start;
+
+  Evaluation evaluation;
+  if (true_labels_file && !evaluate_against_file(true_labels_file, labels, sizeof(int32_t), dataset.n_points,
+                                                 omp_get_max_threads(), &evaluation))
+    return 1;
+
+  // Create result file name
+  char result_file[256];
+  snprintf(result_file, sizeof(result_file), "%s_result.txt", output_prefix);
+
+  // Open result file
+  FILE *result = fopen(result_file, "w");
+  if (result == NULL) {
+    printf("Error opening result file\n");
+    return 1;
+  }
+
+  // Write results to file
+  fprintf(result, "DBSCAN completed in %f seconds\n", time_taken);
+  if (cluster_mode == MODE_CELLS) {
+    fprintf(result, "Mode: cells\n");
+    if (rho > 0) {
+      fprintf(result, "Approximation: rho %g, %u fine cells of size %lld\n", rho, cell_graph.n_fine,
+              (long long)cell_graph.fine_side);
+    }
+    fprintf(result, "Cell graph built in %f seconds (%u cells of size %lld, %u edges)\n", index_time,
+            cell_graph.n_cells, (long long)cell_graph.cell_size, cell_graph.neighbor_start[cell_graph.n_cells]);
+    fprintf(result, "Dense cells: %u, cell pairs searched: %llu\n", nr_dense_cells,
+            (unsigned long long)nr_cell_tests);
+  } else {
+    fprintf(result, "Mode: points\n");
+    fprintf(result, "Index: %s\n", index_mode == INDEX_GRID ? "grid" : "brute");
+    fprintf(result, "Distance kernel: %s (%s)\n", kernel_names[kernel_kind],
+            kernel_specialized ? "specialized for this dimension" : "generic");
+  }
+  if (cluster_mode == MODE_POINTS && index_mode == INDEX_GRID) {
+    fprintf(result, "Grid index built in %f seconds (%d x %d cells of size %d)\n", index_time, grid.cols, grid.rows,
+            grid.cell_size);
+  }
+  print_dataset_summary(result, &dataset);
+  fprintf(result, "Dimensions: %d\n", dimensions);
+  if (coalesce) {
+    fprintf(result, "Unique points: %u of %u, coalesced in %f seconds\n", unique.n_unique, dataset.n_points,
+            unique.seconds);
+  }
+  fprintf(result, "Point order: %s", curve_name(curve));
+  if (curve != CURVE_NONE)
+    fprintf(result, ", sorted in %f seconds", unique.curve_seconds);
+  fprintf(result, "\n");
+  fprintf(result, "Threads: %d\n", omp_get_max_threads());
+  fprintf(result, "Labels: %s, written in %f seconds\n", label_format_name(label_format), labels_time);
+  fprintf(result, "Core points: %f seconds, union: %f seconds, labels: %f seconds\n", core_time, union_time,
+          label_time);
+  PhaseTimes phases;
+  init_phase_times(&phases);
+  phases.seconds[PHASE_LOAD] = dataset.load_seconds;
+  phases.seconds[PHASE_INDEX] = unique.seconds + unique.curve_seconds + index_time;
+  phases.seconds[PHASE_CORE] = core_time;
+  phases.seconds[PHASE_EXPANSION] = time_taken - core_time;
+  phases.seconds[PHASE_OUTPUT] = labels_time;
+  print_phase_times(result, &phases, dataset.n_points);
+  if (true_labels_file)
+    print_evaluation(result, true_labels_file, &evaluation);
+
+  fclose(result);
+
+  printf("Results saved to %s\n", result_file);
+  printf("Predicted labels saved to %s\n", labels_output_file);
+  if (true_labels_file)
+    printf("ARI: %f, NMI: %f\n", evaluation.ari, evaluation.nmi);
+
+  if (cluster_mode == MODE_CELLS)
+    free_cell_graph(&cell_graph);
+  else
+    free_grid_index(&grid);
+  free_coord_arrays(&coords);
+  free(points);
+  free(labels);
+  free_coalesced_points(&unique);
+  free_dataset(&dataset);
+
+  return 0;
+}
@@ -0,0 +1,954 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "dataset.h"
+
+#define UNCLASSIFIED -1
+#define NOISE -2
+
+// Incremental DBSCAN over a stream of point insertions and deletions read from stdin. Points live in grid cells
+// small enough that any two points of a cell are within eps, as in dbscan_cpu_openmp -m cells, so a cell holding
+// min_pts points is all core and the core points of a cell always share a cluster. Each batch only updates the
+// neighbour counts of sparse cells around the changed points, links the cells that gained core points to their
+// neighbours, and checks around every cell that lost core points whether its cluster split. The labels are those
+// a full run of dbscan_cpu gives on the remaining points in arrival order.
+
+// x points into a coordinate block, which never moves once allocated.
+typedef struct {
+  int32_t *x;
+  int32_t cluster;
+} Point;
+
+#define NO_SLOT UINT32_MAX
+#define COORD_BLOCK 65536u // points per coordinate block
+
+// The number of neighbouring cells grows as 5^d.
+#define CELL_MAX_DIMENSIONS 4
+
+typedef struct {
+  uint32_t *data;
+  uint32_t size;
+  uint32_t capacity;
+} SlotVector;
+
+// A cell keeps its slots in no particular order; a slot knows its position so that it can be swapped out in O(1).
+// neighbors lists the other cells that can hold a point within eps of this one, and label is the cluster of its
+// core points while n_core > 0. Cells stay in place once created, even when they empty.
+typedef struct {
+  int64_t at[CELL_MAX_DIMENSIONS];
+  SlotVector slots;
+  SlotVector neighbors;
+  uint32_t n_core;
+  uint32_t label;
+  uint32_t visit;       // search of the current split check that reached the cell
+  uint32_t visit_epoch; // split check that last set visit
+} Cell;
+
+// One breadth-first search of a split check. queue holds every cell it has reached; those before head have been
+// expanded.
+typedef struct {
+  SlotVector queue;
+  uint32_t head;
+} Search;
+
+int dimensions = 0;
+uint32_t eps, eps_squared;
+uint32_t min_pts;
+uint64_t window = 0;     // keep only the last `window` inserted points (0: no window)
+uint32_t batch_size = 0; // end a batch after this many insertions (0: only at empty lines and EOF)
+int verify = 0;          // recluster from scratch after every batch and compare the labels
+
+// Point slots. A deleted point's slot is reused by a later insertion.
+Point *points;
+uint32_t *count;     // points within eps, itself included; only kept up to date in sparse cells
+uint8_t *core;
+uint32_t *slot_cell; // cell holding each slot
+uint32_t *cell_pos;  // position of each slot in its cell
+uint32_t n_slots, slot_capacity;
+SlotVector free_slots;
+int32_t **blocks;
+uint32_t n_blocks;
+
+// Cells, and an open-addressing hash table from cell coordinates to an index into cells.
+int64_t cell_side;
+Cell *cells;
+uint32_t n_cells, cell_capacity;
+uint32_t *cell_table;
+uint32_t cell_table_size; // a power of two, at least twice n_cells
+int8_t *offsets;          // n_offsets offsets to the neighbouring cells, dimensions values each
+int n_offsets;
+
+// Slot of each id in [id_first, next_id), NO_SLOT once deleted. Leading deleted ids are dropped when the array fills.
+uint32_t *id_slot;
+uint64_t id_first, next_id, id_capacity;
+uint64_t window_next; // ids below this have been evicted by the window
+
+// Union-find over cluster labels. Labels merge when clusters join, and the part that splits off a cluster gets a
+// new label. Once most labels are unused, the live ones are renumbered (see compact_labels).
+uint32_t *label_parent;
+uint32_t n_labels, label_capacity;
+
+// Split checks: searches, the union-find that merges searches which reach each other, and the cells each group of
+// searches has left to expand.
+Search *searches;
+uint32_t *search_group, *group_open;
+uint32_t search_capacity, epoch;
+
+uint64_t nr_inserted, nr_deleted, nr_evicted, nr_unknown;
+uint64_t nr_distances, nr_recounts, nr_split_checks, nr_split_visits, nr_splits;
+SlotVector gained, lost_cells, dead, seeds;
+
+double wall_time(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *grow(void *p, size_t size) {
+  void *q = realloc(p, size);
+  if (!q) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    exit(1);
+  }
+  return q;
+}
+
+static void push(SlotVector *v, uint32_t value) {
+  if (v->size == v->capacity) {
+    v->capacity = v->capacity ? v->capacity * 2 : 8;
+    v->data = (uint32_t *)grow(v->data, v->capacity * sizeof(uint32_t));
+  }
+  v->data[v->size++] = value;
+}
+
+// Squares are taken modulo 2^32, as in dbscan_cpu's kernels, so the labels match it bit for bit.
+static inline int within_eps(uint32_t a, uint32_t b) {
+  uint32_t sum = 0;
+  for (int i = 0; i < dimensions; i++) {
+    uint32_t diff = (uint32_t)points[a].x[i] - (uint32_t)points[b].x[i];
+    sum += diff * diff;
+  }
+  nr_distances++;
+  return sum <= eps_squared;
+}
+
+// Cell side and neighbouring cell offsets, as in build_cell_graph of dbscan_cpu_openmp: the side is the largest
+// one whose points, at most side - 1 apart along each axis, stay within eps of each other, and an offset is kept
+// if the closest points of the two cells can be within eps.
+static void init_cells(void) {
+  uint64_t limit = (uint64_t)eps * eps;
+  int64_t t = (int64_t)sqrt((double)limit / dimensions);
+  while ((uint64_t)dimensions * (t + 1) * (t + 1) <= limit)
+    t++;
+  while (t > 0 && (uint64_t)dimensions * t * t > limit)
+    t--;
+  cell_side = t + 1;
+
+  int64_t reach = ((int64_t)eps + cell_side - 1) / cell_side;
+  int64_t span = 2 * reach + 1, n_candidates = 1;
+  for (int k = 0; k < dimensions; k++)
+    n_candidates *= span;
+  offsets = (int8_t *)grow(NULL, (size_t)n_candidates * dimensions);
+  for (int64_t o = 0; o < n_candidates; o++) {
+    int8_t *off = &offsets[(size_t)n_offsets * dimensions];
+    uint64_t gap_squared = 0;
+    int zero = 1;
+    for (int64_t k = 0, rest = o; k < dimensions; k++, rest /= span) {
+      off[k] = (int8_t)(rest % span - reach);
+      int64_t gap = (off[k] < 0 ? -off[k] : off[k]) * cell_side - (cell_side - 1);
+      gap_squared += gap > 0 ? (uint64_t)(gap * gap) : 0;
+      zero = zero && off[k] == 0;
+    }
+    if (!zero && gap_squared <= limit)
+      n_offsets++;
+  }
+}
+
+static inline uint32_t cell_hash(const int64_t *at) {
+  uint64_t h = 0;
+  for (int k = 0; k < dimensions; k++)
+    h = (h ^ (uint64_t)at[k]) * 0x9E3779B97F4A7C15ull;
+  return (uint32_t)(h >> 32);
+}
+
+static void table_insert(uint32_t c) {
+  uint32_t h = cell_hash(cells[c].at) & (cell_table_size - 1);
+  while (cell_table[h] != NO_SLOT)
+    h = (h + 1) & (cell_table_size - 1);
+  cell_table[h] = c;
+}
+
+// Index of the cell at `at`, or NO_SLOT if there is none.
+static uint32_t find_cell(const int64_t *at) {
+  if (cell_table_size == 0)
+    return NO_SLOT;
+  for (uint32_t h = cell_hash(at) & (cell_table_size - 1); cell_table[h] != NO_SLOT;
+       h = (h + 1) & (cell_table_size - 1)) {
+    if (memcmp(cells[cell_table[h]].at, at, dimensions * sizeof(int64_t)) == 0)
+      return cell_table[h];
+  }
+  return NO_SLOT;
+}
+
+// Creates the cell at `at` and links it with the existing cells around it.
+static uint32_t add_cell(const int64_t *at) {
+  if (2 * (n_cells + 1) > cell_table_size) {
+    cell_table_size = cell_table_size ? cell_table_size * 2 : 1024;
+    cell_table = (uint32_t *)grow(cell_table, cell_table_size * sizeof(uint32_t));
+    memset(cell_table, 0xFF, cell_table_size * sizeof(uint32_t));
+    for (uint32_t c = 0; c < n_cells; c++)
+      table_insert(c);
+  }
+  if (n_cells == cell_capacity) {
+    cell_capacity = cell_capacity ? cell_capacity * 2 : 1024;
+    cells = (Cell *)grow(cells, cell_capacity * sizeof(Cell));
+  }
+  uint32_t c = n_cells++;
+  memset(&cells[c], 0, sizeof(Cell));
+  memcpy(cells[c].at, at, dimensions * sizeof(int64_t));
+  table_insert(c);
+
+  int64_t near[CELL_MAX_DIMENSIONS];
+  for (int o = 0; o < n_offsets; o++) {
+    for (int k = 0; k < dimensions; k++)
+      near[k] = at[k] + offsets[(size_t)o * dimensions + k];
+    uint32_t e = find_cell(near);
+    if (e != NO_SLOT) {
+      push(&cells[c].neighbors, e);
+      push(&cells[e].neighbors, c);
+    }
+  }
+  return c;
+}
+
+static inline int dense(const Cell *cell) { return cell->slots.size >= min_pts; }
+
+// Points within eps of slot s, itself included.
+static uint32_t count_neighbors(uint32_t s) {
+  const Cell *cell = &cells[slot_cell[s]];
+  uint32_t n = cell->slots.size;
+  for (uint32_t i = 0; i < cell->neighbors.size; i++) {
+    const Cell *near = &cells[cell->neighbors.data[i]];
+    for (uint32_t j = 0; j < near->slots.size; j++)
+      n += within_eps(s, near->slots.data[j]);
+  }
+  nr_recounts++;
+  return n;
+}
+
+// Whether some core point of cell b is within eps of slot s (of another cell).
+static int reaches_core(uint32_t s, const Cell *b) {
+  for (uint32_t j = 0; j < b->slots.size; j++) {
+    if (core[b->slots.data[j]] && within_eps(s, b->slots.data[j]))
+      return 1;
+  }
+  return 0;
+}
+
+// Whether two neighbouring cells hold a pair of core points within eps, which puts them in one cluster.
+static int cells_linked(const Cell *a, const Cell *b) {
+  for (uint32_t i = 0; i < a->slots.size; i++) {
+    if (core[a->slots.data[i]] && reaches_core(a->slots.data[i], b))
+      return 1;
+  }
+  return 0;
+}
+
+static uint32_t new_label(void) {
+  if (n_labels == label_capacity) {
+    label_capacity = label_capacity ? label_capacity * 2 : 1024;
+    label_parent = (uint32_t *)grow(label_parent, label_capacity * sizeof(uint32_t));
+  }
+  label_parent[n_labels] = n_labels;
+  return n_labels++;
+}
+
+static inline uint32_t find_label(uint32_t x) {
+  while (label_parent[x] != x) {
+    label_parent[x] = label_parent[label_parent[x]];
+    x = label_parent[x];
+  }
+  return x;
+}
+
+// Hangs the larger root under the smaller one.
+static void union_labels(uint32_t a, uint32_t b) {
+  a = find_label(a);
+  b = find_label(b);
+  if (a == b)
+    return;
+  if (a > b) {
+    uint32_t t = a;
+    a = b;
+    b = t;
+  }
+  label_parent[b] = a;
+}
+
+// Renumbers the labels of the core cells from 0, one per cluster.
+static void compact_labels(void) {
+  uint32_t *renamed = (uint32_t *)grow(NULL, (n_labels > 0 ? n_labels : 1) * sizeof(uint32_t));
+  memset(renamed, 0xFF, n_labels * sizeof(uint32_t));
+  uint32_t n = 0;
+  for (uint32_t c = 0; c < n_cells; c++) {
+    if (cells[c].n_core == 0)
+      continue;
+    uint32_t r = find_label(cells[c].label);
+    if (renamed[r] == NO_SLOT)
+      renamed[r] = n++;
+    cells[c].label = renamed[r];
+  }
+  for (uint32_t i = 0; i < n; i++)
+    label_parent[i] = i;
+  n_labels = n;
+  free(renamed);
+}
+
+// The first core point of a cell gives it a new cluster of its own; linking merges it with its neighbours.
+static void set_core(uint32_t s) {
+  Cell *cell = &cells[slot_cell[s]];
+  core[s] = 1;
+  if (cell->n_core++ == 0)
+    cell->label = new_label();
+  push(&gained, s);
+}
+
+static void clear_core(uint32_t s) {
+  core[s] = 0;
+  cells[slot_cell[s]].n_core--;
+  push(&lost_cells, slot_cell[s]);
+}
+
+static uint32_t new_slot(void) {
+  if (free_slots.size > 0)
+    return free_slots.data[--free_slots.size];
+  if (n_slots == slot_capacity) {
+    slot_capacity = slot_capacity ? slot_capacity * 2 : COORD_BLOCK;
+    points = (Point *)grow(points, slot_capacity * sizeof(Point));
+    count = (uint32_t *)grow(count, slot_capacity * sizeof(uint32_t));
+    core = (uint8_t *)grow(core, slot_capacity);
+    slot_cell = (uint32_t *)grow(slot_cell, slot_capacity * sizeof(uint32_t));
+    cell_pos = (uint32_t *)grow(cell_pos, slot_capacity * sizeof(uint32_t));
+  }
+  if (n_slots % COORD_BLOCK == 0) {
+    blocks = (int32_t **)grow(blocks, (n_blocks + 1) * sizeof(int32_t *));
+    blocks[n_blocks++] = (int32_t *)grow(NULL, (size_t)COORD_BLOCK * dimensions * sizeof(int32_t));
+  }
+  points[n_slots].x = blocks[n_slots / COORD_BLOCK] + (size_t)(n_slots % COORD_BLOCK) * dimensions;
+  return n_slots++;
+}
+
+static uint32_t lookup_id(uint64_t id) { return id >= id_first && id < next_id ? id_slot[id - id_first] : NO_SLOT; }
+
+// Gives the next id to slot s, or skips it if s is NO_SLOT.
+static void append_id(uint32_t s) {
+  if (next_id - id_first == id_capacity) {
+    uint64_t skip = 0;
+    while (skip < id_capacity && id_slot[skip] == NO_SLOT)
+      skip++;
+    if (id_capacity > 0 && skip >= id_capacity / 2) {
+      memmove(id_slot, id_slot + skip, (id_capacity - skip) * sizeof(uint32_t));
+      id_first += skip;
+    } else {
+      id_capacity = id_capacity ? id_capacity * 2 : COORD_BLOCK;
+      id_slot = (uint32_t *)grow(id_slot, id_capacity * sizeof(uint32_t));
+    }
+  }
+  id_slot[next_id++ - id_first] = s;
+}
+
+// Adds slot s to its cell. The points of sparse cells within eps count it, and any that reach min_pts become
+// core; a cell that reaches min_pts makes all its points core. Points of dense cells are not counted.
+static void insert_point(uint32_t s) {
+  int64_t at[CELL_MAX_DIMENSIONS];
+  for (int k = 0; k < dimensions; k++) {
+    int64_t x = points[s].x[k];
+    at[k] = x >= 0 ? x / cell_side : -((-x + cell_side - 1) / cell_side);
+  }
+  uint32_t c = find_cell(at);
+  if (c == NO_SLOT)
+    c = add_cell(at);
+  Cell *cell = &cells[c];
+  slot_cell[s] = c;
+  cell_pos[s] = cell->slots.size;
+  push(&cell->slots, s);
+  core[s] = 0;
+
+  if (cell->slots.size == min_pts) {
+    for (uint32_t i = 0; i < cell->slots.size; i++) {
+      if (!core[cell->slots.data[i]])
+        set_core(cell->slots.data[i]);
+    }
+  } else if (dense(cell)) {
+    set_core(s);
+  } else {
+    for (uint32_t i = 0; i + 1 < cell->slots.size; i++) {
+      uint32_t q = cell->slots.data[i];
+      if (++count[q] >= min_pts && !core[q])
+        set_core(q);
+    }
+  }
+  uint32_t n = cell->slots.size;
+  for (uint32_t i = 0; i < cell->neighbors.size; i++) {
+    Cell *near = &cells[cell->neighbors.data[i]];
+    if (dense(cell) && dense(near))
+      continue;
+    for (uint32_t j = 0; j < near->slots.size; j++) {
+      uint32_t q = near->slots.data[j];
+      if (!within_eps(s, q))
+        continue;
+      n++;
+      if (!dense(near) && ++count[q] >= min_pts && !core[q])
+        set_core(q);
+    }
+  }
+  count[s] = n;
+  if (!core[s] && n >= min_pts)
+    set_core(s);
+}
+
+// Removes slot s from its cell. The points of sparse cells within eps stop counting it, and a cell that drops
+// below min_pts counts its points again.
+static void remove_point(uint32_t s) {
+  Cell *cell = &cells[slot_cell[s]];
+  int was_dense = dense(cell);
+  uint32_t last = cell->slots.data[--cell->slots.size];
+  cell->slots.data[cell_pos[s]] = last;
+  cell_pos[last] = cell_pos[s];
+  if (core[s])
+    clear_core(s);
+
+  for (uint32_t i = 0; i < cell->neighbors.size; i++) {
+    Cell *near = &cells[cell->neighbors.data[i]];
+    if (dense(near))
+      continue;
+    for (uint32_t j = 0; j < near->slots.size; j++) {
+      uint32_t q = near->slots.data[j];
+      if (within_eps(s, q) && --count[q] < min_pts && core[q])
+        clear_core(q);
+    }
+  }
+  if (was_dense && dense(cell))
+    return;
+  for (uint32_t i = 0; i < cell->slots.size; i++) {
+    uint32_t q = cell->slots.data[i];
+    count[q] = was_dense ? count_neighbors(q) : count[q] - 1;
+    if (count[q] < min_pts && core[q])
+      clear_core(q);
+  }
+}
+
+static inline uint32_t find_group(uint32_t k) {
+  while (search_group[k] != k) {
+    search_group[k] = search_group[search_group[k]];
+    k = search_group[k];
+  }
+  return k;
+}
+
+// The core cells of one cluster around cells that lost core points may no longer be connected. Each of the n
+// seed cells starts a breadth-first search over linked core cells, searches that reach each other merge into one
+// group, and the check stops as soon as a single group is left open. A group that runs out of cells before then
+// is a whole part of the cluster and gets a new label; the last group keeps the old one. The seeds lie next to
+// each other, so the searches usually meet after a few steps.
+static void check_split(const uint32_t *seed, uint32_t n) {
+  if (n > search_capacity) {
+    searches = (Search *)grow(searches, n * sizeof(Search));
+    memset(searches + search_capacity, 0, (n - search_capacity) * sizeof(Search));
+    search_group = (uint32_t *)grow(search_group, n * sizeof(uint32_t));
+    group_open = (uint32_t *)grow(group_open, n * sizeof(uint32_t));
+    search_capacity = n;
+  }
+  epoch++;
+  nr_split_checks++;
+  uint32_t n_searches = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    Cell *cell = &cells[seed[i]];
+    cell->visit_epoch = epoch;
+    cell->visit = n_searches;
+    searches[n_searches].queue.size = 0;
+    searches[n_searches].head = 0;
+    push(&searches[n_searches].queue, seed[i]);
+    search_group[n_searches] = n_searches;
+    group_open[n_searches] = 1;
+    n_searches++;
+  }
+
+  uint32_t open = n_searches;
+  while (open > 1) {
+    for (uint32_t k = 0; k < n_searches && open > 1; k++) {
+      Search *search = &searches[k];
+      if (search->head == search->queue.size)
+        continue;
+      uint32_t g = find_group(k);
+      Cell *cell = &cells[search->queue.data[search->head++]];
+      group_open[g]--;
+      nr_split_visits++;
+      for (uint32_t i = 0; i < cell->neighbors.size; i++) {
+        uint32_t e = cell->neighbors.data[i];
+        Cell *near = &cells[e];
+        if (near->n_core == 0 || (near->visit_epoch == epoch && find_group(near->visit) == g) ||
+            !cells_linked(cell, near))
+          continue;
+        if (near->visit_epoch != epoch) {
+          near->visit_epoch = epoch;
+          near->visit = k;
+          push(&search->queue, e);
+          group_open[g]++;
+          continue;
+        }
+        uint32_t h = find_group(near->visit);
+        uint32_t low = g < h ? g : h, high = g < h ? h : g;
+        search_group[high] = low;
+        group_open[low] += group_open[high];
+        g = low;
+        open--;
+      }
+      if (group_open[g] == 0 && open > 1) {
+        uint32_t l = new_label();
+        for (uint32_t i = 0; i < n_searches; i++) {
+          if (find_group(i) != g)
+            continue;
+          for (uint32_t t = 0; t < searches[i].queue.size; t++)
+            cells[searches[i].queue.data[t]].label = l;
+        }
+        nr_splits++;
+        open--;
+      }
+    }
+  }
+}
+
+typedef struct {
+  uint32_t label;
+  uint32_t cell;
+} SeedEntry;
+
+static int compare_seeds(const void *a, const void *b) {
+  const SeedEntry *x = (const SeedEntry *)a, *y = (const SeedEntry *)b;
+  if (x->label != y->label)
+    return x->label < y->label ? -1 : 1;
+  return (x->cell > y->cell) - (x->cell < y->cell);
+}
+
+// Applies one batch: the n_inserts points in coords first, so that the batch may delete them again, then the
+// deletions and the window evictions.
+static void apply_batch(const int32_t *coords, uint32_t n_inserts, const uint64_t *deletes, uint32_t n_deletes) {
+  gained.size = lost_cells.size = dead.size = 0;
+
+  // Points the window would evict within this batch are only given their ids.
+  uint32_t skip = window > 0 && n_inserts > window ? n_inserts - (uint32_t)window : 0;
+  for (uint32_t i = 0; i < skip; i++) {
+    append_id(NO_SLOT);
+    nr_inserted++;
+    nr_evicted++;
+  }
+  for (uint32_t i = skip; i < n_inserts; i++) {
+    uint32_t s = new_slot();
+    memcpy(points[s].x, coords + (size_t)i * dimensions, dimensions * sizeof(int32_t));
+    append_id(s);
+    insert_point(s);
+    nr_inserted++;
+  }
+
+  // A new core point joins the cluster of every neighbouring core cell it reaches.
+  for (uint32_t i = 0; i < gained.size; i++) {
+    uint32_t s = gained.data[i];
+    Cell *cell = &cells[slot_cell[s]];
+    for (uint32_t j = 0; j < cell->neighbors.size; j++) {
+      Cell *near = &cells[cell->neighbors.data[j]];
+      if (near->n_core > 0 && find_label(near->label) != find_label(cell->label) && reaches_core(s, near))
+        union_labels(cell->label, near->label);
+    }
+  }
+
+  // Deleted slots are only reused after this batch.
+  for (uint32_t i = 0; i < n_deletes; i++) {
+    uint32_t s = lookup_id(deletes[i]);
+    if (s == NO_SLOT) {
+      nr_unknown++;
+      continue;
+    }
+    push(&dead, s);
+    id_slot[deletes[i] - id_first] = NO_SLOT;
+    nr_deleted++;
+  }
+  for (; window > 0 && window_next + window < next_id; window_next++) {
+    uint32_t s = lookup_id(window_next);
+    if (s != NO_SLOT) {
+      push(&dead, s);
+      id_slot[window_next - id_first] = NO_SLOT;
+      nr_evicted++;
+    }
+  }
+  for (uint32_t i = 0; i < dead.size; i++)
+    remove_point(dead.data[i]);
+
+  // Every link a lost core point took part in joined its cell to a neighbour. The core cells among those, grouped
+  // by cluster, seed the split checks.
+  SeedEntry *entries = NULL;
+  uint32_t n_entries = 0, entries_capacity = 0;
+  for (uint32_t i = 0; i < lost_cells.size; i++) {
+    Cell *cell = &cells[lost_cells.data[i]];
+    for (uint32_t j = 0; j <= cell->neighbors.size; j++) {
+      uint32_t e = j < cell->neighbors.size ? cell->neighbors.data[j] : lost_cells.data[i];
+      if (cells[e].n_core == 0)
+        continue;
+      if (n_entries == entries_capacity) {
+        entries_capacity = entries_capacity ? entries_capacity * 2 : 256;
+        entries = (SeedEntry *)grow(entries, entries_capacity * sizeof(SeedEntry));
+      }
+      entries[n_entries].label = find_label(cells[e].label);
+      entries[n_entries++].cell = e;
+    }
+  }
+  qsort(entries, n_entries, sizeof(SeedEntry), compare_seeds);
+  for (uint32_t i = 0, j; i < n_entries; i = j) {
+    seeds.size = 0;
+    for (j = i; j < n_entries && entries[j].label == entries[i].label; j++) {
+      if (j == i || entries[j].cell != entries[j - 1].cell)
+        push(&seeds, entries[j].cell);
+    }
+    if (seeds.size > 1)
+      check_split(seeds.data, seeds.size);
+  }
+  free(entries);
+
+  for (uint32_t i = 0; i < dead.size; i++)
+    push(&free_slots, dead.data[i]);
+  if (n_labels > 2 * n_cells + 1024)
+    compact_labels();
+}
+
+// Recomputes every count and label from scratch (for -v).
+static void recluster_all(void) {
+  n_labels = 0;
+  for (uint32_t c = 0; c < n_cells; c++)
+    cells[c].n_core = 0;
+  for (uint64_t id = id_first; id < next_id; id++) {
+    uint32_t s = lookup_id(id);
+    if (s == NO_SLOT)
+      continue;
+    count[s] = count_neighbors(s);
+    core[s] = count[s] >= min_pts;
+    if (core[s] && cells[slot_cell[s]].n_core++ == 0)
+      cells[slot_cell[s]].label = new_label();
+  }
+  for (uint32_t c = 0; c < n_cells; c++) {
+    if (cells[c].n_core == 0)
+      continue;
+    for (uint32_t j = 0; j < cells[c].neighbors.size; j++) {
+      Cell *near = &cells[cells[c].neighbors.data[j]];
+      if (near->n_core > 0 && find_label(near->label) != find_label(cells[c].label) && cells_linked(&cells[c], near))
+        union_labels(cells[c].label, near->label);
+    }
+  }
+}
+
+// Labels the live points in id order, as dbscan_cpu numbers them: clusters from 1 in the order of their first core
+// point, and a border point takes the smallest cluster among its core neighbours. Returns the number of points.
+static uint32_t label_points(int32_t *labels, uint32_t *n_clusters) {
+  uint32_t n = 0;
+  int32_t cluster = 0;
+  int32_t *label_cluster = (int32_t *)grow(NULL, (n_labels > 0 ? n_labels : 1) * sizeof(int32_t));
+  for (uint32_t i = 0; i < n_labels; i++)
+    label_cluster[i] = UNCLASSIFIED;
+  for (uint64_t id = id_first; id < next_id; id++) {
+    uint32_t s = lookup_id(id);
+    if (s == NO_SLOT || !core[s])
+      continue;
+    uint32_t r = find_label(cells[slot_cell[s]].label);
+    if (label_cluster[r] == UNCLASSIFIED)
+      label_cluster[r] = ++cluster;
+    points[s].cluster = label_cluster[r];
+  }
+
+  // The core points of a border point's own cell are all within eps; other cells are only searched if their
+  // cluster would be smaller.
+  for (uint64_t id = id_first; id < next_id; id++) {
+    uint32_t s = lookup_id(id);
+    if (s == NO_SLOT)
+      continue;
+    if (!core[s]) {
+      const Cell *cell = &cells[slot_cell[s]];
+      int32_t best = cell->n_core > 0 ? label_cluster[find_label(cell->label)] : NOISE;
+      for (uint32_t j = 0; j < cell->neighbors.size; j++) {
+        const Cell *near = &cells[cell->neighbors.data[j]];
+        if (near->n_core == 0)
+          continue;
+        int32_t c = label_cluster[find_label(near->label)];
+        if ((best == NOISE || c < best) && reaches_core(s, near))
+          best = c;
+      }
+      points[s].cluster = best;
+    }
+    labels[n++] = points[s].cluster;
+  }
+  free(label_cluster);
+  *n_clusters = (uint32_t)cluster;
+  return n;
+}
+
+void usage(const char *prog) {
+  printf("Usage: %s [-b batch_size] [-w window] [-p] [-v] [-o text|binary|mmap] <eps> <min_pts> <output_prefix> < stream\n",
+         prog);
+  printf("  stream: one point per line as up to %d comma-separated integers, \"d <id>\" to delete the point\n"
+         "          inserted as the id-th (from 0), and an empty line to end a batch\n",
+         CELL_MAX_DIMENSIONS);
+  printf("  -b  also end a batch after this many insertions (default: 0, only at empty lines)\n");
+  printf("  -w  sliding window: keep only the last this many inserted points (default: 0, keep all)\n");
+  printf("  -p  also write the remaining points, in label order, to <output_prefix>_points.csv\n");
+  printf("  -v  recluster from scratch after every batch and check that the labels match\n");
+  printf("  -o  labels file format: text, or int32 binary written directly or through mmap (default: text)\n");
+}
+
+int main(int argc, char *argv[]) {
+  int opt, write_points = 0;
+  LabelFormat label_format = LABELS_TEXT;
+  while ((opt = getopt(argc, argv, "b:w:pvo:")) != -1) {
+    switch (opt) {
+    case 'b':
+      batch_size = (uint32_t)strtoul(optarg, NULL, 10);
+      break;
+    case 'w':
+      window = strtoull(optarg, NULL, 10);
+      break;
+    case 'p':
+      write_points = 1;
+      break;
+    case 'v':
+      verify = 1;
+      break;
+    case 'o':
+      if (!parse_label_format(optarg, &label_format)) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 3) {
+    usage(argv[0]);
+    return 1;
+  }
+  eps = (uint32_t)atoi(argv[optind]);
+  eps_squared = eps * eps;
+  min_pts = (uint32_t)atoi(argv[optind + 1]);
+  char *output_prefix = argv[optind + 2];
+
+  // Pending batch: inserted coordinates and deleted ids.
+  int32_t *pending = NULL;
+  uint64_t *deletes = NULL;
+  uint32_t n_pending = 0, pending_capacity = 0, n_deletes = 0, deletes_capacity = 0;
+  uint32_t n_batches = 0, mismatches = 0;
+  double update_time = 0, verify_time = 0;
+  int32_t *labels = NULL, *check = NULL;
+  uint32_t labels_capacity = 0, n_clusters = 0;
+
+  char *line = NULL;
+  size_t line_capacity = 0;
+  uint64_t line_number = 0;
+  double stream_start = wall_time();
+  for (;;) {
+    ssize_t len = getline(&line, &line_capacity, stdin);
+    int end_batch = len == -1;
+    if (len != -1) {
+      line_number++;
+      while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        line[--len] = '\0';
+      if (len == 0) {
+        end_batch = 1;
+      } else if (line[0] == 'd') {
+        if (n_deletes == deletes_capacity) {
+          deletes_capacity = deletes_capacity ? deletes_capacity * 2 : 1024;
+          deletes = (uint64_t *)grow(deletes, deletes_capacity * sizeof(uint64_t));
+        }
+        deletes[n_deletes++] = strtoull(line + 1, NULL, 10);
+      } else {
+        int32_t x[CELL_MAX_DIMENSIONS];
+        int n = 0;
+        char *p = line, *end;
+        for (;;) {
+          long v = strtol(p, &end, 10);
+          if (end == p || n == CELL_MAX_DIMENSIONS) {
+            end = p;
+            break;
+          }
+          x[n++] = (int32_t)v;
+          while (*end == ' ' || *end == '\t')
+            end++;
+          if (*end != ',')
+            break;
+          p = end + 1;
+        }
+        if (dimensions == 0 && n > 0 && *end == '\0') {
+          dimensions = n;
+          init_cells();
+        }
+        if (n == 0 || n != dimensions || *end != '\0') {
+          if (dimensions == 0)
+            fprintf(stderr, "Line %" PRIu64 ": expected 1 to %d comma-separated integers\n", line_number,
+                    CELL_MAX_DIMENSIONS);
+          else
+            fprintf(stderr, "Line %" PRIu64 ": expected %d comma-separated integers\n", line_number, dimensions);
+          return 1;
+        }
+        if (n_pending == pending_capacity) {
+          pending_capacity = pending_capacity ? pending_capacity * 2 : 1024;
+          pending = (int32_t *)grow(pending, (size_t)pending_capacity * dimensions * sizeof(int32_t));
+        }
+        memcpy(pending + (size_t)n_pending * dimensions, x, dimensions * sizeof(int32_t));
+        n_pending++;
+        end_batch = batch_size > 0 && n_pending == batch_size;
+      }
+    }
+
+    if (end_batch && (n_pending > 0 || n_deletes > 0)) {
+      double start = wall_time();
+      apply_batch(pending, n_pending, deletes, n_deletes);
+      update_time += wall_time() - start;
+      n_batches++;
+      n_pending = n_deletes = 0;
+
+      if (verify) {
+        start = wall_time();
+        uint64_t live = next_id - id_first;
+        if (live > labels_capacity) {
+          labels_capacity = (uint32_t)live;
+          labels = (int32_t *)grow(labels, labels_capacity * sizeof(int32_t));
+          check = (int32_t *)grow(check, labels_capacity * sizeof(int32_t));
+        }
+        uint32_t n = label_points(labels, &n_clusters);
+        uint64_t distances = nr_distances, recounts = nr_recounts;
+        recluster_all();
+        label_points(check, &n_clusters);
+        nr_distances = distances;
+        nr_recounts = recounts;
+        if (memcmp(labels, check, n * sizeof(int32_t)) != 0) {
+          fprintf(stderr, "Batch %u: incremental labels differ from a full recompute\n", n_batches);
+          mismatches++;
+        }
+        verify_time += wall_time() - start;
+      }
+    }
+    if (len == -1)
+      break;
+  }
+  double stream_time = wall_time() - stream_start;
+  free(line);
+  free(pending);
+  free(deletes);
+
+  uint64_t span = next_id - id_first;
+  labels = (int32_t *)grow(labels, (span > 0 ? span : 1) * sizeof(int32_t));
+  double start = wall_time();
+  uint32_t n_live = label_points(labels, &n_clusters);
+  double label_time = wall_time() - start;
+  uint32_t n_core = 0;
+  for (uint32_t c = 0; c < n_cells; c++)
+    n_core += cells[c].n_core;
+
+  char labels_output_file[256];
+  snprintf(labels_output_file, sizeof(labels_output_file), "%s_labels.%s", output_prefix,
+           label_extension(label_format));
+  start = wall_time();
+  if (!write_labels(labels_output_file, labels, sizeof(int32_t), n_live, label_format, 0))
+    return 1;
+  double output_time = wall_time() - start;
+
+  if (write_points) {
+    char points_file[256];
+    snprintf(points_file, sizeof(points_file), "%s_points.csv", output_prefix);
+    FILE *out = fopen(points_file, "w");
+    if (!out) {
+      printf("Error opening points file\n");
+      return 1;
+    }
+    for (uint64_t id = id_first; id < next_id; id++) {
+      uint32_t s = lookup_id(id);
+      if (s == NO_SLOT)
+        continue;
+      for (int k = 0; k < dimensions; k++)
+        fprintf(out, k ? ",%d" : "%d", points[s].x[k]);
+      fprintf(out, "\n");
+    }
+    fclose(out);
+  }
+
+  char result_file[256];
+  snprintf(result_file, sizeof(result_file), "%s_result.txt", output_prefix);
+  FILE *result = fopen(result_file, "w");
+  if (result == NULL) {
+    printf("Error opening result file\n");
+    return 1;
+  }
+  fprintf(result, "Incremental DBSCAN: %u batches updated in %f seconds (%f seconds per batch)\n", n_batches,
+          update_time, n_batches ? update_time / n_batches : 0.0);
+  fprintf(result, "Dimensions: %d\n", dimensions);
+  fprintf(result, "Inserted: %" PRIu64 ", deleted: %" PRIu64 ", evicted by the window: %" PRIu64
+          ", unknown ids: %" PRIu64 "\n", nr_inserted, nr_deleted, nr_evicted, nr_unknown);
+  fprintf(result, "Points: %u, core points: %u, clusters: %u\n", n_live, n_core, n_clusters);
+  fprintf(result, "Cells: %u of size %lld\n", n_cells, (long long)cell_side);
+  fprintf(result, "Distance tests: %" PRIu64 ", full recounts: %" PRIu64 "\n", nr_distances, nr_recounts);
+  fprintf(result, "Split checks: %" PRIu64 " (%" PRIu64 " cells expanded, %" PRIu64 " splits)\n", nr_split_checks,
+          nr_split_visits, nr_splits);
+  fprintf(result, "Labels: %s, computed in %f seconds\n", label_format_name(label_format), label_time);
+  if (verify) {
+    fprintf(result, "Verified against a full recompute after every batch in %f seconds: %u mismatches\n",
+            verify_time, mismatches);
+  }
+  // The cells and core counts are maintained by the updates, so index and core points are no phases of their own;
+  // reading the stream includes waiting for its producer.
+  PhaseTimes phases;
+  init_phase_times(&phases);
+  phases.seconds[PHASE_LOAD] = stream_time - update_time - verify_time;
+  phases.seconds[PHASE_EXPANSION] = update_time + label_time;
+  phases.seconds[PHASE_OUTPUT] = output_time;
+  print_phase_times(result, &phases, n_live);
+  fclose(result);
+
+  printf("Results saved to %s\n", result_file);
+  printf("Predicted labels saved to %s\n", labels_output_file);
+
+  for (uint32_t c = 0; c < n_cells; c++) {
+    free(cells[c].slots.data);
+    free(cells[c].neighbors.data);
+  }
+  free(cells);
+  free(cell_table);
+  free(offsets);
+  for (uint32_t b = 0; b < n_blocks; b++)
+    free(blocks[b]);
+  free(blocks);
+  free(points);
+  free(count);
+  free(core);
+  free(slot_cell);
+  free(cell_pos);
+  free(id_slot);
+  free(label_parent);
+  for (uint32_t k = 0; k < search_capacity; k++)
+    free(searches[k].queue.data);
+  free(searches);
+  free(search_group);
+  free(group_open);
+  free(free_slots.data);
+  free(gained.data);
+  free(lost_cells.data);
+  free(dead.data);
+  free(seeds.data);
+  free(labels);
+  free(check);
+  return mismatches > 0;
+}
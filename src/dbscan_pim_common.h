@@ -0,0 +1,77 @@
+#ifndef DBSCAN_PIM_COMMON_H
+#define DBSCAN_PIM_COMMON_H
+
+// host와 DPU 프로그램이 함께 쓰는 정의
+
+#include <stdint.h>
+
+#define MAX_DPU_DIMENSIONS 16        // DPU 프로그램은 좌표 차원(DIMENSIONS)별로 따로 빌드된다
+#define MRAM_POINT_BYTES (16u << 20) // 점 저장에 쓰는 MRAM 크기
+#define MAX_NEIGHBORS (4u << 20)     // MRAM이 받올 수 있는 최대 이웃 개수 (word)
+#define MAX_QUERIES 256              // 한 번의 launch로 처리하는 최대 query 개수
+// query 좌표는 WRAM에 놓이므로 차원이 크면 launch당 query 수를 줄여 좌표 수를 MAX_QUERY_COORDS 이하로 맞춘다.
+// (16차원에서 256개를 두면 tasklet stack과 합쳐 WRAM 64KB를 넘는다)
+#define MAX_QUERY_COORDS 1024
+#define DPU_MAX_QUERIES(dimensions) \
+  ((MAX_QUERY_COORDS / (dimensions) < MAX_QUERIES) ? MAX_QUERY_COORDS / (dimensions) : MAX_QUERIES)
+#define MAX_TASKLETS 24
+#define NEIGHBOR_PAD 0xFFFFFFFFu     // segment를 8바이트로 맞추기 위한 padding 값
+#define CORE_BLOCK 64                // core bitmap에서 tasklet이 한 번에 맡는 점 수 (2 word)
+
+enum {
+  KERNEL_QUERY = 0, // query_points의 이웃을 찾는다
+  KERNEL_CORE = 1,  // 자기 점 전부의 이웃 수를 세어 core bitmap을 만든다
+  KERNEL_LOCAL = 2, // 자기 core 점들을 union-find로 묶고 DPU 경계를 넘는 쌍만 낸다
+};
+
+// MRAM에는 좌표만 저장한다. 점의 번호는 MRAM 위치 + config.index_base로 정해진다.
+// 점 하나는 DIMENSIONS개의 좌표이며 host는 DPU 프로그램의 차원에 맞춰 보낸다.
+enum {
+  POINT_FORMAT_32 = 0, // int32 좌표
+  POINT_FORMAT_16 = 1, // config.origin 기준 uint16 좌표 (DPU의 bounding box가 65535 이하일 때만 사용)
+};
+
+// DPU별로 한 번만 보내는 설정. MRAM에는 자기 점 n_points개 뒤 halo_begin부터 다른 DPU의 점 중 bounding box에서
+// eps 이내인 halo 점 n_halo개가 놓인다. 두 구간은 각각 첫 번째 좌표 순으로 정렬되어 있다.
+// weighted이면 점마다 같은 좌표의 입력 점 몇 개를 합친 것인지가 mram_weights에 같은 위치로 놓이고, 이웃 수는
+// 이 가중치의 합으로 센다. (host가 min_pts에서 잘라 보내므로 uint16으로 충분하다)
+typedef struct {
+  uint32_t n_points;
+  uint32_t index_base;
+  uint32_t point_format;
+  uint32_t n_halo;
+  uint32_t halo_begin;
+  uint32_t min_pts;
+  int32_t eps;
+  int32_t eps_squared;
+  uint32_t weighted;
+  uint32_t reserved; // DpuConfig 크기를 8바이트의 배수로 맞춘다
+  int32_t origin[MAX_DPU_DIMENSIONS]; // 앞쪽 DIMENSIONS개만 쓴다 (모든 차원의 DPU 프로그램이 같은 layout을 쓰도록)
+} DpuConfig;
+
+// launch가 끝난 뒤 host가 한 번에 가져가는 DPU 상태
+typedef struct {
+  uint32_t n_answered;     // mram_neighbors가 부족하면 앞쪽 query만 처리하고 멈춘다
+  uint32_t neighbor_count; // mram_neighbors에 쓰인 전체 word 수
+  uint64_t cycles;         // kernel 수행 cycle (tasklet 0 기준)
+} QueryStatus;
+
+// COUNTERS=1로 빌드한 DPU 프로그램이 tasklet별로 나누어 세는 단계. 각 단계는 DPU cycle counter의 차이이므로
+// 다른 tasklet이 돌던 시간도 들어간다.
+enum {
+  PROFILE_MRAM_READ = 0,    // mram_read
+  PROFILE_COMPUTE = 1,      // 거리 계산 loop와 나머지 계산
+  PROFILE_MUTEX_WAIT = 2,   // union_mutex를 얻기까지 기다린 시간
+  PROFILE_MRAM_WRITE = 3,   // mram_write
+  PROFILE_BARRIER_WAIT = 4, // 다른 tasklet을 기다린 시간
+  NR_PROFILE_PHASES = 5,
+};
+
+// launch 하나의 tasklet별 단계 cycle. launch마다 새로 세며 host가 launch 뒤에 가져간다.
+typedef struct {
+  uint64_t cycles[MAX_TASKLETS][NR_PROFILE_PHASES];
+  uint32_t n_tasklets;
+  uint32_t reserved; // DpuProfile 크기를 8바이트의 배수로 맞춘다
+} DpuProfile;
+
+#endif
@@ -3,102 +3,719 @@
 #include <defs.h>
 #include <mram.h>
 #include <mutex.h>
-// #include <perfcounter.h>
+#include <perfcounter.h>
 #include <stdio.h>
 
+#include "dbscan_pim_common.h"
+
+#ifndef DIMENSIONS         // Makefile이 -DDIMENSIONS=<d>로 차원별 프로그램을 만든다
 #define DIMENSIONS 2
-#define MAX_NEIGHBORS 1048576 // MRAM이 받올 수 있는 최대 점의 개수
-#define CACHE_SIZE 123        // WRAM이 가져올 수 있는 최대 점의 개수
-#define BUFFER_SIZE 512       // 결과 저장 버퍼
-#ifndef NR_TASKLETS           // 오류 안뜨게 하는 용도
+#endif
+_Static_assert(DIMENSIONS >= 2 && DIMENSIONS <= MAX_DPU_DIMENSIONS, "지원하지 않는 DIMENSIONS");
+
+#define CACHE_BYTES 1984   // tasklet이 MRAM에서 한 번에 읽는 점 데이터 크기
+#define BUFFER_SIZE 128    // tasklet별 결과 저장 버퍼
+#define COPY_SIZE 256      // staging에서 옮길 때 한 번에 읽는 word 수 (point_cache를 재사용)
+// core/local 단계에서 WRAM에 한 번에 푸는 점 개수. 차원이 커지면 줄여서 작업 버퍼가 point_cache 안에 들어가게 한다.
+#define CHUNK_POINTS (CORE_BLOCK / ((DIMENSIONS + 1) / 2))
+// 8바이트 정렬을 위해 함께 읽어야 하는 최대 점 개수. 좌표가 2개 이상이면 점 하나가 2바이트의 짝수 배이거나
+// 4바이트의 배수이므로 4개를 넘지 않는다.
+#define MAX_DMA_UNIT 4
+#ifndef NR_TASKLETS        // 오류 안뜨게 하는 용도
 #define NR_TASKLETS 11
 #endif
 
 typedef struct {
   int32_t x[DIMENSIONS];
-  int32_t cluster;
-  int32_t index;
-} Point;
+} MramPoint;
+
+typedef struct {
+  uint16_t x[DIMENSIONS];
+} MramPoint16;
+
+typedef struct {
+  int32_t x[DIMENSIONS];
+} QueryPoint;
 
 BARRIER_INIT(setup_barrier, NR_TASKLETS);
-BARRIER_INIT(final_sync_barrier, NR_TASKLETS);
-MUTEX_INIT(neighbor_mutex);
-MUTEX_INIT(buffer_mutex);
+BARRIER_INIT(query_barrier, NR_TASKLETS);
 
-__mram_noinit Point mram_points[MAX_NEIGHBORS];
+// config.point_format에 따라 MramPoint 또는 MramPoint16의 배열
+__mram_noinit uint8_t mram_points[MRAM_POINT_BYTES];
+
+// config.weighted일 때 MRAM 위치별 점의 가중치. 8바이트 단위로 읽으므로 끝에 여유를 둔다.
+__mram_noinit uint16_t mram_weights[MRAM_POINT_BYTES / sizeof(MramPoint16) + 4];
 
 // host에게 전달할 값들
+// query q의 이웃은 mram_neighbors[query_offsets[q]]부터 query_words[q] word이며, NEIGHBOR_PAD가 아닌 것이
+// 실제 이웃이다. (segment 시작은 항상 짝수) query_counts[q]는 이웃 수이고, config.weighted이면 이웃 가중치의 합이다.
 __mram_noinit uint32_t mram_neighbors[MAX_NEIGHBORS];
-__host uint32_t neighbor_count;
+__host QueryStatus status;
+__host uint32_t query_counts[DPU_MAX_QUERIES(DIMENSIONS)];
+__host uint32_t query_offsets[DPU_MAX_QUERIES(DIMENSIONS)];
+__host uint32_t query_words[DPU_MAX_QUERIES(DIMENSIONS)];
+
+// KERNEL_CORE 결과: 자기 점 i가 core이면 word (i / 32)의 bit (i % 32)가 1이다.
+// KERNEL_LOCAL 입력: halo 점 halo_begin + j가 core이면 mram_halo_core_bits의 bit j가 1이다. (host가 채운다)
+// 한 번에 4 word씩 읽으므로 끝에 여유를 둔다.
+__mram_noinit uint32_t mram_core_bits[MRAM_POINT_BYTES / sizeof(MramPoint16) / 32 + 4];
+__mram_noinit uint32_t mram_halo_core_bits[MRAM_POINT_BYTES / sizeof(MramPoint16) / 32 + 4];
+
+__host DpuConfig config;
+__host uint32_t kernel_mode;
+__host uint32_t n_queries;
+__host QueryPoint query_points[DPU_MAX_QUERIES(DIMENSIONS)];
+
+// tasklet t는 자신이 맡은 점 구간에서 찾은 이웃을 WRAM 버퍼에 모으고, 버퍼가 차면 mram_staging의 자기 구간에
+// 내려 쓴다. 모든 tasklet이 끝나면 개수의 prefix-sum으로 위치를 정해 각자 mram_neighbors로 옮기므로 lock이 없다.
+__mram_noinit uint32_t mram_staging[MAX_NEIGHBORS + 2 * NR_TASKLETS];
+__dma_aligned uint32_t output_buffer[NR_TASKLETS][BUFFER_SIZE];
+uint32_t tasklet_count[NR_TASKLETS];  // 현재 query에서 찾은 이웃 수
+uint32_t tasklet_weight[NR_TASKLETS]; // 그 이웃들의 가중치 합 (config.weighted일 때)
+uint32_t tasklet_staged[NR_TASKLETS]; // 그중 staging에 내려 쓴 수
+uint8_t out_of_space;
+
+// KERNEL_LOCAL: 점 i의 union-find 부모(MRAM 위치). query launch에서만 쓰는 mram_staging을 빌려 쓴다.
+#define mram_parent mram_staging
+MUTEX_INIT(union_mutex); // tasklet 구간을 넘는 union과 쌍 출력 자리 예약에 쓴다
+uint32_t pair_words;     // mram_neighbors에 예약된 word 수
+uint8_t pairs_overflow;
+
+// core/local 단계의 작업 버퍼. stack을 아끼기 위해 main의 point_cache 위에 놓는다.
+typedef struct {
+  __dma_aligned uint8_t raw[(CHUNK_POINTS + MAX_DMA_UNIT) * sizeof(MramPoint)];
+  __dma_aligned uint32_t bits[4];       // 후보 chunk의 core bit
+  __dma_aligned uint32_t block_bits[2]; // block의 core bit
+  __dma_aligned uint16_t weights[CHUNK_POINTS + 4]; // 후보 chunk의 가중치 (load_weights)
+  int32_t block[CHUNK_POINTS][DIMENSIONS]; // block 중 지금 처리하는 부분 (part)
+  int32_t coords[CHUNK_POINTS][DIMENSIONS];
+  union {
+    uint32_t counts[CHUNK_POINTS]; // KERNEL_CORE: part 점별 이웃 수
+    uint32_t roots[CHUNK_POINTS];  // KERNEL_LOCAL: core 점은 root, 아니면 자기 위치
+  };
+} Scratch;
+_Static_assert(sizeof(Scratch) <= CACHE_BYTES, "core 단계의 작업 버퍼가 point_cache보다 크다");
+
+uint32_t point_size; // config.point_format에 따른 점 하나의 바이트 수
+uint32_t dma_unit;   // 8바이트 정렬을 지키는 최소 점 개수
+
+#ifdef DBSCAN_COUNTERS
+// tasklet별 단계 cycle (dbscan_pim_common.h의 PROFILE_*). tasklet은 지금 단계와 그 시작 cycle을 들고 있다가
+// 단계가 바뀔 때 그 사이의 cycle을 더한다.
+__host DpuProfile profile;
+perfcounter_t profile_mark[NR_TASKLETS];
+uint8_t profile_phase[NR_TASKLETS];
+
+static inline void profile_switch(uint32_t phase) {
+  uint32_t t = me();
+  perfcounter_t now = perfcounter_get();
+  profile.cycles[t][profile_phase[t]] += now - profile_mark[t];
+  profile_mark[t] = now;
+  profile_phase[t] = phase;
+}
 
-__host uint32_t n_points;
-__host int32_t eps_squared;
-__host Point query_point;
+// tasklet 0이 cycle counter를 초기화하기 전에 자기 줄을 비우고, 초기화된 뒤(첫 barrier 다음)부터 센다.
+static inline void profile_reset(uint32_t tasklet_id) {
+  for (uint32_t p = 0; p < NR_PROFILE_PHASES; p++)
+    profile.cycles[tasklet_id][p] = 0;
+  if (tasklet_id == 0)
+    profile.n_tasklets = NR_TASKLETS;
+}
+
+static inline void profile_start(uint32_t tasklet_id) {
+  profile_mark[tasklet_id] = perfcounter_get();
+  profile_phase[tasklet_id] = PROFILE_COMPUTE;
+}
+#else
+#define profile_switch(phase) ((void)0)
+#define profile_reset(tasklet_id) ((void)0)
+#define profile_start(tasklet_id) ((void)0)
+#endif
+
+// MRAM 복사와 기다림은 아래 함수로만 하여 COUNTERS=1일 때 단계별 cycle에 들어가게 한다.
+static inline void read_mram(const __mram_ptr void *from, void *to, uint32_t size) {
+  profile_switch(PROFILE_MRAM_READ);
+  mram_read(from, to, size);
+  profile_switch(PROFILE_COMPUTE);
+}
 
-__dma_aligned uint32_t points_per_tasklet;
-__dma_aligned uint32_t output_buffer[2][BUFFER_SIZE];
-__dma_aligned uint8_t active_buffer; // 0 or 1
-__dma_aligned uint32_t buffer_index;
+static inline void write_mram(const void *from, __mram_ptr void *to, uint32_t size) {
+  profile_switch(PROFILE_MRAM_WRITE);
+  mram_write(from, to, size);
+  profile_switch(PROFILE_COMPUTE);
+}
 
-int32_t squared_distance(const int32_t *a, const int32_t *b) {
+static inline void lock_union(void) {
+  profile_switch(PROFILE_MUTEX_WAIT);
+  mutex_lock(union_mutex);
+  profile_switch(PROFILE_COMPUTE);
+}
+
+static inline void wait_barrier(barrier_t *barrier) {
+  profile_switch(PROFILE_BARRIER_WAIT);
+  barrier_wait(barrier);
+  profile_switch(PROFILE_COMPUTE);
+}
+
+// 축마다 먼저 eps 범위를 확인하므로 곱셈은 후보 점에서만 하고 int32를 넘지 않는다.
+static inline int within_eps(const int32_t *diff) {
   int32_t sum = 0;
   for (int i = 0; i < DIMENSIONS; i++) {
-    int32_t diff = a[i] - b[i];
-    sum += diff * diff;
+    if (diff[i] > config.eps || diff[i] < -config.eps)
+      return 0;
+  }
+  for (int i = 0; i < DIMENSIONS; i++) {
+    sum += diff[i] * diff[i];
+  }
+  return sum <= config.eps_squared;
+}
+
+// MRAM 위치 pos인 점 하나의 가중치
+static inline uint32_t point_weight(uint32_t pos) {
+  __dma_aligned uint16_t quad[4];
+  read_mram(&mram_weights[pos & ~3u], quad, sizeof(quad));
+  return quad[pos & 3];
+}
+
+// 결과를 tasklet의 WRAM 버퍼에 넣고, 버퍼가 차면 staging에 내려 쓴다.
+static inline void emit_neighbor(uint32_t *buffer, uint32_t *buffered, uint32_t *staged, uint32_t staging_base,
+                                 uint32_t index) {
+  buffer[(*buffered)++] = index;
+  if (*buffered == BUFFER_SIZE) {
+    write_mram(buffer, &mram_staging[staging_base + *staged], sizeof(uint32_t) * BUFFER_SIZE);
+    *staged += BUFFER_SIZE;
+    *buffered = 0;
+  }
+}
+
+// 자기 구간 [begin, end)의 점들을 query와 비교하여 이웃을 버퍼/staging에 모은다.
+// begin은 dma_unit의 배수이고, 마지막 읽기는 dma_unit 단위로 올림하여 8바이트 정렬을 지킨다.
+void scan_query(const QueryPoint *query_point, uint8_t *point_cache, uint32_t tasklet_id, uint32_t begin,
+                uint32_t end) {
+  uint32_t *buffer = output_buffer[tasklet_id];
+  uint32_t staging_base = (begin & ~1u) + 2 * tasklet_id;
+  uint32_t buffered = 0, staged = 0, weight = 0;
+  uint32_t cache_points = (CACHE_BYTES / point_size) / dma_unit * dma_unit;
+  int32_t query[DIMENSIONS];
+  int32_t diff[DIMENSIONS];
+
+  for (int k = 0; k < DIMENSIONS; k++) {
+    query[k] = query_point->x[k];
+    if (config.point_format == POINT_FORMAT_16)
+      query[k] -= config.origin[k];
+  }
+
+  for (uint32_t i = begin; i < end; i += cache_points) {
+    uint32_t cache_size = (i + cache_points > end) ? (end - i) : cache_points;
+    uint32_t read_size = (cache_size + dma_unit - 1) / dma_unit * dma_unit;
+    read_mram(&mram_points[i * point_size], point_cache, read_size * point_size);
+
+    if (config.point_format == POINT_FORMAT_16) {
+      const MramPoint16 *cache = (const MramPoint16 *)point_cache;
+      for (uint32_t j = 0; j < cache_size; ++j) {
+        for (int k = 0; k < DIMENSIONS; k++)
+          diff[k] = (int32_t)cache[j].x[k] - query[k];
+        if (within_eps(diff)) {
+          emit_neighbor(buffer, &buffered, &staged, staging_base, config.index_base + i + j);
+          if (config.weighted)
+            weight += point_weight(i + j);
+        }
+      }
+    } else {
+      const MramPoint *cache = (const MramPoint *)point_cache;
+      for (uint32_t j = 0; j < cache_size; ++j) {
+        for (int k = 0; k < DIMENSIONS; k++)
+          diff[k] = cache[j].x[k] - query[k];
+        if (within_eps(diff)) {
+          emit_neighbor(buffer, &buffered, &staged, staging_base, config.index_base + i + j);
+          if (config.weighted)
+            weight += point_weight(i + j);
+        }
+      }
+    }
+  }
+  tasklet_count[tasklet_id] = staged + buffered;
+  tasklet_weight[tasklet_id] = weight;
+  tasklet_staged[tasklet_id] = staged;
+}
+
+// prefix 위치부터 staging에 내려 쓴 이웃과 버퍼에 남은 이웃을 옮긴다. 개수가 홀수면 padding을 붙인다.
+void write_segment(uint32_t *copy_buffer, uint32_t tasklet_id, uint32_t begin, uint32_t dest) {
+  uint32_t *buffer = output_buffer[tasklet_id];
+  uint32_t staging_base = (begin & ~1u) + 2 * tasklet_id;
+  uint32_t staged = tasklet_staged[tasklet_id];
+  uint32_t buffered = tasklet_count[tasklet_id] - staged;
+
+  for (uint32_t k = 0; k < staged; k += COPY_SIZE) {
+    uint32_t chunk = (k + COPY_SIZE > staged) ? (staged - k) : COPY_SIZE;
+    read_mram(&mram_staging[staging_base + k], copy_buffer, sizeof(uint32_t) * chunk);
+    write_mram(copy_buffer, &mram_neighbors[dest + k], sizeof(uint32_t) * chunk);
+  }
+  if (buffered > 0) {
+    if (buffered % 2)
+      buffer[buffered++] = NEIGHBOR_PAD;
+    write_mram(buffer, &mram_neighbors[dest + staged], sizeof(uint32_t) * buffered);
+  }
+}
+
+// MRAM 위치 pos부터 end 전까지 최대 CHUNK_POINTS개의 점을 int32 좌표로 풀어 coords에 담고 개수를 돌려준다.
+// 읽기 시작은 dma_unit 단위로 내림하므로 구간의 시작(0, halo_begin)은 dma_unit의 배수여야 한다.
+static uint32_t load_coords(uint32_t pos, uint32_t end, uint8_t *raw, int32_t (*coords)[DIMENSIONS]) {
+  uint32_t aligned = pos - pos % dma_unit;
+  uint32_t count = (end - pos > CHUNK_POINTS) ? CHUNK_POINTS : (end - pos);
+  uint32_t read_size = (pos - aligned + count + dma_unit - 1) / dma_unit * dma_unit;
+  read_mram(&mram_points[aligned * point_size], raw, read_size * point_size);
+
+  if (config.point_format == POINT_FORMAT_16) {
+    const MramPoint16 *cache = (const MramPoint16 *)raw + (pos - aligned);
+    for (uint32_t j = 0; j < count; j++)
+      for (int k = 0; k < DIMENSIONS; k++)
+        coords[j][k] = cache[j].x[k];
+  } else {
+    const MramPoint *cache = (const MramPoint *)raw + (pos - aligned);
+    for (uint32_t j = 0; j < count; j++)
+      for (int k = 0; k < DIMENSIONS; k++)
+        coords[j][k] = cache[j].x[k];
   }
-  return sum;
+  return count;
+}
+
+// MRAM 위치 pos부터 count개 점의 가중치를 읽는다. 점 pos + c의 가중치는 weights[pos % 4 + c]이다.
+static inline void load_weights(uint32_t pos, uint32_t count, uint16_t *weights) {
+  uint32_t aligned = pos & ~3u;
+  read_mram(&mram_weights[aligned], weights, ((pos - aligned + count + 3) & ~3u) * sizeof(uint16_t));
+}
+
+// bitmap에서 위치 rel부터 CHUNK_POINTS개의 bit가 들어 있는 4 word를 읽는다. bit (rel + c)는 core_bit(bits, rel, c)이다.
+static inline void load_core_bits(const __mram_ptr uint32_t *bitmap, uint32_t rel, uint32_t *bits) {
+  read_mram(&bitmap[(rel / 32) & ~1u], bits, 4 * sizeof(uint32_t));
+}
+
+static inline uint32_t core_bit(const uint32_t *bits, uint32_t rel, uint32_t c) {
+  uint32_t t = (rel & 63) + c;
+  return (bits[t / 32] >> (t % 32)) & 1;
+}
+
+// 자기 점 block blk의 끝 위치. block은 CHUNK_POINTS개씩 part로 나누어 scratch->block에 풀어 처리한다.
+static inline uint32_t block_end(uint32_t blk) {
+  uint32_t end = (blk + 1) * CORE_BLOCK;
+  return (end > config.n_points) ? config.n_points : end;
+}
+
+// scratch->block_bits에 읽어 둔 block bitmap에서 자기 점 pos의 core bit
+static inline uint32_t block_bit(const Scratch *scratch, uint32_t pos) {
+  uint32_t b = pos % CORE_BLOCK;
+  return (scratch->block_bits[b / 32] >> (b % 32)) & 1;
+}
+
+// 정렬된 구간 [*lo, region_end)에서 첫 번째 좌표가 low 이상인 첫 위치로 *lo를 옮긴다.
+// part는 tasklet마다 첫 번째 좌표 순으로 처리되므로 *lo는 앞으로만 움직인다.
+static void advance_window(uint32_t region_end, uint32_t *lo, int32_t low, Scratch *scratch) {
+  while (*lo < region_end) {
+    uint32_t n = load_coords(*lo, region_end, scratch->raw, scratch->coords);
+    uint32_t k = 0;
+    while (k < n && scratch->coords[k][0] < low)
+      k++;
+    *lo += k;
+    if (k < n)
+      break;
+  }
+}
+
+// 정렬된 구간 [*lo, region_end)에서 part의 첫 번째 좌표 범위 +-eps 안의 후보만 part 점들과 비교한다.
+// 아직 core가 아닌 점만 세며 (config.weighted이면 후보의 가중치만큼) part 전체가 core가 되면 바로 멈춘다.
+static void count_region(uint32_t region_end, uint32_t *lo, uint32_t part_count, uint32_t *remaining,
+                         Scratch *scratch) {
+  int32_t(*block)[DIMENSIONS] = scratch->block;
+  int32_t high = block[part_count - 1][0] + config.eps;
+  int32_t diff[DIMENSIONS];
+
+  advance_window(region_end, lo, block[0][0] - config.eps, scratch);
+  for (uint32_t pos = *lo; pos < region_end && *remaining > 0;) {
+    uint32_t n = load_coords(pos, region_end, scratch->raw, scratch->coords);
+    if (config.weighted)
+      load_weights(pos, n, scratch->weights);
+    for (uint32_t c = 0; c < n; c++) {
+      if (scratch->coords[c][0] > high)
+        return;
+      uint32_t weight = config.weighted ? scratch->weights[pos % 4 + c] : 1;
+      for (uint32_t b = 0; b < part_count; b++) {
+        if (scratch->counts[b] >= config.min_pts)
+          continue;
+        for (int k = 0; k < DIMENSIONS; k++)
+          diff[k] = scratch->coords[c][k] - block[b][k];
+        if (within_eps(diff) && (scratch->counts[b] += weight) >= config.min_pts)
+          (*remaining)--;
+      }
+    }
+    pos += n;
+  }
+}
+
+// tasklet이 맡는 CORE_BLOCK 단위의 block 구간
+static inline void tasklet_blocks(uint32_t tasklet_id, uint32_t *first_block, uint32_t *last_block) {
+  uint32_t n_blocks = (config.n_points + CORE_BLOCK - 1) / CORE_BLOCK;
+  *first_block = (uint32_t)((uint64_t)n_blocks * tasklet_id / NR_TASKLETS);
+  *last_block = (uint32_t)((uint64_t)n_blocks * (tasklet_id + 1) / NR_TASKLETS);
+}
+
+// KERNEL_CORE: 자기 점마다 자기 점과 halo 점 중 eps 이내의 점을 min_pts개까지 세어 core bitmap을 쓴다.
+// tasklet은 CORE_BLOCK개 단위의 연속 구간을 맡으므로 bitmap의 2 word를 각자 쓰고 lock이 필요 없다.
+static void detect_core_points(uint32_t tasklet_id, Scratch *scratch) {
+  uint32_t first_block, last_block;
+  uint32_t own_lo = 0, halo_lo = config.halo_begin;
+  tasklet_blocks(tasklet_id, &first_block, &last_block);
+
+  for (uint32_t blk = first_block; blk < last_block; blk++) {
+    uint32_t end = block_end(blk);
+    scratch->block_bits[0] = scratch->block_bits[1] = 0;
+    for (uint32_t part = blk * CORE_BLOCK; part < end; part += CHUNK_POINTS) {
+      uint32_t part_count = load_coords(part, end, scratch->raw, scratch->block);
+      uint32_t remaining = part_count;
+      for (uint32_t b = 0; b < part_count; b++)
+        scratch->counts[b] = 0;
+
+      count_region(config.n_points, &own_lo, part_count, &remaining, scratch);
+      if (remaining > 0)
+        count_region(config.halo_begin + config.n_halo, &halo_lo, part_count, &remaining, scratch);
+
+      for (uint32_t b = 0; b < part_count; b++) {
+        uint32_t bit = (part + b) % CORE_BLOCK;
+        if (scratch->counts[b] >= config.min_pts)
+          scratch->block_bits[bit / 32] |= 1u << (bit % 32);
+      }
+    }
+    write_mram(scratch->block_bits, &mram_core_bits[blk * 2], sizeof(scratch->block_bits));
+  }
+}
+
+// mram_parent 위의 union-find. 원소 하나를 바꿀 때도 8바이트 단위로 읽고 쓰므로, 동시에 쓰는 tasklet들은
+// 서로 다른 짝수 위치 쌍을 건드려야 한다. (tasklet 구간은 CORE_BLOCK 단위이므로 자기 구간 안에서는 항상 성립)
+static uint32_t uf_get(uint32_t i) {
+  __dma_aligned uint32_t pair[2];
+  read_mram(&mram_parent[i & ~1u], pair, sizeof(pair));
+  return pair[i & 1];
+}
+
+static void uf_set(uint32_t i, uint32_t parent) {
+  __dma_aligned uint32_t pair[2];
+  read_mram(&mram_parent[i & ~1u], pair, sizeof(pair));
+  pair[i & 1] = parent;
+  write_mram(pair, &mram_parent[i & ~1u], sizeof(pair));
+}
+
+// path halving으로 root를 찾는다.
+static uint32_t uf_find(uint32_t i) {
+  while (1) {
+    uint32_t parent = uf_get(i);
+    if (parent == i)
+      return i;
+    uint32_t grand = uf_get(parent);
+    if (grand != parent)
+      uf_set(i, grand);
+    i = grand;
+  }
+}
+
+// 더 작은 위치가 root가 되도록 잇는다.
+static void uf_union(uint32_t a, uint32_t b) {
+  a = uf_find(a);
+  b = uf_find(b);
+  if (a < b)
+    uf_set(b, a);
+  else if (b < a)
+    uf_set(a, b);
+}
+
+// scratch->block에 푼 part [part, part + part_count)의 core 점 p와 위치가 p보다 큰 core 점 c가 eps 이내이면
+// 합친다. shared가 0이면 자기 구간 [.., range_end) 안의 후보만 lock 없이 합치고, 1이면 range_end 이후의 후보만
+// union_mutex 안에서 합친다.
+static void union_part(uint32_t part, uint32_t part_count, uint32_t range_end, int shared, Scratch *scratch) {
+  uint32_t begin = shared ? range_end : part;
+  uint32_t end = shared ? config.n_points : range_end;
+  int32_t high = scratch->block[part_count - 1][0] + config.eps;
+  int32_t diff[DIMENSIONS];
+
+  for (uint32_t pos = begin; pos < end;) {
+    uint32_t n = load_coords(pos, end, scratch->raw, scratch->coords);
+    load_core_bits(mram_core_bits, pos, scratch->bits);
+    for (uint32_t c = 0; c < n; c++) {
+      if (scratch->coords[c][0] > high)
+        return;
+      if (!core_bit(scratch->bits, pos, c))
+        continue;
+      for (uint32_t b = 0; b < part_count && part + b < pos + c; b++) {
+        if (!block_bit(scratch, part + b))
+          continue;
+        for (int k = 0; k < DIMENSIONS; k++)
+          diff[k] = scratch->coords[c][k] - scratch->block[b][k];
+        if (!within_eps(diff))
+          continue;
+        if (shared)
+          lock_union();
+        uf_union(part + b, pos + c);
+        if (shared)
+          mutex_unlock(union_mutex);
+      }
+    }
+    pos += n;
+  }
+}
+
+// 자기 block blk의 core 점들을 part 단위로 union_part에 넘긴다.
+static void union_block(uint32_t blk, uint32_t range_end, int shared, Scratch *scratch) {
+  uint32_t end = block_end(blk);
+  read_mram(&mram_core_bits[blk * 2], scratch->block_bits, sizeof(scratch->block_bits));
+  if ((scratch->block_bits[0] | scratch->block_bits[1]) == 0)
+    return;
+
+  for (uint32_t part = blk * CORE_BLOCK; part < end; part += CHUNK_POINTS) {
+    uint32_t part_count = load_coords(part, end, scratch->raw, scratch->block);
+    union_part(part, part_count, range_end, shared, scratch);
+  }
+}
+
+// tasklet 버퍼의 쌍들을 mram_neighbors에 예약한 자리로 내려 쓴다. 자리가 없으면 pairs_overflow만 남긴다.
+static void flush_pairs(uint32_t tasklet_id, uint32_t *buffered) {
+  if (*buffered == 0)
+    return;
+  lock_union();
+  uint32_t dest = pair_words;
+  int fits = (dest + *buffered <= MAX_NEIGHBORS);
+  if (fits)
+    pair_words += *buffered;
+  else
+    pairs_overflow = 1;
+  mutex_unlock(union_mutex);
+  if (fits)
+    write_mram(output_buffer[tasklet_id], &mram_neighbors[dest], sizeof(uint32_t) * *buffered);
+  *buffered = 0;
+}
+
+// 쌍 (a, b)를 tasklet 버퍼에 넣고, 버퍼가 차면 mram_neighbors에 자리를 예약해 내려 쓴다. 바로 앞의 쌍과 같으면 버린다.
+static void emit_pair(uint32_t tasklet_id, uint32_t *buffered, uint32_t a, uint32_t b) {
+  uint32_t *buffer = output_buffer[tasklet_id];
+  if (*buffered > 0 && buffer[*buffered - 2] == a && buffer[*buffered - 1] == b)
+    return;
+  buffer[(*buffered)++] = a;
+  buffer[(*buffered)++] = b;
+  if (*buffered == BUFFER_SIZE)
+    flush_pairs(tasklet_id, buffered);
+}
+
+// core 점 p와 eps 이내의 halo core 점 q마다 (root(p), q)를, core가 아닌 점 p와 eps 이내의 halo core 점 q마다
+// (p, q)를 낸다.
+static void emit_halo_pairs(uint32_t tasklet_id, uint32_t part_count, uint32_t *halo_lo, uint32_t *buffered,
+                            Scratch *scratch) {
+  uint32_t halo_end = config.halo_begin + config.n_halo;
+  int32_t high = scratch->block[part_count - 1][0] + config.eps;
+  int32_t diff[DIMENSIONS];
+
+  advance_window(halo_end, halo_lo, scratch->block[0][0] - config.eps, scratch);
+  for (uint32_t pos = *halo_lo; pos < halo_end;) {
+    uint32_t n = load_coords(pos, halo_end, scratch->raw, scratch->coords);
+    load_core_bits(mram_halo_core_bits, pos - config.halo_begin, scratch->bits);
+    for (uint32_t c = 0; c < n; c++) {
+      if (scratch->coords[c][0] > high)
+        return;
+      if (!core_bit(scratch->bits, pos - config.halo_begin, c))
+        continue;
+      for (uint32_t b = 0; b < part_count; b++) {
+        for (int k = 0; k < DIMENSIONS; k++)
+          diff[k] = scratch->coords[c][k] - scratch->block[b][k];
+        if (within_eps(diff))
+          emit_pair(tasklet_id, buffered, scratch->roots[b], pos + c);
+      }
+    }
+    pos += n;
+  }
+}
+
+// core가 아닌 점 p와 eps 이내의 자기 core 점 c마다 (p, root(c))를 낸다.
+static void emit_border_pairs(uint32_t tasklet_id, uint32_t part, uint32_t part_count, uint32_t *own_lo,
+                              uint32_t *buffered, Scratch *scratch) {
+  int32_t high = scratch->block[part_count - 1][0] + config.eps;
+  int32_t diff[DIMENSIONS];
+
+  advance_window(config.n_points, own_lo, scratch->block[0][0] - config.eps, scratch);
+  for (uint32_t pos = *own_lo; pos < config.n_points;) {
+    uint32_t n = load_coords(pos, config.n_points, scratch->raw, scratch->coords);
+    load_core_bits(mram_core_bits, pos, scratch->bits);
+    for (uint32_t c = 0; c < n; c++) {
+      if (scratch->coords[c][0] > high)
+        return;
+      if (!core_bit(scratch->bits, pos, c))
+        continue;
+      uint32_t root = UINT32_MAX;
+      for (uint32_t b = 0; b < part_count; b++) {
+        if (block_bit(scratch, part + b))
+          continue;
+        for (int k = 0; k < DIMENSIONS; k++)
+          diff[k] = scratch->coords[c][k] - scratch->block[b][k];
+        if (!within_eps(diff))
+          continue;
+        if (root == UINT32_MAX)
+          root = uf_get(pos + c);
+        emit_pair(tasklet_id, buffered, part + b, root);
+      }
+    }
+    pos += n;
+  }
+}
+
+// KERNEL_LOCAL: 자기 core 점들을 mram_parent 위의 union-find로 묶고, host가 전체 cluster를 만들 때 필요한
+// halo 쪽 core 쌍과 border 쌍만 mram_neighbors에 낸다. 각 점의 root는 mram_parent에 남는다.
+// 자기 구간 안의 union은 lock 없이 먼저 끝내고, 구간을 넘는 union(첫 번째 좌표의 경계 부근)만 mutex로 묶는다.
+static void cluster_locally(uint32_t tasklet_id, Scratch *scratch) {
+  uint32_t first_block, last_block;
+  uint32_t *buffer = output_buffer[tasklet_id];
+  tasklet_blocks(tasklet_id, &first_block, &last_block);
+  uint32_t range_begin = first_block * CORE_BLOCK;
+  uint32_t range_end = last_block * CORE_BLOCK;
+  range_end = (range_end > config.n_points) ? config.n_points : range_end;
+  range_begin = (range_begin > range_end) ? range_end : range_begin;
+
+  for (uint32_t i = range_begin; i < range_end; i += BUFFER_SIZE) {
+    uint32_t count = (range_end - i > BUFFER_SIZE) ? BUFFER_SIZE : (range_end - i);
+    count += count % 2;
+    for (uint32_t j = 0; j < count; j++)
+      buffer[j] = i + j;
+    write_mram(buffer, &mram_parent[i], sizeof(uint32_t) * count);
+  }
+  wait_barrier(&setup_barrier);
+
+  for (uint32_t blk = first_block; blk < last_block; blk++)
+    union_block(blk, range_end, 0, scratch);
+  wait_barrier(&setup_barrier);
+  for (uint32_t blk = first_block; blk < last_block; blk++)
+    union_block(blk, range_end, 1, scratch);
+  wait_barrier(&setup_barrier);
+
+  // 모든 union이 끝났으므로 자기 구간의 부모를 root로 바꾼다. 다른 tasklet이 읽는 중이어도 root는 같다.
+  for (uint32_t i = range_begin; i < range_end; i += BUFFER_SIZE) {
+    uint32_t count = (range_end - i > BUFFER_SIZE) ? BUFFER_SIZE : (range_end - i);
+    for (uint32_t j = 0; j < count; j++) {
+      uint32_t root = i + j, parent;
+      while ((parent = uf_get(root)) != root)
+        root = parent;
+      buffer[j] = root;
+    }
+    if (count % 2) {
+      buffer[count] = i + count;
+      count++;
+    }
+    write_mram(buffer, &mram_parent[i], sizeof(uint32_t) * count);
+  }
+  wait_barrier(&setup_barrier);
+
+  uint32_t own_lo = 0, halo_lo = config.halo_begin;
+  uint32_t buffered = 0;
+  for (uint32_t blk = first_block; blk < last_block; blk++) {
+    uint32_t end = block_end(blk);
+    read_mram(&mram_core_bits[blk * 2], scratch->block_bits, sizeof(scratch->block_bits));
+    for (uint32_t part = blk * CORE_BLOCK; part < end; part += CHUNK_POINTS) {
+      uint32_t part_count = load_coords(part, end, scratch->raw, scratch->block);
+      uint32_t n_core = 0;
+      for (uint32_t b = 0; b < part_count; b++) {
+        if (block_bit(scratch, part + b)) {
+          scratch->roots[b] = uf_get(part + b);
+          n_core++;
+        } else {
+          scratch->roots[b] = part + b;
+        }
+      }
+      if (config.n_halo > 0)
+        emit_halo_pairs(tasklet_id, part_count, &halo_lo, &buffered, scratch);
+      if (n_core < part_count)
+        emit_border_pairs(tasklet_id, part, part_count, &own_lo, &buffered, scratch);
+    }
+  }
+  flush_pairs(tasklet_id, &buffered);
 }
 
 int main() {
-  __dma_aligned Point point_cache[CACHE_SIZE];
+  __dma_aligned uint8_t point_cache[CACHE_BYTES];
 
   uint32_t tasklet_id = me();
+  uint32_t n_points = config.n_points;
 
+  profile_reset(tasklet_id);
   if (tasklet_id == 0) {
-    neighbor_count = 0;
-    active_buffer = 0;
-    buffer_index = 0;
-
-    // uint32_t max_points_per_tasklet = (1 << 11) / sizeof(Point);
-    points_per_tasklet = n_points / NR_TASKLETS;
-    if (points_per_tasklet > CACHE_SIZE) {
-      points_per_tasklet = CACHE_SIZE;
-    }
+    perfcounter_config(COUNT_CYCLES, true);
+    status.neighbor_count = 0;
+    status.n_answered = 0;
+    pair_words = 0;
+    pairs_overflow = 0;
+    // 구간 경계가 dma_unit개 단위이면 모든 MRAM 읽기 주소가 8바이트 정렬된다.
+    point_size = (config.point_format == POINT_FORMAT_16) ? sizeof(MramPoint16) : sizeof(MramPoint);
+    dma_unit = 1;
+    while ((dma_unit * point_size) % 8)
+      dma_unit++;
   }
 
   barrier_wait(&setup_barrier);
+  profile_start(tasklet_id);
 
-  for (int i = tasklet_id * points_per_tasklet; i < n_points; i += points_per_tasklet * NR_TASKLETS) {
-    uint32_t cache_size = (i + points_per_tasklet > n_points) ? (n_points - i) : points_per_tasklet;
-    mram_read(&mram_points[i], point_cache, cache_size * sizeof(Point));
-    for (int j = 0; j < cache_size; ++j) {
-      if (squared_distance(point_cache[j].x, query_point.x) <= eps_squared) {
-        mutex_lock(neighbor_mutex);
-        output_buffer[active_buffer][buffer_index] = (uint32_t)point_cache[j].index;
-        buffer_index++;
-        neighbor_count++;
-
-        if (buffer_index == BUFFER_SIZE || neighbor_count == n_points) {
-          uint32_t current_buffer_size = buffer_index;
-          uint32_t current_neighbor_count = neighbor_count - current_buffer_size;
-          mutex_lock(buffer_mutex);
-          active_buffer = 1 - active_buffer;
-          buffer_index = 0;
-          mutex_unlock(neighbor_mutex);
-          mram_write(output_buffer[1 - active_buffer], &mram_neighbors[current_neighbor_count],
-                     sizeof(uint32_t) * current_buffer_size);
-          mutex_unlock(buffer_mutex);
-        } else {
-          mutex_unlock(neighbor_mutex);
-        }
+  if (kernel_mode == KERNEL_CORE || kernel_mode == KERNEL_LOCAL) {
+    if (kernel_mode == KERNEL_CORE)
+      detect_core_points(tasklet_id, (Scratch *)point_cache);
+    else
+      cluster_locally(tasklet_id, (Scratch *)point_cache);
+    wait_barrier(&setup_barrier);
+    if (tasklet_id == 0) {
+      // KERNEL_LOCAL: 쌍은 mram_neighbors에 neighbor_count word이고, n_answered가 0이면 자리가 모자랐다.
+      status.neighbor_count = pair_words;
+      status.n_answered = !pairs_overflow;
+      status.cycles = perfcounter_get();
+    }
+    profile_switch(PROFILE_COMPUTE); // 마지막 단계의 cycle을 더한다
+    return 0;
+  }
+
+  uint32_t n_units = (n_points + dma_unit - 1) / dma_unit;
+  uint32_t begin = (uint32_t)((uint64_t)n_units * tasklet_id / NR_TASKLETS) * dma_unit;
+  uint32_t end = (uint32_t)((uint64_t)n_units * (tasklet_id + 1) / NR_TASKLETS) * dma_unit;
+  end = (end > n_points) ? n_points : end;
+  begin = (begin > end) ? end : begin;
+
+  for (uint32_t q = 0; q < n_queries; q++) {
+    if (tasklet_id == 0) {
+      // 최악의 경우(모든 점이 이웃) segment가 들어갈 공간이 없으면 나머지 query는 host가 다시 보낸다.
+      out_of_space = (MAX_NEIGHBORS - status.neighbor_count < n_points + NR_TASKLETS);
+    }
+    wait_barrier(&query_barrier);
+    if (out_of_space)
+      break;
+
+    scan_query(&query_points[q], point_cache, tasklet_id, begin, end);
+    wait_barrier(&query_barrier);
+
+    // 앞선 tasklet들의 (짝수로 맞춘) 이웃 수를 더해 자기 segment 위치를 구한다.
+    uint32_t prefix = 0;
+    for (uint32_t t = 0; t < tasklet_id; t++) {
+      prefix += tasklet_count[t] + tasklet_count[t] % 2;
+    }
+    write_segment((uint32_t *)point_cache, tasklet_id, begin, status.neighbor_count + prefix);
+    wait_barrier(&query_barrier);
+
+    if (tasklet_id == 0) {
+      uint32_t count = 0, weight = 0, words = 0;
+      for (uint32_t t = 0; t < NR_TASKLETS; t++) {
+        count += tasklet_count[t];
+        weight += tasklet_weight[t];
+        words += tasklet_count[t] + tasklet_count[t] % 2;
       }
+      query_counts[q] = config.weighted ? weight : count;
+      query_words[q] = words;
+      query_offsets[q] = status.neighbor_count;
+      status.neighbor_count += words;
+      status.n_answered = q + 1;
     }
   }
-  barrier_wait(&final_sync_barrier);
 
-  if (tasklet_id == 0 && buffer_index > 0) {
-    mram_write(output_buffer[active_buffer], &mram_neighbors[neighbor_count - buffer_index],
-               sizeof(uint32_t) * (buffer_index + buffer_index % 2));
+  if (tasklet_id == 0) {
+    status.cycles = perfcounter_get();
   }
+  profile_switch(PROFILE_COMPUTE); // 마지막 단계의 cycle을 더한다
   return 0;
-}
\ No newline at end of file
+}
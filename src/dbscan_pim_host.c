@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
 #include <dpu.h>
 #include <dpu_log.h>
@@ -5,20 +7,30 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
+#include <unistd.h>
+
+#include "counters.h"
+#include "dataset.h"
+#include "dbscan_pim_common.h"
+#include "evaluate.h"
 
-#define DPU_BINARY "./bin/dbscan_pim_dpu"
+// DPU 프로그램은 차원별로 빌드되어 있다. 입력의 차원 이상인 것 중 가장 작은 것을 쓰고 남는 좌표는 0으로 채운다.
+#define DPU_BINARY_FORMAT "./bin/dbscan_pim_dpu_%dd"
+static const int dpu_program_dimensions[] = {2, 3, 4, 8, 16};
+// halo는 tile 뒤 8개 단위 위치부터 놓아 DPU의 MRAM 읽기가 8바이트 정렬을 지키게 한다.
+#define HALO_BEGIN(n_points) (((n_points) + 7u) & ~7u)
 
-#define DIMENSIONS 2
 #define UNCLASSIFIED -1
 #define NOISE -2
 
 // #define DPU_AMOUNT 64
 
+// x는 점마다 dimensions개의 좌표를 가리킨다.
 typedef struct {
-  int32_t x[DIMENSIONS];
+  int32_t *x;
   int32_t cluster;
-  int32_t index;
 } Point;
 
 typedef struct {
@@ -52,6 +64,7 @@ void free_int_vector(IntVector *vec) {
 
 int push_back(IntVector *vec, uint32_t value) {
   if (vec->size == vec->capacity) {
+    COUNT(vector_growths, 1);
     int new_capacity = vec->capacity * 2;
     uint32_t *new_data = (uint32_t *)realloc(vec->data, new_capacity * sizeof(uint32_t));
     if (!new_data)
@@ -64,112 +77,1074 @@ int push_back(IntVector *vec, uint32_t value) {
 }
 
 Point *points;
+Dataset dataset;
+int32_t *point_coords; // dataset.coords나 unique.coords, 또는 dimensions개로 늘린 복사본
+int coalesce = 1;       // 같은 좌표의 점들을 가중치를 가진 점 하나로 합쳐 clustering한다
+CoalescedPoints unique; // coalesce일 때 합친 점들
+int weighted;           // 실제로 합쳐진 점이 있다
+CurveKind curve = CURVE_NONE; // 점을 저장하고 방문하는 순서
+int remapped;           // points가 unique의 점들이다 (합쳐졌거나 순서를 바꿨다)
+int input_dimensions; // 입력 파일의 좌표 개수
+int dimensions;       // DPU 프로그램의 좌표 개수 (input_dimensions 이상)
 uint32_t nr_dpus;
 uint32_t min_pts;
+int64_t eps_squared;
 
+double wall_time(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// 점을 읽고 DPU 프로그램의 차원을 정한다. 좌표는 dimensions개로 늘려 뒤를 0으로 채우므로 거리는 그대로이다.
+// 입력의 차원이 DPU 프로그램과 같으면 (binary 파일은 mmap한 그대로) 복사하지 않는다.
+// coalesce이면 같은 좌표의 점들을 합친 unique 점들이 points가 되고 그 개수를 돌려준다. curve가 있으면 그 점들을
+// 곡선 순서로 정렬한다.
 uint32_t load_data(const char *filename) {
-  FILE *file = fopen(filename, "r");
-  if (!file) {
-    perror("Error opening file");
-    return -1;
+  if (!load_dataset(filename, 0, &dataset))
+    return 0;
+  input_dimensions = dataset.dimensions;
+  if ((coalesce || curve != CURVE_NONE) &&
+      !coalesce_points(dataset.coords, dataset.n_points, input_dimensions, coalesce, &unique))
+    return 0;
+  if (curve != CURVE_NONE && !sort_points_on_curve(&unique, input_dimensions, curve))
+    return 0;
+  weighted = coalesce && unique.n_unique < dataset.n_points;
+  remapped = weighted || curve != CURVE_NONE;
+  int32_t *source = remapped ? unique.coords : dataset.coords;
+  uint32_t count = remapped ? unique.n_unique : dataset.n_points;
+
+  dimensions = 0;
+  for (size_t k = 0; k < sizeof(dpu_program_dimensions) / sizeof(dpu_program_dimensions[0]); k++) {
+    if (dpu_program_dimensions[k] >= input_dimensions) {
+      dimensions = dpu_program_dimensions[k];
+      break;
+    }
+  }
+  if (dimensions == 0) {
+    fprintf(stderr, "%d-dimensional points are not supported on the DPUs (at most %d)\n", input_dimensions,
+            MAX_DPU_DIMENSIONS);
+    return 0;
+  }
+
+  point_coords = source;
+  if (dimensions != input_dimensions) {
+    point_coords = (int32_t *)calloc((size_t)count * dimensions, sizeof(int32_t));
+    if (!point_coords) {
+      fprintf(stderr, "Failed to allocate memory for points\n");
+      return 0;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      memcpy(point_coords + (size_t)i * dimensions, source + (size_t)i * input_dimensions,
+             sizeof(int32_t) * input_dimensions);
+    }
+  }
+  points = (Point *)malloc(count * sizeof(Point));
+  if (!points) {
+    fprintf(stderr, "Failed to allocate memory for points\n");
+    return 0;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    points[i].x = point_coords + (size_t)i * dimensions;
+    points[i].cluster = UNCLASSIFIED;
+  }
+  return count;
+}
+
+// 각 DPU에 놓인 점들의 bounding box. host는 이것으로 query를 eps-ball과 겹치는 DPU에만 보낸다.
+typedef struct {
+  int32_t min[MAX_DPU_DIMENSIONS];
+  int32_t max[MAX_DPU_DIMENSIONS];
+} BoundingBox;
+
+// 한 번의 launch에 대한 결과. DPU d가 받은 k번째 query는 batch 안의 local_queries[d * MAX_QUERIES + k]번째
+// query이다. 그 이웃들은 result[d * stride + offsets[d * MAX_QUERIES + k]]부터 words[d * MAX_QUERIES + k] word
+// 안에 padding(NEIGHBOR_PAD)과 섞여 있고, counts[d * MAX_QUERIES + k]는 그 이웃 수(가중치를 쓰면 가중치 합)이다.
+typedef struct {
+  uint32_t totals[MAX_QUERIES]; // 모든 DPU에 걸친 query별 이웃 수 (가중치를 쓰면 가중치 합)
+  uint32_t *local_n_queries;
+  uint16_t *local_queries;
+  uint32_t *counts;
+  uint32_t *offsets;
+  uint32_t *words;
+  QueryStatus *status;
+  uint32_t *result;
+  uint32_t stride;
+  uint32_t result_capacity;
+} QueryBatch;
+
+uint32_t batch_size = MAX_QUERIES;
+int pipelined = 0;
+int kd_layout = 1;
+int point_format = -1;        // POINT_FORMAT_32, POINT_FORMAT_16, 또는 -1 (가능하면 16)
+int core_phase = 1;           // 먼저 DPU에서 모든 점의 core 여부를 구하고 core 점만 질의한다
+int local_mode = 0;           // region query 대신 DPU마다 지역 clustering 후 host에서 경계만 합친다
+LabelFormat label_format = LABELS_TEXT;
+char *true_labels_file = NULL;
+uint64_t nr_launches = 0;
+uint64_t nr_queries = 0;
+uint64_t nr_routed = 0;       // DPU에 보낸 (query, DPU) 쌍의 수
+uint64_t dpu_cycles_max = 0;  // launch마다 가장 느린 DPU의 kernel cycle 합
+uint64_t dpu_cycles_sum = 0;  // 모든 DPU의 kernel cycle 합
+double dpu_wait_time = 0.0;   // DPU 완료를 기다리며 host가 쉰 시간
+double launch_time = 0.0;     // core 판정과 지역 clustering launch를 기다린 시간 (query launch는 dpu_wait_time)
+double transfer_time = 0.0;   // host와 DPU 사이 복사 시간. pipelined이면 비동기 복사는 요청하는 시간만 센다
+double overlap_time = 0.0;    // DPU가 다음 batch를 처리하는 동안 host가 결과를 병합한 시간
+double core_time = 0.0;       // core 판정 launch와 bitmap 전송 시간
+uint32_t nr_core = 0;
+double local_time = 0.0;      // 지역 clustering launch와 결과 전송 시간
+double merge_time = 0.0;      // host의 경계 병합 시간
+uint64_t nr_pairs = 0;        // DPU가 낸 halo/border 쌍의 수
+
+#ifdef DBSCAN_COUNTERS
+// DPU 프로그램의 tasklet별 단계 cycle (DpuProfile)을 launch마다 받아 DPU별로 더한다.
+// tasklet이 바쁜 시간은 barrier에서 기다린 시간을 뺀 나머지이다.
+static const char *profile_phase_names[NR_PROFILE_PHASES] = {"mram_read", "compute", "mutex_wait", "mram_write",
+                                                             "barrier_wait"};
+DpuProfile *dpu_profiles;     // [nr_dpus], 마지막 launch의 값
+uint64_t *profile_cycles;     // [nr_dpus][NR_PROFILE_PHASES], 모든 tasklet과 launch의 합
+uint64_t *profile_busiest;    // [nr_dpus], launch마다 가장 바빴던 tasklet의 바쁜 cycle 합
+uint32_t profile_tasklets = 0;
+#endif
+
+// DPU d에는 dpu_order[dpu_start[d]..dpu_start[d] + dpu_count[d])의 점들이 놓인다.
+uint32_t *dpu_order;
+uint32_t *dpu_start;
+uint32_t *dpu_count;
+BoundingBox *dpu_boxes;
+
+// DPU d의 halo는 halo_ids[halo_start[d]..halo_start[d] + halo_count[d])이다. (점 번호, 첫 번째 좌표 순)
+uint32_t *halo_ids;
+uint32_t *halo_start;
+uint32_t *halo_count;
+uint8_t *core_flags;          // core_phase일 때 점별 core 여부
+
+// 비동기 launch 중에도 유효해야 하므로 DPU별 query 버퍼는 전역이다.
+int32_t *dpu_queries;         // [nr_dpus][MAX_QUERIES][dimensions]
+uint32_t *dpu_n_queries;      // [nr_dpus]
+uint16_t *dpu_local_queries;  // [nr_dpus][MAX_QUERIES], DPU가 받은 query의 batch 내 번호
+uint32_t submitted_queries;
+uint32_t max_local_queries;
+
+QueryBatch *create_query_batch(void) {
+  QueryBatch *batch = (QueryBatch *)calloc(1, sizeof(QueryBatch));
+  if (!batch)
+    return NULL;
+  batch->local_n_queries = (uint32_t *)malloc(sizeof(uint32_t) * nr_dpus);
+  batch->local_queries = (uint16_t *)malloc(sizeof(uint16_t) * MAX_QUERIES * nr_dpus);
+  batch->counts = (uint32_t *)malloc(sizeof(uint32_t) * MAX_QUERIES * nr_dpus);
+  batch->offsets = (uint32_t *)malloc(sizeof(uint32_t) * MAX_QUERIES * nr_dpus);
+  batch->words = (uint32_t *)malloc(sizeof(uint32_t) * MAX_QUERIES * nr_dpus);
+  batch->status = (QueryStatus *)malloc(sizeof(QueryStatus) * nr_dpus);
+  if (!batch->local_n_queries || !batch->local_queries || !batch->counts || !batch->offsets || !batch->words ||
+      !batch->status) {
+    free(batch->local_n_queries);
+    free(batch->local_queries);
+    free(batch->counts);
+    free(batch->offsets);
+    free(batch->words);
+    free(batch->status);
+    free(batch);
+    return NULL;
+  }
+  return batch;
+}
+
+void free_query_batch(QueryBatch *batch) {
+  if (batch) {
+    free(batch->local_n_queries);
+    free(batch->local_queries);
+    free(batch->counts);
+    free(batch->offsets);
+    free(batch->words);
+    free(batch->status);
+    free(batch->result);
+    free(batch);
   }
+}
 
-  uint32_t capacity = 65536;
-  uint32_t count = 0;
-  points = malloc(capacity * sizeof(Point));
+uint32_t sort_axis;
 
-  while (fscanf(file, "%d,%d", &points[count].x[0], &points[count].x[1]) == 2) {
-    points[count].cluster = UNCLASSIFIED;
-    points[count].index = count;
-    count++;
-    if (count >= capacity) {
-      capacity *= 2;
-      points = realloc(points, capacity * sizeof(Point));
+int compare_on_axis(const void *a, const void *b) {
+  int32_t va = points[*(const uint32_t *)a].x[sort_axis];
+  int32_t vb = points[*(const uint32_t *)b].x[sort_axis];
+  return (va > vb) - (va < vb);
+}
+
+void compute_box(const uint32_t *ids, uint32_t count, BoundingBox *box) {
+  for (int k = 0; k < dimensions; k++) {
+    box->min[k] = INT32_MAX;
+    box->max[k] = INT32_MIN;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    for (int k = 0; k < dimensions; k++) {
+      int32_t v = points[ids[i]].x[k];
+      box->min[k] = (v < box->min[k]) ? v : box->min[k];
+      box->max[k] = (v > box->max[k]) ? v : box->max[k];
     }
   }
+}
 
+// ids[0..count)를 n_parts개의 DPU(first_dpu부터)에 k-d 방식으로 나눈다. 범위가 가장 넓은 축의 중앙값으로
+// 자르며, 양쪽 점 개수는 나눠 받을 DPU 수에 비례한다.
+void kd_partition(uint32_t *ids, uint32_t count, uint32_t first_dpu, uint32_t n_parts, uint32_t offset) {
+  if (n_parts == 1) {
+    dpu_start[first_dpu] = offset;
+    dpu_count[first_dpu] = count;
+    return;
+  }
+  BoundingBox box;
+  compute_box(ids, count, &box);
+  sort_axis = 0;
+  for (int k = 1; k < dimensions; k++) {
+    if ((int64_t)box.max[k] - box.min[k] > (int64_t)box.max[sort_axis] - box.min[sort_axis])
+      sort_axis = k;
+  }
+  qsort(ids, count, sizeof(uint32_t), compare_on_axis);
+
+  uint32_t left_parts = n_parts / 2;
+  uint32_t left_count = (uint32_t)((uint64_t)count * left_parts / n_parts);
+  kd_partition(ids, left_count, first_dpu, left_parts, offset);
+  kd_partition(ids + left_count, count - left_count, first_dpu + left_parts, n_parts - left_parts,
+               offset + left_count);
+}
+
+// 점들을 DPU에 배치할 순서를 정하고 DPU별 bounding box를 계산한다.
+int partition_points(uint32_t n_points) {
+  dpu_order = (uint32_t *)malloc(sizeof(uint32_t) * n_points);
+  dpu_start = (uint32_t *)malloc(sizeof(uint32_t) * nr_dpus);
+  dpu_count = (uint32_t *)malloc(sizeof(uint32_t) * nr_dpus);
+  dpu_boxes = (BoundingBox *)malloc(sizeof(BoundingBox) * nr_dpus);
+  if (!dpu_order || !dpu_start || !dpu_count || !dpu_boxes)
+    return 0;
+
+  for (uint32_t i = 0; i < n_points; i++) {
+    dpu_order[i] = i;
+  }
+  if (kd_layout) {
+    kd_partition(dpu_order, n_points, 0, nr_dpus, 0);
+  } else {
+    // 입력 순서대로 연속 구간을 나눈다.
+    for (uint32_t d = 0; d < nr_dpus; d++) {
+      dpu_start[d] = (uint32_t)((uint64_t)n_points * d / nr_dpus);
+      dpu_count[d] = (uint32_t)((uint64_t)n_points * (d + 1) / nr_dpus) - dpu_start[d];
+    }
+  }
+  // tile 안의 순서는 자유로우므로 첫 번째 좌표 순으로 두어 DPU의 core 판정이 좁은 창만 훑게 한다.
+  sort_axis = 0;
+  for (uint32_t d = 0; d < nr_dpus; d++) {
+    qsort(&dpu_order[dpu_start[d]], dpu_count[d], sizeof(uint32_t), compare_on_axis);
+    compute_box(&dpu_order[dpu_start[d]], dpu_count[d], &dpu_boxes[d]);
+  }
+  return 1;
+}
+
+// query 점과 box 사이의 거리가 eps 이하인지 검사한다. 빈 DPU의 box는 어떤 query와도 겹치지 않는다.
+int box_intersects(const BoundingBox *box, const int32_t *query, int64_t eps_squared) {
+  int64_t sum = 0;
+  for (int k = 0; k < dimensions; k++) {
+    int64_t diff = 0;
+    if (query[k] < box->min[k])
+      diff = (int64_t)box->min[k] - query[k];
+    else if (query[k] > box->max[k])
+      diff = (int64_t)query[k] - box->max[k];
+    sum += diff * diff;
+    if (sum > eps_squared)
+      return 0;
+  }
+  return 1;
+}
+
+// 두 box 사이의 거리가 eps 이하인지 검사한다.
+int boxes_within(const BoundingBox *a, const BoundingBox *b, int64_t eps_squared) {
+  int64_t sum = 0;
+  for (int k = 0; k < dimensions; k++) {
+    int64_t diff = 0;
+    if (a->max[k] < b->min[k])
+      diff = (int64_t)b->min[k] - a->max[k];
+    else if (b->max[k] < a->min[k])
+      diff = (int64_t)a->min[k] - b->max[k];
+    sum += diff * diff;
+    if (sum > eps_squared)
+      return 0;
+  }
+  return 1;
+}
+
+// DPU마다 다른 tile의 점 중 자기 box에서 eps 이내인 점을 halo로 모은다. 가까운 tile 쌍만 점 단위로 검사한다.
+// tile은 첫 번째 좌표 순이므로 tile 순서대로 모은 halo를 마지막에 한 번 더 정렬한다.
+int build_halos(void) {
+  uint32_t capacity = 1024, total = 0;
+  halo_ids = (uint32_t *)malloc(sizeof(uint32_t) * capacity);
+  halo_start = (uint32_t *)malloc(sizeof(uint32_t) * nr_dpus);
+  halo_count = (uint32_t *)calloc(nr_dpus, sizeof(uint32_t));
+  if (!halo_ids || !halo_start || !halo_count)
+    return 0;
+
+  sort_axis = 0;
+  for (uint32_t d = 0; d < nr_dpus; d++) {
+    halo_start[d] = total;
+    for (uint32_t e = 0; e < nr_dpus && dpu_count[d] > 0; e++) {
+      if (e == d || dpu_count[e] == 0 || !boxes_within(&dpu_boxes[d], &dpu_boxes[e], eps_squared))
+        continue;
+      for (uint32_t i = 0; i < dpu_count[e]; i++) {
+        uint32_t id = dpu_order[dpu_start[e] + i];
+        if (!box_intersects(&dpu_boxes[d], points[id].x, eps_squared))
+          continue;
+        if (total == capacity) {
+          capacity *= 2;
+          uint32_t *grown = (uint32_t *)realloc(halo_ids, sizeof(uint32_t) * capacity);
+          if (!grown)
+            return 0;
+          halo_ids = grown;
+        }
+        halo_ids[total++] = id;
+      }
+    }
+    halo_count[d] = total - halo_start[d];
+    qsort(&halo_ids[halo_start[d]], halo_count[d], sizeof(uint32_t), compare_on_axis);
+  }
+  return 1;
+}
+
+// 각 DPU에 자기 tile의 좌표만 보낸다. 점 번호는 dpu_order 안의 위치이므로 DPU마다 시작 위치(index_base)만
+// 알려 주면 된다. core_phase이면 tile 뒤 halo_begin부터 halo 좌표를 함께 보낸다.
+// 16비트 형식은 모든 DPU의 점(halo 포함) 범위가 uint16 안에 들어갈 때만 쓴다.
+// weighted이면 같은 위치로 가중치도 보낸다. 이웃 수는 min_pts에 닿았는지만 보므로 가중치는 min_pts에서 자른다.
+int load_points_to_dpus(struct dpu_set_t set, int32_t eps) {
+  struct dpu_set_t dpu;
+  uint32_t each_dpu;
+
+  BoundingBox *extents = (BoundingBox *)malloc(sizeof(BoundingBox) * nr_dpus);
+  if (!extents)
+    return 0;
+  int fits_16 = 1;
+  uint32_t max_points_per_dpu = 0;
+  uint32_t max_slots_per_dpu = 0; // tile, 정렬용 빈칸, halo를 합친 MRAM 점 개수
+  for (uint32_t d = 0; d < nr_dpus; d++) {
+    uint32_t n_halo = halo_count ? halo_count[d] : 0;
+    extents[d] = dpu_boxes[d];
+    if (n_halo > 0) {
+      BoundingBox halo_box;
+      compute_box(&halo_ids[halo_start[d]], n_halo, &halo_box);
+      for (int k = 0; k < dimensions; k++) {
+        extents[d].min[k] = (halo_box.min[k] < extents[d].min[k]) ? halo_box.min[k] : extents[d].min[k];
+        extents[d].max[k] = (halo_box.max[k] > extents[d].max[k]) ? halo_box.max[k] : extents[d].max[k];
+      }
+    }
+    for (int k = 0; k < dimensions && dpu_count[d] > 0; k++) {
+      if ((int64_t)extents[d].max[k] - extents[d].min[k] > UINT16_MAX)
+        fits_16 = 0;
+    }
+    uint32_t slots = n_halo > 0 ? HALO_BEGIN(dpu_count[d]) + n_halo : dpu_count[d];
+    max_points_per_dpu = (dpu_count[d] > max_points_per_dpu) ? dpu_count[d] : max_points_per_dpu;
+    max_slots_per_dpu = (slots > max_slots_per_dpu) ? slots : max_slots_per_dpu;
+  }
+  if (point_format == POINT_FORMAT_16 && !fits_16) {
+    fprintf(stderr, "Coordinates span more than 16 bits within a DPU; use -f 32\n");
+    return 0;
+  }
+  if (point_format < 0)
+    point_format = fits_16 ? POINT_FORMAT_16 : POINT_FORMAT_32;
+
+  uint32_t point_size = dimensions * ((point_format == POINT_FORMAT_16) ? sizeof(uint16_t) : sizeof(int32_t));
+  if ((uint64_t)max_slots_per_dpu * point_size > MRAM_POINT_BYTES ||
+      max_points_per_dpu + MAX_TASKLETS > MAX_NEIGHBORS) {
+    fprintf(stderr, "Too many points per DPU (%u with halo)\n", max_slots_per_dpu);
+    free(extents);
+    return 0;
+  }
+
+  DpuConfig *configs = (DpuConfig *)calloc(nr_dpus, sizeof(DpuConfig));
+  uint32_t stride = ((max_slots_per_dpu * point_size + 7) & ~7u);
+  uint8_t *staging = (uint8_t *)calloc(nr_dpus, stride);
+  uint32_t weight_stride = (max_slots_per_dpu + 3) & ~3u;
+  uint16_t *weights = weighted ? (uint16_t *)calloc((size_t)nr_dpus * weight_stride + 4, sizeof(uint16_t)) : NULL;
+  if (!configs || !staging || (weighted && !weights)) {
+    free(extents);
+    free(configs);
+    free(staging);
+    free(weights);
+    return 0;
+  }
+  uint32_t max_weight = min_pts < 1 ? 1 : (min_pts > UINT16_MAX ? UINT16_MAX : min_pts);
+
+  for (uint32_t d = 0; d < nr_dpus; d++) {
+    configs[d].n_points = dpu_count[d];
+    configs[d].index_base = dpu_start[d];
+    configs[d].point_format = point_format;
+    configs[d].n_halo = halo_count ? halo_count[d] : 0;
+    configs[d].halo_begin = HALO_BEGIN(dpu_count[d]);
+    configs[d].min_pts = min_pts;
+    configs[d].eps = eps;
+    configs[d].eps_squared = (int32_t)eps_squared;
+    configs[d].weighted = weighted;
+    for (int k = 0; k < dimensions; k++) {
+      configs[d].origin[k] = dpu_count[d] > 0 ? extents[d].min[k] : 0;
+    }
+    for (uint32_t i = 0; i < configs[d].halo_begin + configs[d].n_halo; i++) {
+      if (i >= dpu_count[d] && i < configs[d].halo_begin)
+        continue;
+      uint32_t id = (i < dpu_count[d]) ? dpu_order[dpu_start[d] + i]
+                                       : halo_ids[halo_start[d] + i - configs[d].halo_begin];
+      const Point *p = &points[id];
+      if (weighted) {
+        uint32_t w = unique.weights[id];
+        weights[(size_t)d * weight_stride + i] = (uint16_t)(w < max_weight ? w : max_weight);
+      }
+      if (point_format == POINT_FORMAT_16) {
+        uint16_t *out = (uint16_t *)(staging + (size_t)d * stride) + (size_t)i * dimensions;
+        for (int k = 0; k < dimensions; k++)
+          out[k] = (uint16_t)(p->x[k] - configs[d].origin[k]);
+      } else {
+        int32_t *out = (int32_t *)(staging + (size_t)d * stride) + (size_t)i * dimensions;
+        memcpy(out, p->x, sizeof(int32_t) * dimensions);
+      }
+    }
+  }
+
+  double xfer_start = wall_time();
+  DPU_FOREACH(set, dpu, each_dpu) { DPU_ASSERT(dpu_prepare_xfer(dpu, &configs[each_dpu])); }
+  DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "config", 0, sizeof(DpuConfig), DPU_XFER_DEFAULT));
+  COUNT(bytes_to_dpu, sizeof(DpuConfig) * nr_dpus);
+  DPU_FOREACH(set, dpu, each_dpu) { DPU_ASSERT(dpu_prepare_xfer(dpu, staging + (size_t)each_dpu * stride)); }
+  DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "mram_points", 0, stride, DPU_XFER_DEFAULT));
+  COUNT(bytes_to_dpu, (uint64_t)stride * nr_dpus);
+  if (weighted) {
+    DPU_FOREACH(set, dpu, each_dpu) { DPU_ASSERT(dpu_prepare_xfer(dpu, &weights[(size_t)each_dpu * weight_stride])); }
+    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "mram_weights", 0, weight_stride * sizeof(uint16_t),
+                             DPU_XFER_DEFAULT));
+    COUNT(bytes_to_dpu, weight_stride * sizeof(uint16_t) * nr_dpus);
+  }
+  transfer_time += wall_time() - xfer_start;
+
+  free(extents);
+  free(configs);
+  free(staging);
+  free(weights);
+  return 1;
+}
+
+#ifdef DBSCAN_COUNTERS
+// launch가 끝난 뒤 DPU별 tasklet 단계 cycle을 가져와 더한다.
+void collect_profile(struct dpu_set_t set) {
+  struct dpu_set_t dpu;
+  uint32_t each_dpu;
+  double step = wall_time();
+  DPU_FOREACH(set, dpu, each_dpu) { DPU_ASSERT(dpu_prepare_xfer(dpu, &dpu_profiles[each_dpu])); }
+  DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "profile", 0, sizeof(DpuProfile), DPU_XFER_DEFAULT));
+  COUNT(bytes_from_dpu, sizeof(DpuProfile) * nr_dpus);
+  transfer_time += wall_time() - step;
+
+  for (uint32_t d = 0; d < nr_dpus; d++) {
+    const DpuProfile *profile = &dpu_profiles[d];
+    uint64_t busiest = 0;
+    profile_tasklets = profile->n_tasklets;
+    for (uint32_t t = 0; t < profile->n_tasklets; t++) {
+      uint64_t busy = 0;
+      for (uint32_t p = 0; p < NR_PROFILE_PHASES; p++) {
+        profile_cycles[d * NR_PROFILE_PHASES + p] += profile->cycles[t][p];
+        if (p != PROFILE_BARRIER_WAIT)
+          busy += profile->cycles[t][p];
+      }
+      busiest = (busy > busiest) ? busy : busiest;
+    }
+    profile_busiest[d] += busiest;
+  }
+}
+
+static uint64_t profile_busy(uint32_t d) {
+  uint64_t busy = 0;
+  for (uint32_t p = 0; p < NR_PROFILE_PHASES; p++) {
+    if (p != PROFILE_BARRIER_WAIT)
+      busy += profile_cycles[d * NR_PROFILE_PHASES + p];
+  }
+  return busy;
+}
+
+// 단계별 비율과 불균형 요약. DPU 사이 불균형은 tasklet들의 바쁜 cycle 합으로, DPU 안의 불균형은 가장 바쁜
+// tasklet과 평균 tasklet의 비로 본다.
+void print_profile(FILE *out) {
+  uint64_t totals[NR_PROFILE_PHASES] = {0};
+  uint64_t all = 0, busy_sum = 0, busy_max = 0;
+  uint32_t busiest_dpu = 0, skewed_dpu = 0, contended_dpu = 0;
+  double skew_sum = 0.0, skew_max = 0.0, wait_max = 0.0;
+  for (uint32_t d = 0; d < nr_dpus; d++) {
+    uint64_t dpu_all = 0;
+    for (uint32_t p = 0; p < NR_PROFILE_PHASES; p++) {
+      totals[p] += profile_cycles[d * NR_PROFILE_PHASES + p];
+      dpu_all += profile_cycles[d * NR_PROFILE_PHASES + p];
+    }
+    all += dpu_all;
+    uint64_t busy = profile_busy(d);
+    busy_sum += busy;
+    if (busy > busy_max) {
+      busy_max = busy;
+      busiest_dpu = d;
+    }
+    double skew = busy ? (double)profile_busiest[d] * profile_tasklets / busy : 1.0;
+    skew_sum += skew;
+    if (skew > skew_max) {
+      skew_max = skew;
+      skewed_dpu = d;
+    }
+    double wait = dpu_all ? (double)profile_cycles[d * NR_PROFILE_PHASES + PROFILE_MUTEX_WAIT] / dpu_all : 0.0;
+    if (wait > wait_max) {
+      wait_max = wait;
+      contended_dpu = d;
+    }
+  }
+
+  fprintf(out, "DPU profile:");
+  for (uint32_t p = 0; p < NR_PROFILE_PHASES; p++)
+    fprintf(out, " %s=%.1f%%", profile_phase_names[p], all ? 100.0 * totals[p] / all : 0.0);
+  fprintf(out, " of %llu tasklet cycles\n", (unsigned long long)all);
+  double busy_mean = (double)busy_sum / nr_dpus;
+  fprintf(out, "DPU imbalance: busiest DPU %u at %.2fx the mean busy cycles; busiest tasklet %.2fx the mean on average, "
+          "%.2fx on DPU %u; mutex wait up to %.1f%% on DPU %u\n",
+          busiest_dpu, busy_mean > 0 ? busy_max / busy_mean : 1.0, skew_sum / nr_dpus, skew_max, skewed_dpu,
+          100.0 * wait_max, contended_dpu);
+}
+
+// DPU별 단계 cycle과 가장 바쁜 tasklet의 cycle을 CSV로 남긴다.
+int write_profile(const char *filename) {
+  FILE *file = fopen(filename, "w");
+  if (!file) {
+    fprintf(stderr, "Error opening %s\n", filename);
+    return 0;
+  }
+  fprintf(file, "dpu");
+  for (uint32_t p = 0; p < NR_PROFILE_PHASES; p++)
+    fprintf(file, ",%s", profile_phase_names[p]);
+  fprintf(file, ",busiest_tasklet,mean_tasklet\n");
+  for (uint32_t d = 0; d < nr_dpus; d++) {
+    fprintf(file, "%u", d);
+    for (uint32_t p = 0; p < NR_PROFILE_PHASES; p++)
+      fprintf(file, ",%llu", (unsigned long long)profile_cycles[d * NR_PROFILE_PHASES + p]);
+    fprintf(file, ",%llu,%.0f\n", (unsigned long long)profile_busiest[d],
+            profile_tasklets ? (double)profile_busy(d) / profile_tasklets : 0.0);
+  }
   fclose(file);
-  return count;
+  return 1;
 }
+#endif
 
-uint32_t get_neighbors_from_dpus(struct dpu_set_t set, const Point *query_point, uint32_t n_points,
-                                 IntVector *neighbors) {
+// 모든 DPU가 자기 tile의 core 여부를 한 번의 launch로 구한다. bitmap을 한 번에 가져와 core_flags에 풀고
+// 이후 launch를 위해 kernel을 query 모드로 되돌린다.
+int detect_core_points(struct dpu_set_t set, uint32_t n_points) {
   struct dpu_set_t dpu;
   uint32_t each_dpu;
-  DPU_ASSERT(dpu_broadcast_to(set, "query_point", 0, query_point, sizeof(Point), DPU_XFER_DEFAULT));
+  double start = wall_time();
 
+  uint32_t max_points_per_dpu = 0;
+  for (uint32_t d = 0; d < nr_dpus; d++)
+    max_points_per_dpu = (dpu_count[d] > max_points_per_dpu) ? dpu_count[d] : max_points_per_dpu;
+  uint32_t words = (max_points_per_dpu + CORE_BLOCK - 1) / CORE_BLOCK * (CORE_BLOCK / 32);
+
+  core_flags = (uint8_t *)calloc(n_points, sizeof(uint8_t));
+  uint32_t *bits = (uint32_t *)malloc(sizeof(uint32_t) * ((size_t)words * nr_dpus + 1));
+  QueryStatus *status = (QueryStatus *)malloc(sizeof(QueryStatus) * nr_dpus);
+  if (!core_flags || !bits || !status) {
+    free(bits);
+    free(status);
+    return 0;
+  }
+
+  uint32_t mode = KERNEL_CORE;
+  double step = wall_time();
+  DPU_ASSERT(dpu_broadcast_to(set, "kernel_mode", 0, &mode, sizeof(mode), DPU_XFER_DEFAULT));
+  COUNT(bytes_to_dpu, sizeof(mode) * nr_dpus);
+  transfer_time += wall_time() - step;
+  step = wall_time();
   DPU_ASSERT(dpu_launch(set, DPU_SYNCHRONOUS));
+  launch_time += wall_time() - step;
+  nr_launches++;
+
+  step = wall_time();
+  DPU_FOREACH(set, dpu, each_dpu) { DPU_ASSERT(dpu_prepare_xfer(dpu, &status[each_dpu])); }
+  DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "status", 0, sizeof(QueryStatus), DPU_XFER_DEFAULT));
+  COUNT(bytes_from_dpu, sizeof(QueryStatus) * nr_dpus);
+  if (words > 0) {
+    DPU_FOREACH(set, dpu, each_dpu) { DPU_ASSERT(dpu_prepare_xfer(dpu, &bits[(size_t)each_dpu * words])); }
+    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "mram_core_bits", 0, sizeof(uint32_t) * words,
+                             DPU_XFER_DEFAULT));
+    COUNT(bytes_from_dpu, sizeof(uint32_t) * words * nr_dpus);
+  }
+  transfer_time += wall_time() - step;
+#ifdef DBSCAN_COUNTERS
+  collect_profile(set);
+#endif
+
+  uint64_t launch_cycles = 0;
+  for (uint32_t d = 0; d < nr_dpus; d++) {
+    launch_cycles = (status[d].cycles > launch_cycles) ? status[d].cycles : launch_cycles;
+    dpu_cycles_sum += status[d].cycles;
+    for (uint32_t i = 0; i < dpu_count[d]; i++) {
+      if (bits[(size_t)d * words + i / 32] & (1u << (i % 32))) {
+        core_flags[dpu_order[dpu_start[d] + i]] = 1;
+        nr_core++;
+      }
+    }
+  }
+  dpu_cycles_max += launch_cycles;
+
+  mode = KERNEL_QUERY;
+  step = wall_time();
+  DPU_ASSERT(dpu_broadcast_to(set, "kernel_mode", 0, &mode, sizeof(mode), DPU_XFER_DEFAULT));
+  COUNT(bytes_to_dpu, sizeof(mode) * nr_dpus);
+  transfer_time += wall_time() - step;
+  free(bits);
+  free(status);
+  core_time = wall_time() - start;
+  return 1;
+}
+
+// query_ids[0..n_queries)를 eps-ball이 겹치는 DPU에만 보내고 launch한다. DPU마다 받는 query 목록이 다르므로
+// 서로 다른 query들이 서로 다른 DPU 집합에서 동시에 처리된다.
+void submit_queries(struct dpu_set_t set, const uint32_t *query_ids, uint32_t n_queries, dpu_launch_policy_t policy) {
+  struct dpu_set_t dpu;
+  uint32_t each_dpu;
+
+  memset(dpu_n_queries, 0, sizeof(uint32_t) * nr_dpus);
+  max_local_queries = 0;
+  for (uint32_t q = 0; q < n_queries; ++q) {
+    const int32_t *query = points[query_ids[q]].x;
+    for (uint32_t d = 0; d < nr_dpus; ++d) {
+      if (!box_intersects(&dpu_boxes[d], query, eps_squared))
+        continue;
+      uint32_t k = dpu_n_queries[d]++;
+      memcpy(&dpu_queries[((size_t)d * MAX_QUERIES + k) * dimensions], query, sizeof(int32_t) * dimensions);
+      dpu_local_queries[d * MAX_QUERIES + k] = (uint16_t)q;
+      max_local_queries = (dpu_n_queries[d] > max_local_queries) ? dpu_n_queries[d] : max_local_queries;
+      nr_routed++;
+    }
+  }
+  submitted_queries = n_queries;
 
-  uint32_t *counts = (uint32_t *)malloc(sizeof(uint32_t) * nr_dpus);
-  uint32_t total_count = 0, max_count = 0;
+  dpu_xfer_flags_t flags = (policy == DPU_ASYNCHRONOUS) ? DPU_XFER_ASYNC : DPU_XFER_DEFAULT;
+  double xfer_start = wall_time();
+  DPU_FOREACH(set, dpu, each_dpu) { DPU_ASSERT(dpu_prepare_xfer(dpu, &dpu_n_queries[each_dpu])); }
+  DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "n_queries", 0, sizeof(uint32_t), flags));
+  COUNT(bytes_to_dpu, sizeof(uint32_t) * nr_dpus);
+  DPU_FOREACH(set, dpu, each_dpu) {
+    DPU_ASSERT(dpu_prepare_xfer(dpu, &dpu_queries[(size_t)each_dpu * MAX_QUERIES * dimensions]));
+  }
+  DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "query_points", 0, max_local_queries * sizeof(int32_t) * dimensions,
+                           flags));
+  COUNT(bytes_to_dpu, max_local_queries * sizeof(int32_t) * dimensions * nr_dpus);
+  transfer_time += wall_time() - xfer_start;
 
-  // WRAM을 통해 점의 이웃 개수를 먼저 받아온다.
-  DPU_FOREACH(set, dpu, each_dpu) { DPU_ASSERT(dpu_prepare_xfer(dpu, &counts[each_dpu])); }
-  DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "neighbor_count", 0, 4, DPU_XFER_DEFAULT));
+  double launch_start = wall_time();
+  DPU_ASSERT(dpu_launch(set, policy));
+  if (policy == DPU_SYNCHRONOUS)
+    dpu_wait_time += wall_time() - launch_start;
+  nr_launches++;
+}
 
-  for (uint32_t i = 0; i < nr_dpus; ++i) {
-    total_count += counts[i];
-    max_count = (counts[i] > max_count) ? counts[i] : max_count;
+// 마지막으로 보낸 query들의 결과를 batch로 가져오고 처리된 query 수를 돌려준다.
+// 이웃 목록은 min_pts 이상인 query가 있을 때만 가져온다.
+uint32_t collect_neighbors(struct dpu_set_t set, QueryBatch *batch) {
+  struct dpu_set_t dpu;
+  uint32_t each_dpu;
+  uint32_t n_queries = submitted_queries;
+
+  double wait_start = wall_time();
+  DPU_ASSERT(dpu_sync(set));
+  dpu_wait_time += wall_time() - wait_start;
+
+  // 다음 submit이 DPU별 query 목록을 덮어쓰기 전에 batch로 옮겨 둔다.
+  memcpy(batch->local_n_queries, dpu_n_queries, sizeof(uint32_t) * nr_dpus);
+  for (uint32_t d = 0; d < nr_dpus; ++d) {
+    memcpy(&batch->local_queries[d * MAX_QUERIES], &dpu_local_queries[d * MAX_QUERIES],
+           sizeof(uint16_t) * dpu_n_queries[d]);
   }
 
-  if (total_count < min_pts) {
-    free(counts);
-    return 0;
+  // WRAM을 통해 query별 이웃 개수와 segment 위치를 먼저 받아온다.
+  double xfer_start = wall_time();
+  DPU_FOREACH(set, dpu, each_dpu) { DPU_ASSERT(dpu_prepare_xfer(dpu, &batch->status[each_dpu])); }
+  DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "status", 0, sizeof(QueryStatus), DPU_XFER_DEFAULT));
+  COUNT(bytes_from_dpu, sizeof(QueryStatus) * nr_dpus);
+  DPU_FOREACH(set, dpu, each_dpu) { DPU_ASSERT(dpu_prepare_xfer(dpu, &batch->counts[each_dpu * MAX_QUERIES])); }
+  DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "query_counts", 0, max_local_queries * sizeof(uint32_t),
+                           DPU_XFER_DEFAULT));
+  COUNT(bytes_from_dpu, max_local_queries * sizeof(uint32_t) * nr_dpus);
+  DPU_FOREACH(set, dpu, each_dpu) { DPU_ASSERT(dpu_prepare_xfer(dpu, &batch->offsets[each_dpu * MAX_QUERIES])); }
+  DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "query_offsets", 0, max_local_queries * sizeof(uint32_t),
+                           DPU_XFER_DEFAULT));
+  COUNT(bytes_from_dpu, max_local_queries * sizeof(uint32_t) * nr_dpus);
+  DPU_FOREACH(set, dpu, each_dpu) { DPU_ASSERT(dpu_prepare_xfer(dpu, &batch->words[each_dpu * MAX_QUERIES])); }
+  DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "query_words", 0, max_local_queries * sizeof(uint32_t),
+                           DPU_XFER_DEFAULT));
+  COUNT(bytes_from_dpu, max_local_queries * sizeof(uint32_t) * nr_dpus);
+  transfer_time += wall_time() - xfer_start;
+#ifdef DBSCAN_COUNTERS
+  collect_profile(set);
+#endif
+
+  uint64_t launch_cycles = 0;
+  for (uint32_t d = 0; d < nr_dpus; ++d) {
+    launch_cycles = (batch->status[d].cycles > launch_cycles) ? batch->status[d].cycles : launch_cycles;
+    dpu_cycles_sum += batch->status[d].cycles;
+  }
+  dpu_cycles_max += launch_cycles;
+
+  // DPU가 공간 부족으로 멈췄다면 그 DPU가 처리하지 못한 첫 query부터는 다시 보내야 한다.
+  uint32_t n_answered = n_queries;
+  for (uint32_t d = 0; d < nr_dpus; ++d) {
+    if (batch->status[d].n_answered < batch->local_n_queries[d]) {
+      uint32_t q = batch->local_queries[d * MAX_QUERIES + batch->status[d].n_answered];
+      n_answered = (q < n_answered) ? q : n_answered;
+    }
+  }
+  if (n_answered == 0) {
+    fprintf(stderr, "DPU neighbor buffer too small for a single query\n");
+    exit(1);
   }
-  max_count = (max_count + 1) & ~(uint32_t)1;
+  nr_queries += n_answered;
+  COUNT(region_queries, n_answered);
 
-  uint32_t *result = (uint32_t *)malloc(max_count * nr_dpus * sizeof(uint32_t));
-  DPU_FOREACH(set, dpu, each_dpu) { DPU_ASSERT(dpu_prepare_xfer(dpu, &result[each_dpu * max_count])); }
+  memset(batch->totals, 0, sizeof(uint32_t) * n_answered);
+  for (uint32_t d = 0; d < nr_dpus; ++d) {
+    for (uint32_t k = 0; k < batch->local_n_queries[d]; ++k) {
+      uint32_t q = batch->local_queries[d * MAX_QUERIES + k];
+      if (q < n_answered)
+        batch->totals[q] += batch->counts[d * MAX_QUERIES + k];
+    }
+  }
+
+  // DPU마다 가장 마지막 core query의 segment 끝까지만 가져오면 된다.
+  uint32_t max_words = 0;
+  for (uint32_t d = 0; d < nr_dpus; ++d) {
+    for (uint32_t k = 0; k < batch->local_n_queries[d]; ++k) {
+      uint32_t q = batch->local_queries[d * MAX_QUERIES + k];
+      if (q >= n_answered || batch->totals[q] < min_pts)
+        continue;
+      uint32_t end = batch->offsets[d * MAX_QUERIES + k] + batch->words[d * MAX_QUERIES + k];
+      max_words = (end > max_words) ? end : max_words;
+    }
+  }
+  if (max_words == 0)
+    return n_answered;
+
+  if (max_words * nr_dpus > batch->result_capacity) {
+    free(batch->result);
+    batch->result_capacity = max_words * nr_dpus;
+    batch->result = (uint32_t *)malloc(batch->result_capacity * sizeof(uint32_t));
+    if (!batch->result) {
+      fprintf(stderr, "Failed to allocate memory for neighbors\n");
+      exit(1);
+    }
+  }
+  batch->stride = max_words;
+  xfer_start = wall_time();
+  DPU_FOREACH(set, dpu, each_dpu) { DPU_ASSERT(dpu_prepare_xfer(dpu, &batch->result[each_dpu * max_words])); }
   DPU_ASSERT(
-      dpu_push_xfer(set, DPU_XFER_FROM_DPU, "mram_neighbors", 0, sizeof(uint32_t) * max_count, DPU_XFER_DEFAULT));
+      dpu_push_xfer(set, DPU_XFER_FROM_DPU, "mram_neighbors", 0, sizeof(uint32_t) * max_words, DPU_XFER_DEFAULT));
+  COUNT(bytes_from_dpu, sizeof(uint32_t) * max_words * nr_dpus);
+  transfer_time += wall_time() - xfer_start;
 
-  for (uint32_t i = 0; i < nr_dpus; ++i) {
-    for (uint32_t j = 0; j < counts[i]; ++j) {
-      uint32_t idx = result[max_count * i + j];
-      if (idx >= n_points)
+  return n_answered;
+}
+
+// query_ids[0..n_queries)를 한 번의 launch로 처리하고 처리된 query 수를 돌려준다.
+uint32_t get_neighbors_from_dpus(struct dpu_set_t set, const uint32_t *query_ids, uint32_t n_queries,
+                                 QueryBatch *batch) {
+  submit_queries(set, query_ids, n_queries, DPU_SYNCHRONOUS);
+  return collect_neighbors(set, batch);
+}
+
+// batch의 앞쪽 n_answered개 query 중 core인 것들의 이웃 중 아직 방문하지 않은 점을 neighbors에 추가한다.
+void merge_neighbors(const QueryBatch *batch, uint32_t n_answered, uint32_t n_points, IntVector *neighbors) {
+  for (uint32_t d = 0; d < nr_dpus; ++d) {
+    for (uint32_t k = 0; k < batch->local_n_queries[d]; ++k) {
+      uint32_t q = batch->local_queries[d * MAX_QUERIES + k];
+      if (q >= n_answered || batch->totals[q] < min_pts)
         continue;
-      if (!visited[idx]) {
-        if (!push_back(neighbors, idx)) {
-          printf("Failed to push neighbor\n");
-          exit(1);
+      const uint32_t *segment = &batch->result[d * batch->stride + batch->offsets[d * MAX_QUERIES + k]];
+      for (uint32_t j = 0; j < batch->words[d * MAX_QUERIES + k]; ++j) {
+        // DPU는 dpu_order 안의 위치를 돌려준다.
+        uint32_t idx = segment[j];
+        if (idx >= n_points)
+          continue;
+        idx = dpu_order[idx];
+        COUNT(neighbors_returned, 1);
+        if (!visited[idx]) {
+          COUNT(neighbors_new, 1);
+          if (!push_back(neighbors, idx)) {
+            printf("Failed to push neighbor\n");
+            exit(1);
+          }
+          visited[idx] = 1;
         }
-        visited[idx] = 1;
       }
     }
   }
-  free(result);
-  free(counts);
-  return total_count;
 }
 
-void expand_cluster(struct dpu_set_t set, int n_points, int point_id, int cluster_id, IntVector *neighbors,
-                    IntVector *tmp_neighbors) {
-  points[point_id].cluster = cluster_id;
-
-  for (uint32_t i = 0; i < neighbors->size; ++i) {
-    uint32_t current_point = neighbors->data[i];
+// frontier의 다음 미분류 점들을 query_ids 뒤에 채운다. NOISE였던 점은 query 없이 cluster에 편입된다.
+// core 여부를 미리 알면 core가 아닌 점은 이웃을 넓히지 않으므로 질의하지 않는다.
+uint32_t fill_frontier(IntVector *neighbors, uint32_t *next, int cluster_id, uint32_t *query_ids,
+                       uint32_t n_queries) {
+  while (*next < neighbors->size && n_queries < batch_size) {
+    uint32_t current_point = neighbors->data[(*next)++];
     if (points[current_point].cluster == NOISE) {
       points[current_point].cluster = cluster_id;
     } else if (points[current_point].cluster == UNCLASSIFIED) {
       points[current_point].cluster = cluster_id;
-      tmp_neighbors->size = 0;
-      uint32_t neighbor_count = get_neighbors_from_dpus(set, &points[current_point], n_points, tmp_neighbors);
-      if (neighbor_count < min_pts)
-        continue;
-      for (uint32_t j = 0; j < tmp_neighbors->size; ++j) {
-        push_back(neighbors, tmp_neighbors->data[j]);
+      if (!core_flags || core_flags[current_point])
+        query_ids[n_queries++] = current_point;
+    }
+  }
+  return n_queries;
+}
+
+void expand_cluster(struct dpu_set_t set, int n_points, int point_id, int cluster_id, IntVector *neighbors,
+                    QueryBatch *batch) {
+  uint32_t query_ids[MAX_QUERIES];
+  points[point_id].cluster = cluster_id;
+
+  uint32_t next = 0;
+  while (next < neighbors->size) {
+    // frontier에서 최대 batch_size개의 미분류 점을 모아 한 번에 질의한다.
+    uint32_t n_queries = fill_frontier(neighbors, &next, cluster_id, query_ids, 0);
+
+    for (uint32_t done = 0; done < n_queries;) {
+      uint32_t n_answered = get_neighbors_from_dpus(set, &query_ids[done], n_queries - done, batch);
+      merge_neighbors(batch, n_answered, n_points, neighbors);
+      done += n_answered;
+    }
+  }
+}
+
+// expand_cluster와 같은 결과를 내지만, batch k의 결과를 병합하기 전에 batch k+1을 비동기로 launch하여
+// DPU가 k+1을 처리하는 동안 host가 k를 neighbors/visited에 병합한다.
+void expand_cluster_pipelined(struct dpu_set_t set, int n_points, int point_id, int cluster_id, IntVector *neighbors,
+                              QueryBatch *batch) {
+  uint32_t query_ids[2][MAX_QUERIES];
+  uint32_t n_queries[2];
+  uint32_t cur = 0;
+  uint32_t next = 0;
+  points[point_id].cluster = cluster_id;
+
+  n_queries[cur] = fill_frontier(neighbors, &next, cluster_id, query_ids[cur], 0);
+  if (n_queries[cur] == 0)
+    return;
+  submit_queries(set, query_ids[cur], n_queries[cur], DPU_ASYNCHRONOUS);
+
+  while (1) {
+    uint32_t n_answered = collect_neighbors(set, batch);
+
+    // 처리되지 못한 query를 앞에 두고 frontier로 다음 batch를 채워 병합 전에 launch한다.
+    uint32_t nxt = 1 - cur;
+    n_queries[nxt] = n_queries[cur] - n_answered;
+    memcpy(query_ids[nxt], &query_ids[cur][n_answered], n_queries[nxt] * sizeof(uint32_t));
+    n_queries[nxt] = fill_frontier(neighbors, &next, cluster_id, query_ids[nxt], n_queries[nxt]);
+    int in_flight = n_queries[nxt] > 0;
+    if (in_flight)
+      submit_queries(set, query_ids[nxt], n_queries[nxt], DPU_ASYNCHRONOUS);
+
+    double merge_start = wall_time();
+    merge_neighbors(batch, n_answered, n_points, neighbors);
+    if (in_flight) {
+      overlap_time += wall_time() - merge_start;
+    } else {
+      // frontier가 비어 있었다면 방금 병합한 점들로 다음 batch를 만든다.
+      n_queries[nxt] = fill_frontier(neighbors, &next, cluster_id, query_ids[nxt], 0);
+      if (n_queries[nxt] == 0)
+        break;
+      submit_queries(set, query_ids[nxt], n_queries[nxt], DPU_ASYNCHRONOUS);
+    }
+    cur = nxt;
+  }
+}
+
+// dpu_order 위치에 대한 disjoint set (path halving, 더 작은 위치가 root)
+uint32_t find_root(uint32_t *parent, uint32_t i) {
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+// DPU d가 낸 쌍의 MRAM 위치를 dpu_order 위치로 바꾼다. halo 위치는 그 점을 가진 tile의 위치가 된다.
+static inline uint32_t pair_position(uint32_t d, uint32_t local, const uint32_t *position_of) {
+  if (local < dpu_count[d])
+    return dpu_start[d] + local;
+  return position_of[halo_ids[halo_start[d] + local - HALO_BEGIN(dpu_count[d])]];
+}
+
+// 각 DPU가 자기 tile의 core 점을 묶은 결과(root)로 disjoint set을 채우고, DPU가 낸 쌍 중 halo를 넘는 core 쌍만
+// 합쳐 전체 cluster를 만든다. cluster 번호는 dbscan_cpu처럼 cluster에서 가장 앞선 core 점의 순서로 매긴다.
+// border 점은 이웃 core 점들의 cluster 중 가장 작은 번호를 받는데, cluster를 번호 순으로 끝까지 확장하는
+// dbscan_cpu가 border 점에 주는 번호도 이와 같다.
+int cluster_local(struct dpu_set_t set, uint32_t n_points) {
+  struct dpu_set_t dpu;
+  uint32_t each_dpu;
+  double start = wall_time();
+
+  uint32_t max_points_per_dpu = 0, max_halo = 0;
+  for (uint32_t d = 0; d < nr_dpus; d++) {
+    max_points_per_dpu = (dpu_count[d] > max_points_per_dpu) ? dpu_count[d] : max_points_per_dpu;
+    max_halo = (halo_count[d] > max_halo) ? halo_count[d] : max_halo;
+  }
+
+  // 다른 tile에 속한 halo 점의 core 여부는 host만 알고 있으므로 DPU별 bitmap으로 보낸다.
+  uint32_t halo_words = (max_halo + 63) / 64 * 2;
+  if (halo_words > 0) {
+    uint32_t *halo_bits = (uint32_t *)calloc((size_t)halo_words * nr_dpus, sizeof(uint32_t));
+    if (!halo_bits)
+      return 0;
+    for (uint32_t d = 0; d < nr_dpus; d++) {
+      for (uint32_t j = 0; j < halo_count[d]; j++) {
+        if (core_flags[halo_ids[halo_start[d] + j]])
+          halo_bits[(size_t)d * halo_words + j / 32] |= 1u << (j % 32);
       }
     }
+    double step = wall_time();
+    DPU_FOREACH(set, dpu, each_dpu) { DPU_ASSERT(dpu_prepare_xfer(dpu, &halo_bits[(size_t)each_dpu * halo_words])); }
+    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "mram_halo_core_bits", 0, sizeof(uint32_t) * halo_words,
+                             DPU_XFER_DEFAULT));
+    COUNT(bytes_to_dpu, sizeof(uint32_t) * halo_words * nr_dpus);
+    transfer_time += wall_time() - step;
+    free(halo_bits);
   }
+
+  uint32_t mode = KERNEL_LOCAL;
+  double step = wall_time();
+  DPU_ASSERT(dpu_broadcast_to(set, "kernel_mode", 0, &mode, sizeof(mode), DPU_XFER_DEFAULT));
+  COUNT(bytes_to_dpu, sizeof(mode) * nr_dpus);
+  transfer_time += wall_time() - step;
+  step = wall_time();
+  DPU_ASSERT(dpu_launch(set, DPU_SYNCHRONOUS));
+  launch_time += wall_time() - step;
+  nr_launches++;
+
+  QueryStatus *status = (QueryStatus *)malloc(sizeof(QueryStatus) * nr_dpus);
+  if (!status)
+    return 0;
+  step = wall_time();
+  DPU_FOREACH(set, dpu, each_dpu) { DPU_ASSERT(dpu_prepare_xfer(dpu, &status[each_dpu])); }
+  DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "status", 0, sizeof(QueryStatus), DPU_XFER_DEFAULT));
+  COUNT(bytes_from_dpu, sizeof(QueryStatus) * nr_dpus);
+  transfer_time += wall_time() - step;
+#ifdef DBSCAN_COUNTERS
+  collect_profile(set);
+#endif
+
+  uint64_t launch_cycles = 0;
+  uint32_t pair_words = 0;
+  for (uint32_t d = 0; d < nr_dpus; d++) {
+    if (!status[d].n_answered) {
+      fprintf(stderr, "DPU %u ran out of space for boundary pairs; use more DPUs or -m expand\n", d);
+      free(status);
+      return 0;
+    }
+    launch_cycles = (status[d].cycles > launch_cycles) ? status[d].cycles : launch_cycles;
+    dpu_cycles_sum += status[d].cycles;
+    pair_words = (status[d].neighbor_count > pair_words) ? status[d].neighbor_count : pair_words;
+  }
+  dpu_cycles_max += launch_cycles;
+
+  // 지역 root는 query launch가 쓰지 않는 mram_staging에 남아 있다.
+  uint32_t root_words = (max_points_per_dpu + 1) & ~1u;
+  uint32_t *roots = (uint32_t *)malloc(sizeof(uint32_t) * ((size_t)root_words * nr_dpus + 1));
+  uint32_t *pairs = (uint32_t *)malloc(sizeof(uint32_t) * ((size_t)pair_words * nr_dpus + 1));
+  uint32_t *parent = (uint32_t *)malloc(sizeof(uint32_t) * n_points);
+  uint32_t *position_of = (uint32_t *)malloc(sizeof(uint32_t) * n_points);
+  uint32_t *cluster_of = (uint32_t *)calloc(n_points, sizeof(uint32_t));
+  if (!roots || !pairs || !parent || !position_of || !cluster_of) {
+    free(status);
+    free(roots);
+    free(pairs);
+    free(parent);
+    free(position_of);
+    free(cluster_of);
+    return 0;
+  }
+  step = wall_time();
+  if (root_words > 0) {
+    DPU_FOREACH(set, dpu, each_dpu) { DPU_ASSERT(dpu_prepare_xfer(dpu, &roots[(size_t)each_dpu * root_words])); }
+    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "mram_staging", 0, sizeof(uint32_t) * root_words,
+                             DPU_XFER_DEFAULT));
+    COUNT(bytes_from_dpu, sizeof(uint32_t) * root_words * nr_dpus);
+  }
+  if (pair_words > 0) {
+    DPU_FOREACH(set, dpu, each_dpu) { DPU_ASSERT(dpu_prepare_xfer(dpu, &pairs[(size_t)each_dpu * pair_words])); }
+    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "mram_neighbors", 0, sizeof(uint32_t) * pair_words,
+                             DPU_XFER_DEFAULT));
+    COUNT(bytes_from_dpu, sizeof(uint32_t) * pair_words * nr_dpus);
+  }
+  transfer_time += wall_time() - step;
+  double merge_start = wall_time();
+  local_time = merge_start - start;
+
+  for (uint32_t pos = 0; pos < n_points; pos++)
+    position_of[dpu_order[pos]] = pos;
+  for (uint32_t d = 0; d < nr_dpus; d++) {
+    for (uint32_t i = 0; i < dpu_count[d]; i++)
+      parent[dpu_start[d] + i] = dpu_start[d] + roots[(size_t)d * root_words + i];
+  }
+
+  // core 점에서 나온 쌍은 DPU 경계를 넘는 core 쌍이다.
+  for (uint32_t d = 0; d < nr_dpus; d++) {
+    const uint32_t *list = &pairs[(size_t)d * pair_words];
+    for (uint32_t j = 0; j < status[d].neighbor_count; j += 2) {
+      uint32_t a = dpu_start[d] + list[j];
+      if (!core_flags[dpu_order[a]])
+        continue;
+      uint32_t ra = find_root(parent, a);
+      uint32_t rb = find_root(parent, pair_position(d, list[j + 1], position_of));
+      if (ra < rb)
+        parent[rb] = ra;
+      else if (rb < ra)
+        parent[ra] = rb;
+    }
+    nr_pairs += status[d].neighbor_count / 2;
+  }
+
+  uint32_t cluster_id = 0;
+  for (uint32_t i = 0; i < n_points; i++) {
+    if (!core_flags[i]) {
+      points[i].cluster = NOISE;
+      continue;
+    }
+    uint32_t root = find_root(parent, position_of[i]);
+    if (cluster_of[root] == 0)
+      cluster_of[root] = ++cluster_id;
+    points[i].cluster = cluster_of[root];
+  }
+
+  // core가 아닌 점에서 나온 쌍은 border 점과 이웃 core 점이다.
+  for (uint32_t d = 0; d < nr_dpus; d++) {
+    const uint32_t *list = &pairs[(size_t)d * pair_words];
+    for (uint32_t j = 0; j < status[d].neighbor_count; j += 2) {
+      uint32_t border = dpu_order[dpu_start[d] + list[j]];
+      if (core_flags[border])
+        continue;
+      int cluster = cluster_of[find_root(parent, pair_position(d, list[j + 1], position_of))];
+      if (points[border].cluster == NOISE || cluster < points[border].cluster)
+        points[border].cluster = cluster;
+    }
+  }
+  merge_time = wall_time() - merge_start;
+
+  free(status);
+  free(roots);
+  free(pairs);
+  free(parent);
+  free(position_of);
+  free(cluster_of);
+  return 1;
 }
 
 void dbscan(struct dpu_set_t set, uint32_t n_points) {
   int cluster_id = 0;
   IntVector *neighbors = create_int_vector(n_points);
-  IntVector *tmp_neighbors = create_int_vector(n_points);
+  QueryBatch *batch = create_query_batch();
   visited = (uint8_t *)calloc(n_points, sizeof(uint8_t));
 
-  if (!neighbors || !tmp_neighbors || !visited) {
+  if (!neighbors || !batch || !visited) {
     fprintf(stderr, "Failed to allocate memory for neighbors\n");
     exit(1);
   }
@@ -178,68 +1153,236 @@ void dbscan(struct dpu_set_t set, uint32_t n_points) {
     if (points[i].cluster != UNCLASSIFIED)
       continue;
     neighbors->size = 0;
-    uint32_t neighbor_count = get_neighbors_from_dpus(set, &points[i], n_points, neighbors);
+    if (core_flags && !core_flags[i]) {
+      points[i].cluster = NOISE;
+      continue;
+    }
+    get_neighbors_from_dpus(set, &i, 1, batch);
 
-    if (neighbor_count < min_pts) {
+    if (batch->totals[0] < min_pts) {
       points[i].cluster = NOISE;
     } else {
+      merge_neighbors(batch, 1, n_points, neighbors);
       visited[i] = 1;
       cluster_id++;
-      expand_cluster(set, n_points, i, cluster_id, neighbors, tmp_neighbors);
+      if (pipelined)
+        expand_cluster_pipelined(set, n_points, i, cluster_id, neighbors, batch);
+      else
+        expand_cluster(set, n_points, i, cluster_id, neighbors, batch);
     }
   }
-  free(neighbors);
-  free(tmp_neighbors);
+  free_int_vector(neighbors);
+  free_query_batch(batch);
+  free(visited);
+}
+
+void usage(const char *prog) {
+  printf("Usage: %s [-b batch_size] [-a] [-l kd|input] [-f 32|16] [-c on|off] [-m expand|local] [-u on|off] [-r none|morton|hilbert] [-o text|binary|mmap] [-e true_labels] <data_file> <eps> <min_pts> <output_prefix> "
+         "<nr_dpus>\n",
+         prog);
+  printf("  -b  region queries answered per DPU launch, 1..%d (default: %d), at most %d / d for the\n"
+         "      d-dimensional DPU program\n",
+         MAX_QUERIES, MAX_QUERIES, MAX_QUERY_COORDS);
+  printf("  -a  pipeline batches: launch batch k+1 asynchronously while merging batch k\n");
+  printf("  -l  point placement across DPUs: k-d spatial tiles or input order (default: kd)\n");
+  printf("  -f  MRAM coordinate width; 16 stores offsets from each DPU's box (default: 16 when it fits)\n");
+  printf("  -c  find core points on the DPUs first and query only core points (default: on)\n");
+  printf("  -m  expand clusters with region queries, or cluster each tile on its DPU and merge the\n"
+         "      boundaries on the host (local needs -c on; default: expand)\n");
+  printf("  -u  merge points with identical coordinates into weighted points before clustering (default: on)\n");
+  printf("  -r  sort the points along a space-filling curve before clustering (default: none, the input order)\n");
+  printf("  -o  labels file format: text, or int32 binary written directly or through mmap (default: text)\n");
+  printf("  -e  ground-truth labels file; ARI and NMI are added to the result file\n");
 }
 
 int main(int argc, char *argv[]) {
-  if (argc != 6) {
-    printf("Usage: %s <data_file> <eps> <min_pts> <output_prefix> <nr_dpus>\n", argv[0]);
+  int opt;
+  while ((opt = getopt(argc, argv, "b:al:f:c:m:u:r:o:e:")) != -1) {
+    switch (opt) {
+    case 'b':
+      batch_size = atoi(optarg);
+      if (batch_size < 1 || batch_size > MAX_QUERIES) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'a':
+      pipelined = 1;
+      break;
+    case 'l':
+      if (strcmp(optarg, "kd") == 0) {
+        kd_layout = 1;
+      } else if (strcmp(optarg, "input") == 0) {
+        kd_layout = 0;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'f':
+      if (strcmp(optarg, "32") == 0) {
+        point_format = POINT_FORMAT_32;
+      } else if (strcmp(optarg, "16") == 0) {
+        point_format = POINT_FORMAT_16;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'c':
+      if (strcmp(optarg, "on") == 0) {
+        core_phase = 1;
+      } else if (strcmp(optarg, "off") == 0) {
+        core_phase = 0;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'm':
+      if (strcmp(optarg, "expand") == 0) {
+        local_mode = 0;
+      } else if (strcmp(optarg, "local") == 0) {
+        local_mode = 1;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'u':
+      if (strcmp(optarg, "on") == 0) {
+        coalesce = 1;
+      } else if (strcmp(optarg, "off") == 0) {
+        coalesce = 0;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'r':
+      if (!parse_curve(optarg, &curve)) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'e':
+      true_labels_file = optarg;
+      break;
+    case 'o':
+      if (!parse_label_format(optarg, &label_format)) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 5 || (local_mode && !core_phase)) {
+    usage(argv[0]);
     return 1;
   }
 
-  char *data_file = argv[1];
-  int32_t eps = atoi(argv[2]);
-  min_pts = atoi(argv[3]);
-  char *output_prefix = argv[4];
-  nr_dpus = atoi(argv[5]);
+  char *data_file = argv[optind];
+  int32_t eps = atoi(argv[optind + 1]);
+  min_pts = atoi(argv[optind + 2]);
+  char *output_prefix = argv[optind + 3];
+  nr_dpus = atoi(argv[optind + 4]);
 
+  double load_start = wall_time();
   uint32_t n_points = load_data(data_file);
   if (n_points == 0) {
     return 1;
   }
+  // 차원이 큰 DPU 프로그램은 WRAM에 둘 수 있는 query가 적다.
+  uint32_t max_batch = DPU_MAX_QUERIES(dimensions);
+  batch_size = (batch_size > max_batch) ? max_batch : batch_size;
+  double placement_start = wall_time();
 
-  struct dpu_set_t set, dpu;
+  struct dpu_set_t set;
 
   DPU_ASSERT(dpu_alloc(nr_dpus, NULL, &set));
   // DPU_ASSERT(dpu_get_nr_dpus(set, &nr_dpus));
   // printf("Allocated %d DPU(s)\n", nr_dpus);
 
-  uint32_t points_per_dpu = n_points / nr_dpus; // 나누어 떨어진다는 가정
-
-  // printf("points_per_dpu %u\n", points_per_dpu);
+  eps_squared = (int64_t)eps * eps;
+  if (!partition_points(n_points) || (core_phase && !build_halos())) {
+    fprintf(stderr, "Failed to allocate memory for partitions\n");
+    return 1;
+  }
 
-  DPU_ASSERT(dpu_load(set, DPU_BINARY, NULL));
+  dpu_queries = (int32_t *)malloc(sizeof(int32_t) * dimensions * MAX_QUERIES * nr_dpus);
+  dpu_n_queries = (uint32_t *)calloc(nr_dpus, sizeof(uint32_t));
+  dpu_local_queries = (uint16_t *)malloc(sizeof(uint16_t) * MAX_QUERIES * nr_dpus);
+  if (!dpu_queries || !dpu_n_queries || !dpu_local_queries) {
+    fprintf(stderr, "Failed to allocate memory for DPU buffers\n");
+    return 1;
+  }
+#ifdef DBSCAN_COUNTERS
+  dpu_profiles = (DpuProfile *)malloc(sizeof(DpuProfile) * nr_dpus);
+  profile_cycles = (uint64_t *)calloc((size_t)nr_dpus * NR_PROFILE_PHASES, sizeof(uint64_t));
+  profile_busiest = (uint64_t *)calloc(nr_dpus, sizeof(uint64_t));
+  if (!dpu_profiles || !profile_cycles || !profile_busiest) {
+    fprintf(stderr, "Failed to allocate memory for DPU buffers\n");
+    return 1;
+  }
+#endif
 
-  DPU_ASSERT(dpu_broadcast_to(set, "n_points", 0, &points_per_dpu, 4, DPU_XFER_DEFAULT));
-  eps = eps * eps;
-  DPU_ASSERT(dpu_broadcast_to(set, "eps_squared", 0, &eps, 4, DPU_XFER_DEFAULT));
-  uint32_t each_dpu;
-  DPU_FOREACH(set, dpu, each_dpu) {
+  char dpu_binary[64];
+  snprintf(dpu_binary, sizeof(dpu_binary), DPU_BINARY_FORMAT, dimensions);
+  DPU_ASSERT(dpu_load(set, dpu_binary, NULL));
 
-    int start_idx = each_dpu * points_per_dpu;
-    DPU_ASSERT(dpu_prepare_xfer(dpu, &points[start_idx]));
+  if (!load_points_to_dpus(set, eps)) {
+    return 1;
   }
-  DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "mram_points", 0, points_per_dpu * sizeof(Point), DPU_XFER_DEFAULT));
+  double placement_time = wall_time() - placement_start;
+
+  HardwareCounters hardware;
+  start_hardware_counters(&hardware);
   struct timeval start_time, end_time;
   gettimeofday(&start_time, NULL);
-  dbscan(set, n_points);
+  if (core_phase && !detect_core_points(set, n_points)) {
+    fprintf(stderr, "Failed to allocate memory for core flags\n");
+    return 1;
+  }
+  if (local_mode) {
+    if (!cluster_local(set, n_points)) {
+      fprintf(stderr, "Local clustering failed\n");
+      return 1;
+    }
+  } else {
+    dbscan(set, n_points);
+  }
 
   gettimeofday(&end_time, NULL);
+  stop_hardware_counters(&hardware);
   double time_taken = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_usec - start_time.tv_usec) / 1e6;
 
   printf("total time = %lf\n", time_taken);
 
+  // 합친 점의 label을 그 점으로 합쳐진 모든 입력 점에 돌려준다.
+  int32_t *labels = (int32_t *)malloc(dataset.n_points * sizeof(int32_t) + 1);
+  if (!labels) {
+    fprintf(stderr, "Failed to allocate memory for labels\n");
+    return 1;
+  }
+  for (uint32_t i = 0; i < dataset.n_points; i++)
+    labels[i] = points[remapped ? unique.index[i] : i].cluster;
+
+  char labels_output_file[256];
+  snprintf(labels_output_file, sizeof(labels_output_file), "%s_%u_labels.%s", output_prefix, nr_dpus,
+           label_extension(label_format));
+  double labels_start = wall_time();
+  if (!write_labels(labels_output_file, labels, sizeof(int32_t), dataset.n_points, label_format, 0))
+    return 1;
+  double labels_time = wall_time() - labels_start;
+
+  Evaluation evaluation;
+  if (true_labels_file &&
+      !evaluate_against_file(true_labels_file, labels, sizeof(int32_t), dataset.n_points, 0, &evaluation))
+    return 1;
+
   char result_file[256];
   snprintf(result_file, sizeof(result_file), "%s_%u_result.txt", output_prefix, nr_dpus);
   FILE *result = fopen(result_file, "w");
@@ -248,24 +1391,101 @@ int main(int argc, char *argv[]) {
     return 1;
   }
   fprintf(result, "DBSCAN completed in %f seconds\n", time_taken);
-  fclose(result);
-
-  char labels_output_file[256];
-  snprintf(labels_output_file, sizeof(labels_output_file), "%s_%u_labels.txt", output_prefix, nr_dpus);
-  FILE *labels_output = fopen(labels_output_file, "w");
-  if (labels_output == NULL) {
-    printf("Error opening labels output file\n");
-    return 1;
+  fprintf(result, "Batch size: %u\n", batch_size);
+  fprintf(result, "Region queries: %lu in %lu DPU launches\n", (unsigned long)nr_queries, (unsigned long)nr_launches);
+  print_dataset_summary(result, &dataset);
+  fprintf(result, "Dimensions: %d (DPU program for %d)\n", input_dimensions, dimensions);
+  if (coalesce) {
+    fprintf(result, "Unique points: %u of %u, coalesced in %f seconds\n", unique.n_unique, dataset.n_points,
+            unique.seconds);
   }
-  for (uint32_t i = 0; i < n_points; i++) {
-    fprintf(labels_output, "%d\n", points[i].cluster);
+  fprintf(result, "Point order: %s", curve_name(curve));
+  if (curve != CURVE_NONE)
+    fprintf(result, ", sorted in %f seconds", unique.curve_seconds);
+  fprintf(result, "\n");
+  fprintf(result, "Layout: %s\n", kd_layout ? "kd" : "input");
+  fprintf(result, "Mode: %s\n", local_mode ? "local" : "expand");
+  fprintf(result, "MRAM point format: %s\n", point_format == POINT_FORMAT_16 ? "16-bit" : "32-bit");
+  fprintf(result, "DPUs per region query: %.2f of %u\n", nr_queries ? (double)nr_routed / nr_queries : 0.0, nr_dpus);
+  fprintf(result, "Pipelined: %s\n", pipelined ? "yes" : "no");
+  fprintf(result, "Labels: %s, written in %f seconds\n", label_format_name(label_format), labels_time);
+  if (core_phase) {
+    uint64_t n_halo = 0;
+    for (uint32_t d = 0; d < nr_dpus; d++)
+      n_halo += halo_count[d];
+    fprintf(result, "Core point detection: %f seconds, %u core points, %llu halo points\n", core_time, nr_core,
+            (unsigned long long)n_halo);
+  } else {
+    fprintf(result, "Core point detection: off\n");
   }
-  fclose(labels_output);
+  if (local_mode) {
+    fprintf(result, "Local clustering: %f seconds on DPUs, %f seconds merging %llu boundary pairs\n", local_time,
+            merge_time, (unsigned long long)nr_pairs);
+  }
+  fprintf(result, "Host waiting on DPUs: %f seconds\n", dpu_wait_time);
+  fprintf(result, "DPU kernel cycles: %llu (slowest DPU per launch), %.0f per DPU per launch\n",
+          (unsigned long long)dpu_cycles_max, nr_launches ? (double)dpu_cycles_sum / nr_launches / nr_dpus : 0.0);
+  if (pipelined) {
+    // DPU가 batch를 처리하는 동안 host가 병합으로 채운 비율
+    double busy = overlap_time + dpu_wait_time;
+    fprintf(result, "Host merge overlapped with DPU execution: %f seconds (%.1f%% of DPU wait)\n", overlap_time,
+            busy > 0 ? 100.0 * overlap_time / busy : 0.0);
+  }
+  // index는 점을 합치고 정렬해 DPU에 나누어 올리기까지이다 (처음 점을 보내는 복사는 transfer에도 들어간다).
+  PhaseTimes phases;
+  init_phase_times(&phases);
+  phases.seconds[PHASE_LOAD] = dataset.load_seconds;
+  phases.seconds[PHASE_INDEX] = placement_start - load_start - dataset.load_seconds + placement_time;
+  phases.seconds[PHASE_CORE] = core_phase ? core_time : -1.0;
+  phases.seconds[PHASE_EXPANSION] = time_taken - (core_phase ? core_time : 0.0);
+  phases.seconds[PHASE_TRANSFER] = transfer_time;
+  phases.seconds[PHASE_LAUNCH] = launch_time + dpu_wait_time;
+  phases.seconds[PHASE_OUTPUT] = labels_time;
+  print_phase_times(result, &phases, dataset.n_points);
+  print_counters(result, &hardware, 1);
+#ifdef DBSCAN_COUNTERS
+  print_profile(result);
+#endif
+  if (true_labels_file)
+    print_evaluation(result, true_labels_file, &evaluation);
+  fclose(result);
+#ifdef DBSCAN_COUNTERS
+  char profile_file[256];
+  snprintf(profile_file, sizeof(profile_file), "%s_%u_profile.csv", output_prefix, nr_dpus);
+  if (!write_profile(profile_file))
+    return 1;
+#endif
 
   printf("Results saved to %s\n", result_file);
   printf("Predicted labels saved to %s\n", labels_output_file);
+#ifdef DBSCAN_COUNTERS
+  printf("DPU profile saved to %s\n", profile_file);
+#endif
+  if (true_labels_file)
+    printf("ARI: %f, NMI: %f\n", evaluation.ari, evaluation.nmi);
 
   free(points);
+  free(labels);
+  if (point_coords != dataset.coords && point_coords != unique.coords)
+    free(point_coords);
+  free_coalesced_points(&unique);
+  free_dataset(&dataset);
+  free(dpu_order);
+  free(dpu_start);
+  free(dpu_count);
+  free(dpu_boxes);
+  free(halo_ids);
+  free(halo_start);
+  free(halo_count);
+  free(core_flags);
+  free(dpu_queries);
+  free(dpu_n_queries);
+  free(dpu_local_queries);
+#ifdef DBSCAN_COUNTERS
+  free(dpu_profiles);
+  free(profile_cycles);
+  free(profile_busiest);
+#endif
   DPU_ASSERT(dpu_free(set));
 
   return 0;
@@ -0,0 +1,229 @@
+#include "distance_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+const char *kernel_names[] = {"scalar", "avx2", "avx512"};
+
+// Dimensions with their own kernels. The loops over the axes are unrolled at compile time for these; any other
+// dimension uses the generic kernels, which read it from kernel_dimensions.
+static const int specialized_dims[] = {2, 3, 4, 8, 16};
+#define N_SPECIALIZED ((int)(sizeof(specialized_dims) / sizeof(specialized_dims[0])))
+
+static int kernel_dimensions;
+int kernel_specialized;
+CollectKernel collect_kernel;
+CountKernel count_kernel;
+// The kernel bodies take the dimension as a parameter and are always inlined, so each specialised wrapper below
+// compiles them with a constant dims.
+#define KERNEL_BODY static inline __attribute__((always_inline))
+
+// Squares are taken modulo 2^32 in every kernel so that all of them agree with each other.
+KERNEL_BODY uint32_t squared_offset(const int32_t *const *axes, uint32_t k, const int32_t *query, int dims) {
+  uint32_t sum = 0;
+  for (int a = 0; a < dims; a++) {
+    uint32_t diff = (uint32_t)axes[a][k] - (uint32_t)query[a];
+    sum += diff * diff;
+  }
+  return sum;
+}
+
+KERNEL_BODY uint32_t collect_scalar_body(const int32_t *const *axes, uint32_t begin, uint32_t end,
+                                         const int32_t *query, uint32_t eps_squared, uint32_t *out, int dims) {
+  uint32_t n = 0;
+  for (uint32_t k = begin; k < end; k++) {
+    if (squared_offset(axes, k, query, dims) <= eps_squared)
+      out[n++] = k;
+  }
+  return n;
+}
+
+KERNEL_BODY uint32_t count_scalar_body(const int32_t *const *axes, uint32_t begin, uint32_t end,
+                                       const int32_t *query, uint32_t eps_squared, uint32_t limit, int dims) {
+  uint32_t n = 0;
+  for (uint32_t k = begin; k < end && n < limit; k++) {
+    if (squared_offset(axes, k, query, dims) <= eps_squared)
+      n++;
+  }
+  return n;
+}
+
+#ifdef HAVE_X86_KERNELS
+// compress_lut[m] lists the set lanes of the 8-bit mask m first, so one permute packs the matching indices.
+static uint32_t compress_lut[256][8];
+
+void init_compress_lut(void) {
+  for (uint32_t m = 0; m < 256; m++) {
+    uint32_t n = 0;
+    for (uint32_t lane = 0; lane < 8; lane++) {
+      if (m & (1u << lane))
+        compress_lut[m][n++] = lane;
+    }
+    while (n < 8)
+      compress_lut[m][n++] = 0;
+  }
+}
+
+// AVX2 has no unsigned compare, so d <= eps_squared is tested as min(d, eps_squared) == d.
+__attribute__((target("avx2"))) KERNEL_BODY uint32_t match_mask_avx2(const int32_t *const *axes, uint32_t k,
+                                                                     const int32_t *query, __m256i eps_squared,
+                                                                     int dims) {
+  __m256i d = _mm256_setzero_si256();
+  for (int a = 0; a < dims; a++) {
+    __m256i diff = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(axes[a] + k)), _mm256_set1_epi32(query[a]));
+    d = _mm256_add_epi32(d, _mm256_mullo_epi32(diff, diff));
+  }
+  __m256i le = _mm256_cmpeq_epi32(_mm256_min_epu32(d, eps_squared), d);
+  return (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(le));
+}
+
+__attribute__((target("avx2"))) KERNEL_BODY uint32_t collect_avx2_body(const int32_t *const *axes, uint32_t begin,
+                                                                       uint32_t end, const int32_t *query,
+                                                                       uint32_t eps_squared, uint32_t *out,
+                                                                       int dims) {
+  const __m256i veps = _mm256_set1_epi32((int32_t)eps_squared);
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  uint32_t n = 0, k = begin;
+  for (; k + 8 <= end; k += 8) {
+    uint32_t mask = match_mask_avx2(axes, k, query, veps, dims);
+    if (mask) {
+      __m256i idx = _mm256_add_epi32(_mm256_set1_epi32((int32_t)k), lanes);
+      __m256i perm = _mm256_loadu_si256((const __m256i *)compress_lut[mask]);
+      _mm256_storeu_si256((__m256i *)(out + n), _mm256_permutevar8x32_epi32(idx, perm));
+      n += __builtin_popcount(mask);
+    }
+  }
+  return n + collect_scalar_body(axes, k, end, query, eps_squared, out + n, dims);
+}
+
+__attribute__((target("avx2"))) KERNEL_BODY uint32_t count_avx2_body(const int32_t *const *axes, uint32_t begin,
+                                                                     uint32_t end, const int32_t *query,
+                                                                     uint32_t eps_squared, uint32_t limit,
+                                                                     int dims) {
+  const __m256i veps = _mm256_set1_epi32((int32_t)eps_squared);
+  uint32_t n = 0, k = begin;
+  for (; k + 8 <= end; k += 8) {
+    n += __builtin_popcount(match_mask_avx2(axes, k, query, veps, dims));
+    if (n >= limit)
+      return n;
+  }
+  return n + count_scalar_body(axes, k, end, query, eps_squared, limit - n, dims);
+}
+
+// The tail of a run is handled with a lane mask instead of a scalar loop.
+__attribute__((target("avx512f"))) KERNEL_BODY __mmask16 match_mask_avx512(const int32_t *const *axes, uint32_t k,
+                                                                           uint32_t end, const int32_t *query,
+                                                                           __m512i eps_squared, int dims) {
+  __mmask16 live = (end - k >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (end - k)) - 1);
+  __m512i d = _mm512_setzero_si512();
+  for (int a = 0; a < dims; a++) {
+    __m512i diff = _mm512_sub_epi32(_mm512_maskz_loadu_epi32(live, axes[a] + k), _mm512_set1_epi32(query[a]));
+    d = _mm512_add_epi32(d, _mm512_mullo_epi32(diff, diff));
+  }
+  return _mm512_mask_cmple_epu32_mask(live, d, eps_squared);
+}
+
+__attribute__((target("avx512f"))) KERNEL_BODY uint32_t collect_avx512_body(const int32_t *const *axes,
+                                                                            uint32_t begin, uint32_t end,
+                                                                            const int32_t *query,
+                                                                            uint32_t eps_squared, uint32_t *out,
+                                                                            int dims) {
+  const __m512i veps = _mm512_set1_epi32((int32_t)eps_squared);
+  const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  uint32_t n = 0;
+  for (uint32_t k = begin; k < end; k += 16) {
+    __mmask16 mask = match_mask_avx512(axes, k, end, query, veps, dims);
+    if (mask) {
+      __m512i idx = _mm512_add_epi32(_mm512_set1_epi32((int32_t)k), lanes);
+      _mm512_mask_compressstoreu_epi32(out + n, mask, idx);
+      n += __builtin_popcount(mask);
+    }
+  }
+  return n;
+}
+
+__attribute__((target("avx512f"))) KERNEL_BODY uint32_t count_avx512_body(const int32_t *const *axes,
+                                                                          uint32_t begin, uint32_t end,
+                                                                          const int32_t *query,
+                                                                          uint32_t eps_squared, uint32_t limit,
+                                                                          int dims) {
+  const __m512i veps = _mm512_set1_epi32((int32_t)eps_squared);
+  uint32_t n = 0;
+  for (uint32_t k = begin; k < end; k += 16) {
+    n += __builtin_popcount(match_mask_avx512(axes, k, end, query, veps, dims));
+    if (n >= limit)
+      return n;
+  }
+  return n;
+}
+#endif
+
+// Defines collect_<isa>_<suffix> and count_<isa>_<suffix> for one dimension (a constant, or kernel_dimensions for the
+// generic pair).
+#define DEFINE_KERNELS(isa, target, suffix, dims)                                                                  \
+  target uint32_t collect_##isa##_##suffix(const int32_t *const *axes, uint32_t begin, uint32_t end,               \
+                                           const int32_t *query, uint32_t eps_squared, uint32_t *out) {            \
+    return collect_##isa##_body(axes, begin, end, query, eps_squared, out, dims);                                  \
+  }                                                                                                                \
+  target uint32_t count_##isa##_##suffix(const int32_t *const *axes, uint32_t begin, uint32_t end,                 \
+                                         const int32_t *query, uint32_t eps_squared, uint32_t limit) {             \
+    return count_##isa##_body(axes, begin, end, query, eps_squared, limit, dims);                                  \
+  }
+
+#define DEFINE_ALL_DIMENSIONS(isa, target)                                                                         \
+  DEFINE_KERNELS(isa, target, 2, 2)                                                                                \
+  DEFINE_KERNELS(isa, target, 3, 3)                                                                                \
+  DEFINE_KERNELS(isa, target, 4, 4)                                                                                \
+  DEFINE_KERNELS(isa, target, 8, 8)                                                                                \
+  DEFINE_KERNELS(isa, target, 16, 16)                                                                              \
+  DEFINE_KERNELS(isa, target, any, kernel_dimensions)                                                              \
+  static const CollectKernel collect_##isa[N_SPECIALIZED + 1] = {collect_##isa##_2, collect_##isa##_3,             \
+                                                                 collect_##isa##_4, collect_##isa##_8,             \
+                                                                 collect_##isa##_16, collect_##isa##_any};         \
+  static const CountKernel count_##isa[N_SPECIALIZED + 1] = {count_##isa##_2, count_##isa##_3, count_##isa##_4,    \
+                                                             count_##isa##_8, count_##isa##_16, count_##isa##_any};
+
+DEFINE_ALL_DIMENSIONS(scalar, )
+#ifdef HAVE_X86_KERNELS
+DEFINE_ALL_DIMENSIONS(avx2, __attribute__((target("avx2"))))
+DEFINE_ALL_DIMENSIONS(avx512, __attribute__((target("avx512f"))))
+#endif
+
+int select_kernels(int kind, int dimensions) {
+  int best = KERNEL_SCALAR;
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    best = KERNEL_AVX2;
+  if (__builtin_cpu_supports("avx512f"))
+    best = KERNEL_AVX512;
+  init_compress_lut();
+#endif
+  if (kind < 0)
+    kind = best;
+  if (kind > best)
+    return -1;
+
+  kernel_dimensions = dimensions;
+  int slot = N_SPECIALIZED;
+  for (int s = 0; s < N_SPECIALIZED; s++) {
+    if (specialized_dims[s] == dimensions)
+      slot = s;
+  }
+  kernel_specialized = slot < N_SPECIALIZED;
+
+  collect_kernel = collect_scalar[slot];
+  count_kernel = count_scalar[slot];
+#ifdef HAVE_X86_KERNELS
+  if (kind == KERNEL_AVX2) {
+    collect_kernel = collect_avx2[slot];
+    count_kernel = count_avx2[slot];
+  } else if (kind == KERNEL_AVX512) {
+    collect_kernel = collect_avx512[slot];
+    count_kernel = count_avx512[slot];
+  }
+#endif
+  return kind;
+}
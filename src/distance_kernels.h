@@ -0,0 +1,43 @@
+#ifndef DISTANCE_KERNELS_H
+#define DISTANCE_KERNELS_H
+
+// Neighbour search kernels over structure-of-arrays coordinates, shared by dbscan_cpu and dbscan_cpu_openmp. Every
+// instruction set (scalar, AVX2, AVX-512) has kernels unrolled for 2, 3, 4, 8 and 16 dimensions and a generic pair
+// for any other dimension. The kernels only read their arguments, so threads may call them concurrently.
+
+#include <stdint.h>
+
+#include "dataset.h"
+
+// Coordinates in structure-of-arrays form (axis[k] holds coordinate k of every point), stored in the order region
+// queries scan them (cell_points order for the grid, input order for brute force) so each scanned run is contiguous
+// and SIMD kernels load 8 or 16 candidates at once.
+typedef struct {
+  int32_t *axis[MAX_DIMENSIONS];
+  uint32_t *weight; // input points merged into each position (see CoalescedPoints), or NULL if all are 1
+} CoordArrays;
+
+typedef enum {
+  KERNEL_SCALAR,
+  KERNEL_AVX2,
+  KERNEL_AVX512,
+} KernelKind;
+
+extern const char *kernel_names[];
+
+// collect writes the positions k in [begin, end) within eps of query to out and returns how many there are; out
+// needs 16 spare slots past the last match. count stops as soon as it reaches limit.
+typedef uint32_t (*CollectKernel)(const int32_t *const *axes, uint32_t begin, uint32_t end, const int32_t *query,
+                                  uint32_t eps_squared, uint32_t *out);
+typedef uint32_t (*CountKernel)(const int32_t *const *axes, uint32_t begin, uint32_t end, const int32_t *query,
+                                uint32_t eps_squared, uint32_t limit);
+
+extern CollectKernel collect_kernel;
+extern CountKernel count_kernel;
+extern int kernel_specialized; // whether collect_kernel/count_kernel are unrolled for the selected dimension
+
+// Picks the requested kernel, or the widest one the CPU supports when kind < 0, in its variant for dimensions.
+// Returns the kernel in use, or -1 if the requested one is not available.
+int select_kernels(int kind, int dimensions);
+
+#endif
@@ -0,0 +1,288 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "evaluate.h"
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dataset.h"
+
+#define MIN_EVAL_SLICE (1u << 16) // fewer labels are not worth another thread
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Open-addressing map from a 64-bit key to a count; a slot with count 0 is free.
+typedef struct {
+  uint64_t *keys;
+  uint64_t *counts;
+  int bits; // capacity is 1 << bits
+  size_t size;
+} CountTable;
+
+static int table_init(CountTable *t, int bits) {
+  t->bits = bits;
+  t->size = 0;
+  t->keys = (uint64_t *)malloc(sizeof(uint64_t) << bits);
+  t->counts = (uint64_t *)calloc((size_t)1 << bits, sizeof(uint64_t));
+  return t->keys && t->counts;
+}
+
+static void table_free(CountTable *t) {
+  free(t->keys);
+  free(t->counts);
+  memset(t, 0, sizeof(*t));
+}
+
+static inline size_t table_slot(const CountTable *t, uint64_t key) {
+  return (size_t)((key * 0x9E3779B97F4A7C15ull) >> (64 - t->bits));
+}
+
+static int table_add(CountTable *t, uint64_t key, uint64_t count);
+
+// Doubles the capacity once the table is half full.
+static int table_grow(CountTable *t) {
+  CountTable old = *t;
+  if (!table_init(t, old.bits + 1)) {
+    table_free(t);
+    *t = old;
+    return 0;
+  }
+  for (size_t s = 0; s < (size_t)1 << old.bits; s++) {
+    if (old.counts[s])
+      table_add(t, old.keys[s], old.counts[s]);
+  }
+  table_free(&old);
+  return 1;
+}
+
+static int table_add(CountTable *t, uint64_t key, uint64_t count) {
+  size_t mask = ((size_t)1 << t->bits) - 1;
+  for (size_t s = table_slot(t, key);; s = (s + 1) & mask) {
+    if (t->counts[s] && t->keys[s] == key) {
+      t->counts[s] += count;
+      return 1;
+    }
+    if (!t->counts[s]) {
+      t->keys[s] = key;
+      t->counts[s] = count;
+      t->size++;
+      return t->size * 2 <= mask + 1 || table_grow(t);
+    }
+  }
+}
+
+static uint64_t table_get(const CountTable *t, uint64_t key) {
+  size_t mask = ((size_t)1 << t->bits) - 1;
+  for (size_t s = table_slot(t, key); t->counts[s]; s = (s + 1) & mask) {
+    if (t->keys[s] == key)
+      return t->counts[s];
+  }
+  return 0;
+}
+
+static inline uint64_t pair_key(int32_t truth, int32_t pred) {
+  return (uint64_t)(uint32_t)truth << 32 | (uint32_t)pred;
+}
+
+// One slice of the labels; each thread counts the (true, predicted) pairs of its slice into its own table.
+typedef struct {
+  const int32_t *truth;
+  const int32_t *pred;
+  size_t stride;
+  size_t begin, end;
+  CountTable cells;
+  int ok;
+} EvalSlice;
+
+static void *count_pairs(void *arg) {
+  EvalSlice *slice = (EvalSlice *)arg;
+  slice->ok = table_init(&slice->cells, 10);
+  if (!slice->ok || slice->begin == slice->end)
+    return NULL;
+  // Labels come in runs (clusters are numbered in input order and datasets are often grouped), so runs of the same
+  // pair are summed before touching the table.
+  uint64_t run_key = 0, run_length = 0;
+  for (size_t i = slice->begin; i < slice->end && slice->ok; i++) {
+    int32_t pred = *(const int32_t *)((const char *)slice->pred + i * slice->stride);
+    uint64_t key = pair_key(slice->truth[i], pred);
+    if (run_length && key != run_key) {
+      slice->ok = table_add(&slice->cells, run_key, run_length);
+      run_length = 0;
+    }
+    run_key = key;
+    run_length++;
+  }
+  if (slice->ok)
+    slice->ok = table_add(&slice->cells, run_key, run_length);
+  return NULL;
+}
+
+int evaluate_labels(const int32_t *truth, const int32_t *pred, size_t stride, uint32_t n_points, int n_threads,
+                    Evaluation *ev) {
+  double start = now();
+  memset(ev, 0, sizeof(*ev));
+  ev->n_points = n_points;
+  n_threads = thread_count(n_threads, n_points, MIN_EVAL_SLICE);
+  EvalSlice *slices = (EvalSlice *)calloc(n_threads, sizeof(EvalSlice));
+  if (!slices)
+    return 0;
+  for (int t = 0; t < n_threads; t++) {
+    slices[t].truth = truth;
+    slices[t].pred = pred;
+    slices[t].stride = stride;
+    slices[t].begin = (size_t)n_points * t / n_threads;
+    slices[t].end = (size_t)n_points * (t + 1) / n_threads;
+  }
+  run_tasks(slices, sizeof(EvalSlice), n_threads, count_pairs);
+
+  // Merge the per-thread cells into slice 0's table, then sum them into the row (true) and column (predicted)
+  // marginals.
+  CountTable rows = {0}, cols = {0};
+  int ok = table_init(&rows, 6) && table_init(&cols, 6);
+  for (int t = 0; t < n_threads; t++)
+    ok = ok && slices[t].ok;
+  CountTable *cells = &slices[0].cells;
+  for (int t = 1; t < n_threads && ok; t++) {
+    CountTable *local = &slices[t].cells;
+    for (size_t s = 0; s < (size_t)1 << local->bits && ok; s++) {
+      if (local->counts[s])
+        ok = table_add(cells, local->keys[s], local->counts[s]);
+    }
+  }
+  uint64_t sum_squares = 0, row_squares = 0, col_squares = 0;
+  double mutual_info = 0.0, true_entropy = 0.0, pred_entropy = 0.0;
+  double n = n_points;
+  for (size_t s = 0; ok && s < (size_t)1 << cells->bits; s++) {
+    uint64_t c = cells->counts[s];
+    if (!c)
+      continue;
+    sum_squares += c * c;
+    ok = table_add(&rows, cells->keys[s] >> 32, c) && table_add(&cols, cells->keys[s] & 0xFFFFFFFFu, c);
+  }
+  for (size_t s = 0; ok && s < (size_t)1 << rows.bits; s++) {
+    if (rows.counts[s]) {
+      row_squares += rows.counts[s] * rows.counts[s];
+      true_entropy -= rows.counts[s] / n * log(rows.counts[s] / n);
+    }
+  }
+  for (size_t s = 0; ok && s < (size_t)1 << cols.bits; s++) {
+    if (cols.counts[s]) {
+      col_squares += cols.counts[s] * cols.counts[s];
+      pred_entropy -= cols.counts[s] / n * log(cols.counts[s] / n);
+    }
+  }
+  // MI = sum over cells of n_ij/n * log(n * n_ij / (a_i * b_j)), with a_i and b_j looked up in the marginals.
+  for (size_t s = 0; ok && s < (size_t)1 << cells->bits; s++) {
+    uint64_t c = cells->counts[s];
+    if (!c)
+      continue;
+    uint64_t a = table_get(&rows, cells->keys[s] >> 32), b = table_get(&cols, cells->keys[s] & 0xFFFFFFFFu);
+    mutual_info += c / n * (log(c / n) - log(a / n) - log(b / n));
+  }
+
+  if (ok) {
+    ev->true_clusters = (uint32_t)rows.size;
+    ev->pred_clusters = (uint32_t)cols.size;
+    // Pair confusion counts over ordered pairs, as sklearn's pair_confusion_matrix.
+    double tp = (double)(sum_squares - n_points);
+    double fp = (double)(col_squares - sum_squares);
+    double fn = (double)(row_squares - sum_squares);
+    double tn = (double)((uint64_t)n_points * n_points - col_squares - row_squares + sum_squares);
+    ev->ari = fn == 0 && fp == 0 ? 1.0 : 2.0 * (tp * tn - fn * fp) / ((tp + fn) * (fn + tn) + (tp + fp) * (fp + tn));
+    if (rows.size == cols.size && rows.size <= 1)
+      ev->nmi = 1.0;
+    else if (mutual_info <= 0.0)
+      ev->nmi = 0.0;
+    else
+      ev->nmi = mutual_info / ((true_entropy + pred_entropy) / 2);
+  }
+  for (int t = 0; t < n_threads; t++)
+    table_free(&slices[t].cells);
+  table_free(&rows);
+  table_free(&cols);
+  free(slices);
+  ev->seconds = now() - start;
+  return ok;
+}
+
+int32_t *load_labels(const char *path, int n_threads, uint32_t *n_labels) {
+  size_t length = strlen(path);
+  if (length < 4 || strcmp(path + length - 4, ".bin") != 0) {
+    int columns;
+    int32_t *labels = load_points_csv(path, n_threads, n_labels, &columns);
+    if (labels && columns != 1) {
+      fprintf(stderr, "%s: expected one label per line\n", path);
+      free(labels);
+      return NULL;
+    }
+    return labels;
+  }
+
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror("Error opening labels file");
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+  size_t size = (size_t)st.st_size;
+  if (size % sizeof(int32_t) || size / sizeof(int32_t) > UINT32_MAX) {
+    fprintf(stderr, "%s: not a file of int32 labels\n", path);
+    close(fd);
+    return NULL;
+  }
+  int32_t *labels = (int32_t *)malloc(size > 0 ? size : 1);
+  if (!labels) {
+    fprintf(stderr, "Failed to allocate memory for labels\n");
+    close(fd);
+    return NULL;
+  }
+  for (size_t done = 0; done < size;) {
+    ssize_t got = read(fd, (char *)labels + done, size - done);
+    if (got <= 0) {
+      perror("Error reading labels file");
+      free(labels);
+      close(fd);
+      return NULL;
+    }
+    done += (size_t)got;
+  }
+  close(fd);
+  *n_labels = (uint32_t)(size / sizeof(int32_t));
+  return labels;
+}
+
+int evaluate_against_file(const char *truth_path, const int32_t *pred, size_t stride, uint32_t n_points,
+                          int n_threads, Evaluation *ev) {
+  uint32_t n_truth;
+  int32_t *truth = load_labels(truth_path, n_threads, &n_truth);
+  if (!truth)
+    return 0;
+  if (n_truth != n_points) {
+    fprintf(stderr, "%s: %u labels for %u points\n", truth_path, n_truth, n_points);
+    free(truth);
+    return 0;
+  }
+  int ok = evaluate_labels(truth, pred, stride, n_points, n_threads, ev);
+  if (!ok)
+    fprintf(stderr, "Failed to allocate memory for evaluation\n");
+  free(truth);
+  return ok;
+}
+
+void print_evaluation(FILE *out, const char *truth_path, const Evaluation *ev) {
+  fprintf(out, "Evaluated against %s in %f seconds (%u true labels, %u predicted labels)\n", truth_path, ev->seconds,
+          ev->true_clusters, ev->pred_clusters);
+  fprintf(out, "NMI: %f\n", ev->nmi);
+  fprintf(out, "ARI: %f\n", ev->ari);
+}
@@ -0,0 +1,37 @@
+#ifndef EVALUATE_H
+#define EVALUATE_H
+
+// Clustering quality against ground-truth labels, shared by the DBSCAN programs and evaluate_labels.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct {
+  double ari; // adjusted Rand index
+  double nmi; // normalized mutual information, arithmetic mean of the entropies
+  uint32_t n_points;
+  uint32_t true_clusters; // distinct labels in each labelling (noise counts as one label, as in sklearn)
+  uint32_t pred_clusters;
+  double seconds;
+} Evaluation;
+
+// Reads a labels file: raw int32 values if the name ends in ".bin" (dbscan_* -o binary|mmap), otherwise one integer
+// per line. Returns the labels, or NULL after printing the reason.
+int32_t *load_labels(const char *path, int n_threads, uint32_t *n_labels);
+
+// Scores pred against truth from their contingency table, which n_threads threads (0: one per online CPU) build
+// with one hash table each. Predicted label i is the int32_t stride bytes after label i - 1, as in write_labels.
+// Matches sklearn's adjusted_rand_score and normalized_mutual_info_score. Returns 0 if memory runs out.
+int evaluate_labels(const int32_t *truth, const int32_t *pred, size_t stride, uint32_t n_points, int n_threads,
+                    Evaluation *ev);
+
+// Loads the ground truth from truth_path and evaluates pred against it. Returns 0 after printing the reason if the
+// file cannot be read or holds a different number of labels.
+int evaluate_against_file(const char *truth_path, const int32_t *pred, size_t stride, uint32_t n_points,
+                          int n_threads, Evaluation *ev);
+
+// Writes the evaluation lines of a result file, ending with "ARI: <value>".
+void print_evaluation(FILE *out, const char *truth_path, const Evaluation *ev);
+
+#endif
@@ -0,0 +1,28 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "evaluate.h"
+
+// Scores a labels file written by one of the DBSCAN programs against the ground truth, without going through Python.
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    printf("Usage: %s <true_labels_file> <pred_labels_file>\n", argv[0]);
+    printf("  files ending in .bin hold int32 labels (dbscan_* -o binary|mmap), others one label per line\n");
+    return 1;
+  }
+
+  uint32_t n_points;
+  int32_t *pred = load_labels(argv[2], 0, &n_points);
+  if (!pred)
+    return 1;
+  Evaluation evaluation;
+  if (!evaluate_against_file(argv[1], pred, sizeof(int32_t), n_points, 0, &evaluation)) {
+    free(pred);
+    return 1;
+  }
+  print_evaluation(stdout, argv[1], &evaluation);
+  free(pred);
+  return 0;
+}